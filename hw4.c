@@ -1,22 +1,70 @@
+#define _GNU_SOURCE // allows for use of O_DIRECT
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <time.h>
 #include <string.h>
-#include <arpa/inet.h> // allows for use of htons()
+#include <stddef.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <signal.h>
+#include <sched.h>
+#include <fnmatch.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h> // SSE4.2 crc32 instructions
+#elif defined(__aarch64__)
+#include <arm_acle.h> // ARMv8 crc32 instructions
+#include <sys/auxv.h>
+#endif
 
 #define DISK_NAME "FileSystem.bin"
+// every structure below is little-endian on disk and is read and written in place, through
+// pointers into the loaded disk or by copying it whole, so the host has to be little-endian too
+// (x86 and ARM are); mbr_t.version changes whenever the layout does, and --migrate brings an
+// older image up to date
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the disk structures are little-endian and accessed in place"
+#endif
+#define FS_MAGIC 0x46345748 // "HW4F"
+#define FS_VERSION 4 // 0: unversioned, big-endian timestamps; 1: no free_count; 2: a free_hint where generation is; 3: no stripes
+
 // structure to store Master Boot Record information
 typedef struct __attribute__ ((__packed__)) {
-	uint16_t sector_size; // bytes ( >= 64 bytes)
-	uint16_t cluster_size; // number of sectors (at least 1 sector/cluster) 
+	uint16_t sector_size; // bytes, a power of two ( >= 64 bytes)
+	uint16_t cluster_size; // number of sectors, a power of two (at least 1 sector/cluster) 
 	uint16_t disk_size; // size of disk in clusters
 	uint16_t fat_start;
 	uint16_t fat_length; // number of clusters
 	uint16_t data_start; 
 	uint16_t data_length; // clusters
-	char disk_name[32];
+	char disk_name[22];
+	uint16_t stripe_count; // files the data area is striped across, 0 if it is in this file
+	uint16_t stripe_unit; // clusters of a stripe unit
+	uint32_t magic; // FS_MAGIC, 0 on an unversioned image
+	uint16_t version; // FS_VERSION of the layout
+	uint16_t cow_start; // first cluster of the snapshot area, 0xFFFF until a snapshot is taken
+	uint16_t crc_start; // first cluster of the checksum table, 0xFFFF if the disk has none
+	uint16_t crc_length; // clusters
+	uint32_t crc_table; // CRC32C of the checksum table
+	uint16_t free_count; // free data clusters, kept in step with the FAT by fat_set
+	uint16_t generation; // bumped before an operation first writes the FAT, see fat_checkpoint_t
+	uint32_t crc_mbr; // CRC32C of the MBR up to this field
 } mbr_t;
+_Static_assert(sizeof(mbr_t) <= 64, "the MBR has to fit in the smallest cluster, 64 bytes");
 
 // structure to store directory or file
 typedef struct __attribute__ ((__packed__)) {
@@ -26,7 +74,7 @@ typedef struct __attribute__ ((__packed__)) {
 	uint8_t name_len;
 	char name[16];
 	uint32_t size;
-	uint16_t children_count; // keep track of the number of children
+	uint16_t children_count; // keep track of the number of children, for a file its FILE_ flags
 } entry_t;
 
 // structure to store pointer to another directory or file
@@ -36,425 +84,7658 @@ typedef struct __attribute__ ((__packed__)) {
 	uint16_t start;
 } entry_ptr_t;
 
+// a file's entry_t is alone in the first cluster of the file, its data follows in the FAT chain
+// a compressed file is split into CHUNK_BYTES chunks compressed on their own, and the chunk map
+// after its entry_t says how much of the chain each chunk takes, so any chunk can be read alone
+// a sparse file keeps a run map there instead: the chain only holds the clusters inside a run,
+// the others are holes that read as zeros and take no space
+#define FILE_COMPRESSED 1
+#define FILE_SPARSE 2
+#define CHUNK_BYTES 65536
+
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t bytes; // stored length, 0 if the chunk was never written and reads as zeros
+	uint16_t clusters; // clusters of the chain it takes, after those of the chunks before it
+	uint8_t raw; // 1 if it didn't shrink and is stored as it is
+	uint8_t reserved;
+} chunk_t;
+
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t first; // clusters first to first + count - 1 of the file are in the chain, in order
+	uint32_t count; // 0 past the last run
+} run_t;
+
+// header of the snapshot area, a FAT chain of clusters starting at mbr_t.cow_start
+// it is followed by a cow_t for every data cluster and then by the snapshot_t records
+typedef struct __attribute__ ((__packed__)) {
+	uint16_t root; // cluster of the live root directory, it moves when the root is copied
+	uint16_t generation; // stamped on every cluster allocated from now on
+	uint16_t snapshot_count;
+	uint16_t snapshot_generation; // generation of the newest snapshot, older clusters may be shared
+} cow_header_t;
+
+// reference count and allocation generation of a data cluster
+typedef struct __attribute__ ((__packed__)) {
+	uint16_t refs; // slots, links, FAT entries and roots pointing to the cluster
+	uint16_t birth;
+} cow_t;
+
+// a read-only snapshot of the whole volume
+typedef struct __attribute__ ((__packed__)) {
+	char name[16];
+	uint16_t root; // root directory as it was when the snapshot was taken
+	uint16_t generation;
+} snapshot_t;
+
+// free space of a group of data clusters, those whose FAT entries share a FAT page
+typedef struct __attribute__ ((__packed__)) {
+	uint16_t free;
+	uint16_t head; // free clusters at the start of the group
+	uint16_t tail; // and at its end
+	uint16_t longest; // longest run of free clusters in the group
+} fat_group_t;
+
+// checkpoint of the allocation summary, in cluster 0 right after the MBR and followed by a
+// fat_group_t for every group; it describes the FAT only while its generation is the MBR's
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t crc; // CRC32C of the rest of the checkpoint, groups included
+	uint16_t generation;
+	uint16_t groups;
+	uint16_t free_hint; // no data cluster below it is free, find_free_cluster starts there
+	uint16_t largest_start; // longest run of free clusters on the disk, 0xFFFF if there is none
+	uint16_t largest_length;
+	uint16_t reserved;
+} fat_checkpoint_t;
+
+// geometry of a disk, worked out once from its MBR
+typedef struct {
+	int cluster_bytes; // 0 until a disk is loaded
+	int cluster_shift; // log2 of cluster_bytes
+	int cluster_mask; // cluster_bytes - 1
+	off_t data_offset; // byte offset of the data area
+} geometry_t;
+
+// called by fs_walk for every entry below the directory it starts from, with the handle to open
+// or read the entry, the handle of its directory and its depth, 1 for the children of the first one
+// it runs on the walk's threads while fs_lock is held, so it must not call the fs_ functions
+// returning 1 for a directory skips what's below it, returning -1 ends the walk
+typedef int (*walk_fn)(entry_t *entry, int handle, int parent, int depth, void *arg);
+
+// totals fs_du adds up below a directory
+typedef struct {
+	uint64_t files;
+	uint64_t directories;
+	uint64_t bytes; // sizes of the files
+	uint64_t clusters; // clusters the files and directories take, a shared one counts for each
+} du_t;
+
+// free space of the disk, read from the allocation summary
+typedef struct {
+	int clusters; // data clusters
+	int free;
+	int largest_start; // first cluster of the longest run of free clusters, -1 if none is free
+	int largest_length;
+	int groups; // groups the summary keeps, FAT_PAGE_ENTRIES clusters each
+} space_t;
+
 // ****************************** global variables ***********************//
 // variables filled when load_disk function is called
 mbr_t *MBR_memory; 
-uint16_t *FAT_memory;
 uint8_t *DATA_memory;  
+geometry_t geo; // geometry of the disk last loaded, kept after unload_disk to count cluster I/O
+cow_header_t *COW_header; // snapshot area, NULL until the first snapshot is taken
+cow_t *COW_memory;
+snapshot_t *SNAP_memory;
+uint32_t *CRC_memory; // checksum table, the FAT's CRC32C and then one per data cluster, NULL on a disk without one
+uint64_t *dedup_key; // dedup key of each data cluster, 0 if not known, NULL until deduplication is first used
+int dedup_length; // data clusters dedup_key covers
 // **********************************************************************//
 
-// ************************** linked list related functions *************//
-// structures and functions associated with linked lists
-// linked list is used to store a path (parameter of fs_opendir)
-typedef struct node {
-	char *dir;
-	struct node *next;
-} node_t;
+// public operations, each wraps the do_ function of the same name with its statistics
+void format(uint16_t sector_size, uint16_t cluster_size, uint16_t disk_size);
+entry_t *fs_ls(int dh, int child_num);
+int fs_mkdir(int dh, char* child_name);
+int fs_opendir(char *absolute_path);
+int fs_fsck(int repair, int nthreads);
+int fs_walk(int dh, walk_fn fn, void *arg, int nthreads);
+int fs_du(int dh, du_t *du, int nthreads);
+int fs_find(int dh, char *pattern, int *handles, int max, int nthreads);
+int fs_migrate();
+int fs_space(space_t *space);
+int fs_defrag(uint64_t slice_ns);
+int fs_rmdir(int dh, char *child_name);
+int fs_unlink(int dh, char *child_name);
+int fs_rename(char *old_path, char *new_path);
+int fs_snapshot(char *name);
+int fs_snapshot_delete(char *name);
+int fs_snapshot_ls(int n, snapshot_t *snapshot);
+int fs_snapshot_opendir(char *snapshot, char *absolute_path);
+int fs_create(int dh, char *name, int flags);
+int fs_open(int dh, char *name);
+int fs_read(int fh, void *buf, int len, uint32_t offset);
+int fs_write(int fh, void *buf, int len, uint32_t offset);
+int64_t fs_seek_data(int fh, uint32_t offset);
+int64_t fs_seek_hole(int fh, uint32_t offset);
+int fs_sendfile(int fh, int out_fd, uint32_t offset, int len);
+int fs_dedup(uint64_t slice_ns);
+void fs_reclaim_wait();
+void fs_sync();
+void fs_io_class(int class);
 
-// insert at end of list
-// e.g /root/OS/hw yields root->OS->hw->null
-void insert(node_t **headRef, char* dir) {
-	node_t *newNode = (node_t *)malloc(sizeof(node_t));
-	newNode->dir = dir;
-	newNode->next = NULL;
-	if (*headRef == NULL) {
-		*headRef = newNode;
-	} else {
-		node_t *current = *headRef;
-		while (current->next != NULL) {
-			current = current->next;
+// what the write-back cache holds for a file, for the operations that come before its functions
+uint32_t wb_size(int fh, uint32_t size);
+uint8_t *wb_data(int fh, uint32_t k);
+void wb_drop(int fh);
+
+// the shared mount, for the scheduler and the block cache that come before its functions
+void shm_acquire();
+void shm_release();
+int shm_cache_init();
+int shm_cache_free();
+
+// held by every public operation and by each reclaim batch, they all share the globals above
+// it is taken and released through io_lock and io_unlock, see the scheduler functions
+pthread_mutex_t fs_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+
+// ************************** statistics related functions **************//
+// every thread counts into its own fs_stats_t with relaxed atomic adds, so counting never
+// contends between threads and is cheap enough to leave on; fs_stats() sums all threads
+#define LATENCY_BUCKETS 32 // bucket i counts calls that took [2^i, 2^(i+1)) nanoseconds
+
+enum { OP_FORMAT, OP_MKDIR, OP_OPENDIR, OP_LS, OP_FSCK, OP_DEFRAG, OP_RMDIR, OP_UNLINK, OP_RENAME, OP_SNAPSHOT, OP_SNAPSHOT_DELETE,
+	OP_CREATE, OP_OPEN, OP_READ, OP_WRITE, OP_SEEK, OP_SENDFILE, OP_DEDUP, OP_WALK, OP_MIGRATE, OP_SPACE, OP_SYNC, OP_COUNT };
+const char *op_names[OP_COUNT] = { "format", "fs_mkdir", "fs_opendir", "fs_ls", "fs_fsck", "fs_defrag", "fs_rmdir", "fs_unlink", "fs_rename",
+	"fs_snapshot", "fs_snapshot_delete", "fs_create", "fs_open", "fs_read", "fs_write", "fs_seek", "fs_sendfile", "fs_dedup", "fs_walk", "fs_migrate", "fs_space", "fs_sync" };
+
+// priority classes of the scheduler, the thread's class applies to everything it does
+enum { IO_FOREGROUND, IO_BACKGROUND, IO_CLASSES };
+const char *io_class_names[IO_CLASSES] = { "foreground", "background" };
+
+typedef struct fs_stats {
+	uint64_t calls[OP_COUNT];
+	uint64_t latency[OP_COUNT][LATENCY_BUCKETS];
+	uint64_t cluster_reads; // clusters read or written through the disk I/O functions
+	uint64_t cluster_writes;
+	uint64_t bytes_read; // bytes moved between the disk and memory
+	uint64_t bytes_written;
+	uint64_t fat_scans; // calls to find_free_cluster
+	uint64_t fat_scan_length; // FAT entries examined by those calls
+	uint64_t cache_hits; // block cache, direct mode only
+	uint64_t cache_misses;
+	uint64_t lookups; // path components resolved by fs_opendir
+	uint64_t lookup_entries; // directory entries visited while resolving them
+	uint64_t reclaim_batches; // batches run by the reclaim thread
+	uint64_t clusters_reclaimed; // clusters those batches returned to the FAT
+	uint64_t clusters_copied; // shared clusters copied before a write
+	uint64_t checksum_errors; // clusters, FATs and MBRs read back with the wrong CRC32C
+	uint64_t chunks_compressed; // chunks of compressed files written
+	uint64_t compress_in; // bytes of those chunks, and what was stored for them
+	uint64_t compress_out;
+	uint64_t send_zero_copy; // bytes fs_sendfile moved inside the kernel
+	uint64_t send_copied; // and through a buffer
+	uint64_t send_extents; // runs of neighbouring clusters it moved at once
+	uint64_t clusters_deduped; // file clusters given back because another file ended in the same ones
+	uint64_t dedup_hashed; // clusters hashed to find them
+	uint64_t dedup_ns; // time spent looking
+	uint64_t walk_entries; // entries fs_walk passed to its callback
+	uint64_t walk_steals; // directories a walk thread took from another's deque
+	uint64_t fat_faults; // FAT pages read in on first touch
+	uint64_t fat_evictions; // clean FAT pages dropped to stay within FAT_BUDGET
+	uint64_t fat_rebuilds; // times the free space was counted from the FAT rather than taken from the checkpoint
+	uint64_t wb_buffered; // bytes fs_write left in the write-back cache
+	uint64_t wb_written; // bytes written back from it
+	uint64_t wb_dropped; // bytes of removed files dropped from it before they were written back
+	uint64_t class_holds[IO_CLASSES]; // times each class took fs_lock through io_lock
+	uint64_t class_latency[IO_CLASSES][LATENCY_BUCKETS]; // from asking for fs_lock to letting it go
+	uint64_t io_aged; // background requests let in ahead of foreground ones after waiting IO_STARVE_NS
+	uint64_t io_yields; // times background work let waiting foreground operations in
+	uint64_t write_requests; // disk_write calls and blocks written back by the block cache
+	uint64_t write_calls; // system calls they went out in, after merging neighbours
+	uint64_t fsd_connections; // accepted by the server
+	uint64_t fsd_requests; // it ran
+	uint64_t fsd_batches; // runs of them under one io_lock
+	uint64_t stripe_transfers; // reads and writes split across the stripe files
+	uint64_t stripe_parallel; // of those, the ones whose files were read or written at once
+	struct fs_stats *next; // next thread in stats_threads
+} fs_stats_t;
+
+fs_stats_t *stats_threads = NULL; // counters of every thread that has counted anything
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread fs_stats_t *thread_stats = NULL;
+
+// counters of the calling thread, registered on first use and kept after the thread exits
+fs_stats_t *local_stats() {
+	if (thread_stats == NULL) {
+		thread_stats = (fs_stats_t *)calloc(1, sizeof(fs_stats_t));
+		pthread_mutex_lock(&stats_lock);
+		thread_stats->next = stats_threads;
+		stats_threads = thread_stats;
+		pthread_mutex_unlock(&stats_lock);
+	}
+	return thread_stats;
+}
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&local_stats()->field, (n), __ATOMIC_RELAXED)
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// count a call to an operation and return its start time for op_end
+uint64_t op_begin(int op) {
+	STAT_ADD(calls[op], 1);
+	return now_ns();
+}
+
+// latency bucket of a call that took elapsed nanoseconds
+int latency_bucket(uint64_t elapsed) {
+	int bucket = 0;
+	while (elapsed > 1 && bucket < LATENCY_BUCKETS - 1) {
+		elapsed >>= 1;
+		bucket++;
+	}
+	return bucket;
+}
+
+// add the time since op_begin to the latency histogram of an operation
+void op_end(int op, uint64_t start) {
+	STAT_ADD(latency[op][latency_bucket(now_ns() - start)], 1);
+}
+
+// sum the counters of every thread
+fs_stats_t fs_stats() {
+	fs_stats_t total;
+	memset(&total, 0, sizeof(fs_stats_t));
+	pthread_mutex_lock(&stats_lock);
+	fs_stats_t *t;
+	for (t = stats_threads; t != NULL; t = t->next) {
+		uint64_t *src = (uint64_t *)t;
+		uint64_t *dst = (uint64_t *)&total;
+		size_t i;
+		for (i = 0; i < offsetof(fs_stats_t, next) / sizeof(uint64_t); i++) {
+			dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
 		}
-		current->next = newNode;
 	}
+	pthread_mutex_unlock(&stats_lock);
+	return total;
 }
 
-// given a directory, find the next directory in the list
-char *get_next_dir(node_t **headRef, char* current_dir) {
-	if (*headRef == NULL) return NULL;
-	node_t *current = *headRef;
-	while (current->next != NULL) {
-		if (strcmp(current->dir, current_dir) == 0) {
-			return current->next->dir;
+// upper bound, in nanoseconds, of the bucket of a latency histogram holding the given fraction of its count calls
+uint64_t histogram_percentile(const uint64_t *histogram, uint64_t count, double fraction) {
+	uint64_t seen = 0;
+	int bucket;
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += histogram[bucket];
+		if (seen > 0 && seen >= fraction * count) break;
+	}
+	return (uint64_t)2 << bucket;
+}
+
+// the same for the calls of an operation
+uint64_t latency_percentile(fs_stats_t *stats, int op, double fraction) {
+	return histogram_percentile(stats->latency[op], stats->calls[op], fraction);
+}
+
+// the same for the time a priority class held fs_lock, waiting for it included
+uint64_t class_percentile(fs_stats_t *stats, int class, double fraction) {
+	return histogram_percentile(stats->class_latency[class], stats->class_holds[class], fraction);
+}
+
+void print_stats(fs_stats_t *stats) {
+	printf("*********** stats *****************\n");
+	int op, bucket;
+	for (op = 0; op < OP_COUNT; op++) {
+		if (stats->calls[op] == 0) continue;
+		printf("%s: %llu calls, p50 < %llu ns, p99 < %llu ns\n", op_names[op], (unsigned long long)stats->calls[op],
+			(unsigned long long)latency_percentile(stats, op, 0.50), (unsigned long long)latency_percentile(stats, op, 0.99));
+		for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+			if (stats->latency[op][bucket] == 0) continue;
+			printf("  [%llu, %llu) ns: %llu\n", (unsigned long long)1 << bucket, (unsigned long long)2 << bucket,
+				(unsigned long long)stats->latency[op][bucket]);
 		}
-		current = current->next;
+	}
+	printf("cluster reads %llu, cluster writes %llu\n", (unsigned long long)stats->cluster_reads, (unsigned long long)stats->cluster_writes);
+	printf("bytes read %llu, bytes written %llu\n", (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written);
+	printf("FAT scans %llu, FAT entries scanned %llu\n", (unsigned long long)stats->fat_scans, (unsigned long long)stats->fat_scan_length);
+	printf("cache hits %llu, cache misses %llu\n", (unsigned long long)stats->cache_hits, (unsigned long long)stats->cache_misses);
+	printf("lookups %llu, directory entries visited %llu (%.2f per lookup)\n", (unsigned long long)stats->lookups,
+		(unsigned long long)stats->lookup_entries, stats->lookups ? (double)stats->lookup_entries / stats->lookups : 0.0);
+	printf("reclaim batches %llu, clusters reclaimed %llu\n", (unsigned long long)stats->reclaim_batches, (unsigned long long)stats->clusters_reclaimed);
+	printf("clusters copied on write %llu\n", (unsigned long long)stats->clusters_copied);
+	printf("checksum errors %llu\n", (unsigned long long)stats->checksum_errors);
+	printf("chunks compressed %llu, %llu bytes stored as %llu (%.2fx)\n", (unsigned long long)stats->chunks_compressed,
+		(unsigned long long)stats->compress_in, (unsigned long long)stats->compress_out,
+		stats->compress_out ? (double)stats->compress_in / stats->compress_out : 0.0);
+	printf("sendfile: %llu bytes in the kernel, %llu through a buffer, %llu extents\n", (unsigned long long)stats->send_zero_copy,
+		(unsigned long long)stats->send_copied, (unsigned long long)stats->send_extents);
+	printf("clusters deduplicated %llu, clusters hashed %llu in %.3f ms\n", (unsigned long long)stats->clusters_deduped,
+		(unsigned long long)stats->dedup_hashed, stats->dedup_ns / 1e6);
+	printf("walk entries %llu, directories stolen %llu\n", (unsigned long long)stats->walk_entries, (unsigned long long)stats->walk_steals);
+	printf("FAT page faults %llu, FAT pages evicted %llu, free space recounted %llu times\n", (unsigned long long)stats->fat_faults,
+		(unsigned long long)stats->fat_evictions, (unsigned long long)stats->fat_rebuilds);
+	printf("write-back: %llu bytes buffered, %llu written back, %llu dropped\n", (unsigned long long)stats->wb_buffered,
+		(unsigned long long)stats->wb_written, (unsigned long long)stats->wb_dropped);
+	int class;
+	for (class = 0; class < IO_CLASSES; class++) {
+		if (stats->class_holds[class] == 0) continue;
+		printf("%s: fs_lock held %llu times, p50 < %llu ns, p99 < %llu ns waiting included\n", io_class_names[class],
+			(unsigned long long)stats->class_holds[class], (unsigned long long)class_percentile(stats, class, 0.50),
+			(unsigned long long)class_percentile(stats, class, 0.99));
+	}
+	printf("background let in after waiting %llu times, yielded %llu times\n", (unsigned long long)stats->io_aged,
+		(unsigned long long)stats->io_yields);
+	printf("writes: %llu requests sent in %llu system calls\n", (unsigned long long)stats->write_requests,
+		(unsigned long long)stats->write_calls);
+	printf("server: %llu connections, %llu requests in %llu batches\n", (unsigned long long)stats->fsd_connections,
+		(unsigned long long)stats->fsd_requests, (unsigned long long)stats->fsd_batches);
+	printf("stripes: %llu transfers split across files, %llu of them in parallel\n", (unsigned long long)stats->stripe_transfers,
+		(unsigned long long)stats->stripe_parallel);
+}
+// **************** end statistics functions *****************//
+
+// ************************** trace related functions *******************//
+// compiled in with -DFS_TRACE: every operation and every internal I/O records a begin and an
+// end event into a ring buffer owned by the calling thread, only the owner writes its ring so
+// recording takes no locks, and trace_dump writes all rings as Chrome trace-event JSON
+#ifdef FS_TRACE
+#define TRACE_EVENTS 65536 // events kept per thread, older events are overwritten
+
+typedef struct {
+	const char *name;
+	char phase; // 'B' begin or 'E' end
+	uint64_t ts; // nanoseconds
+} trace_event_t;
+
+typedef struct trace_ring {
+	trace_event_t events[TRACE_EVENTS];
+	uint64_t head; // number of events ever recorded, published with release ordering
+	int tid;
+	struct trace_ring *next;
+} trace_ring_t;
+
+trace_ring_t *trace_rings = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+int trace_threads = 0;
+__thread trace_ring_t *thread_ring = NULL;
+
+void trace_event(const char *name, char phase) {
+	if (thread_ring == NULL) {
+		thread_ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+		pthread_mutex_lock(&trace_lock);
+		thread_ring->tid = ++trace_threads;
+		thread_ring->next = trace_rings;
+		trace_rings = thread_ring;
+		pthread_mutex_unlock(&trace_lock);
+	}
+	uint64_t head = thread_ring->head;
+	trace_event_t *e = &thread_ring->events[head % TRACE_EVENTS];
+	e->name = name;
+	e->phase = phase;
+	e->ts = now_ns();
+	__atomic_store_n(&thread_ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// write every recorded event to path, load it in chrome://tracing or Perfetto
+void trace_dump(char *path) {
+	FILE *out = fopen(path, "w");
+	if (out == NULL) {
+		printf("trace_dump: unable to open %s\n", path);
+		return;
+	}
+	fprintf(out, "{\"traceEvents\":[");
+	int first = 1;
+	pthread_mutex_lock(&trace_lock);
+	trace_ring_t *ring;
+	for (ring = trace_rings; ring != NULL; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+		for (; i < head; i++) {
+			trace_event_t *e = &ring->events[i % TRACE_EVENTS];
+			fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+				first ? "" : ",", e->name, e->phase, e->ts / 1000.0, (int)getpid(), ring->tid);
+			first = 0;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+	fprintf(out, "\n]}\n");
+	fclose(out);
+}
+
+#define TRACE_BEGIN(name) trace_event(name, 'B')
+#define TRACE_END(name) trace_event(name, 'E')
+#else
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+#endif
+// **************** end trace functions *****************//
+
+// ************************** scheduler related functions ***************//
+// every operation takes fs_lock through io_lock, and its disk I/O runs under it, so the lock is
+// where work of different priority competes; a thread's work is in the foreground class unless
+// it's background work (the reclaim and write-back threads, or a thread fs_io_class put there,
+// such as one running a defrag)
+// a background request isn't let past the gate while foreground ones are waiting or running,
+// unless it has waited IO_STARVE_NS, and at most io_depth[class] requests of a class are past the
+// gate at once, the others wait in it; background work holding the lock for long calls io_yield
+// between units of work, letting the foreground operations that came in meanwhile go first
+#define IO_STARVE_NS 50000000ULL
+
+int IO_SCHED = 1; // 0 takes fs_lock first come, first served
+int io_depth[IO_CLASSES] = { 16, 1 };
+int io_waiting[IO_CLASSES]; // at the gate
+int io_admitted[IO_CLASSES]; // past it, holding fs_lock or waiting for it
+pthread_mutex_t io_gate = PTHREAD_MUTEX_INITIALIZER; // nothing else is taken while it's held
+pthread_cond_t io_turn = PTHREAD_COND_INITIALIZER;
+__thread int io_class = IO_FOREGROUND;
+__thread int io_held = 0; // io_lock calls of this thread not yet undone by io_unlock
+__thread int io_held_class = -1; // class it was let in as, -1 if it didn't pass the gate
+__thread uint64_t io_entered; // when it asked for fs_lock
+
+// put the calling thread's operations in a priority class, IO_FOREGROUND or IO_BACKGROUND
+void fs_io_class(int class) {
+	io_class = class == IO_BACKGROUND ? IO_BACKGROUND : IO_FOREGROUND;
+}
+
+// 1 while a request of the class that came in at since has to wait, io_gate must be held
+int io_blocked(int class, uint64_t since) {
+	if (io_admitted[class] >= io_depth[class]) return 1;
+	if (class != IO_BACKGROUND || io_waiting[IO_FOREGROUND] + io_admitted[IO_FOREGROUND] == 0) return 0;
+	if (now_ns() - since < IO_STARVE_NS) return 1;
+	STAT_ADD(io_aged, 1);
+	return 0;
+}
+
+// take fs_lock once the scheduler lets the calling thread's class in, calls may be nested
+void io_lock() {
+	if (io_held++ > 0) {
+		pthread_mutex_lock(&fs_lock);
+		return;
+	}
+	io_entered = now_ns();
+	io_held_class = -1;
+	if (IO_SCHED) {
+		int class = io_class;
+		pthread_mutex_lock(&io_gate);
+		io_waiting[class]++;
+		while (io_blocked(class, io_entered)) {
+			if (class == IO_FOREGROUND) {
+				pthread_cond_wait(&io_turn, &io_gate);
+				continue;
+			}
+			// a background request wakes up in time to stop waiting
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			uint64_t left = io_entered + IO_STARVE_NS - now_ns();
+			if (left > IO_STARVE_NS) left = 0;
+			until.tv_sec += (until.tv_nsec + left) / 1000000000;
+			until.tv_nsec = (until.tv_nsec + left) % 1000000000;
+			pthread_cond_timedwait(&io_turn, &io_gate, &until);
+		}
+		io_waiting[class]--;
+		io_admitted[class]++;
+		io_held_class = class;
+		pthread_mutex_unlock(&io_gate);
+	}
+	TRACE_BEGIN("fs_lock_wait");
+	pthread_mutex_lock(&fs_lock);
+	TRACE_END("fs_lock_wait");
+	shm_acquire();
+}
+
+// release fs_lock, the outermost call lets the next request past the gate
+void io_unlock() {
+	if (io_held == 1) shm_release();
+	pthread_mutex_unlock(&fs_lock);
+	if (--io_held > 0) return;
+	int class = io_held_class != -1 ? io_held_class : io_class;
+	if (io_held_class != -1) {
+		pthread_mutex_lock(&io_gate);
+		io_admitted[io_held_class]--;
+		pthread_cond_broadcast(&io_turn);
+		pthread_mutex_unlock(&io_gate);
+	}
+	STAT_ADD(class_holds[class], 1);
+	STAT_ADD(class_latency[class][latency_bucket(now_ns() - io_entered)], 1);
+}
+
+// 1 if the calling thread holds fs_lock as background work and foreground operations are
+// waiting for it, time sliced work ends its slice early then
+int io_preempted() {
+	if (io_held == 0 || io_held_class != IO_BACKGROUND) return 0;
+	pthread_mutex_lock(&io_gate);
+	int waiting = io_waiting[IO_FOREGROUND] + io_admitted[IO_FOREGROUND];
+	pthread_mutex_unlock(&io_gate);
+	return waiting > 0;
+}
+
+// from background work holding fs_lock once and with no disk loaded: let the foreground
+// operations that are waiting go first
+void io_yield() {
+	if (io_held != 1 || !io_preempted()) return;
+	STAT_ADD(io_yields, 1);
+	io_unlock();
+	io_lock();
+}
+// **************** end scheduler functions *****************//
+
+// ************************** geometry related functions ****************//
+// sector and cluster sizes are powers of two, so load_disk works out the geometry of the disk once
+// and a cluster number turns into a byte offset or an address with a shift instead of a multiply
+// the disk structures are used in place, the few fields read from raw bytes go through le16
+int disk_migrating = 0; // set while --migrate loads an image of an older version
+
+// log2 of n, or -1 if n isn't a power of two
+int log2_exact(uint32_t n) {
+	if (n == 0 || (n & (n - 1)) != 0) return -1;
+	return __builtin_ctz(n);
+}
+
+// 1 if a disk can have these sector and cluster sizes
+int geometry_valid(uint32_t sector_size, uint32_t cluster_size) {
+	return sector_size >= 64 && log2_exact(sector_size) != -1 && log2_exact(cluster_size) != -1;
+}
+
+// little-endian 16-bit field at p, which needn't be aligned; a plain load on a little-endian host
+uint16_t le16(const void *p) {
+	uint16_t v;
+	memcpy(&v, p, sizeof(uint16_t));
+	return v;
+}
+
+// fill geo from the MBR of the disk being loaded, returns -1 if it can't be loaded
+int geometry_init(mbr_t *mbr) {
+	if (!geometry_valid(mbr->sector_size, mbr->cluster_size)) {
+		printf("load_disk: sector size %d and cluster size %d aren't powers of two\n", mbr->sector_size, mbr->cluster_size);
+		return -1;
+	}
+	if (!disk_migrating && (mbr->magic != FS_MAGIC || mbr->version != FS_VERSION)) {
+		printf("load_disk: %s has on-disk format version %d, this is version %d; run --migrate to update it\n", DISK_NAME,
+			mbr->magic == FS_MAGIC ? mbr->version : 0, FS_VERSION);
+		return -1;
+	}
+	geo.cluster_shift = log2_exact(mbr->sector_size) + log2_exact(mbr->cluster_size);
+	geo.cluster_bytes = 1 << geo.cluster_shift;
+	geo.cluster_mask = geo.cluster_bytes - 1;
+	geo.data_offset = (off_t)mbr->data_start << geo.cluster_shift;
+	return 0;
+}
+
+// byte offset on disk of a data cluster
+off_t cluster_offset(int cluster) {
+	return geo.data_offset + ((off_t)cluster << geo.cluster_shift);
+}
+
+// address of a data cluster in the data area held in memory
+uint8_t *cluster_memory(int cluster) {
+	return DATA_memory + ((size_t)cluster << geo.cluster_shift);
+}
+// **************** end geometry functions *****************//
+
+// ************************** checksum related functions ****************//
+// a disk formatted with CHECKSUMS set keeps a CRC32C of the FAT and of every data cluster in a
+// table between the FAT and the data area, and the MBR holds the CRC32C of the table and of itself
+// load_disk checks the MBR, FAT and table, a data cluster is checked the first time the process
+// reads it, and in direct mode each block as it comes into the cache; disk_write only marks what
+// it touched: unload_disk recomputes those checksums once per operation
+// CRC32C uses the SSE4.2 or ARMv8 crc32 instructions when the CPU has them, slicing-by-8 otherwise
+#define CRC32C_POLY 0x82F63B78 // Castagnoli polynomial, reflected
+
+int CHECKSUMS = 0; // set by --checksums, format then creates the checksum table
+int crc_verify = 1; // 0 while fsck runs, it checks and reports checksums itself
+uint8_t *crc_dirty; // data clusters written during this operation, their checksums are stale
+uint64_t *crc_checked = NULL; // data clusters already checked, kept from one operation to the next
+int crc_checked_length = 0;
+uint32_t crc_checked_table; // mbr_t.crc_table when crc_checked was last valid
+int crc_fat_dirty; // the FAT was written during this operation
+int crc_pending; // anything was written during this operation
+
+uint32_t crc32c_table[8][256];
+uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *buf, size_t len);
+pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+uint32_t crc32c_slicing8(uint32_t crc, const uint8_t *buf, size_t len) {
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xFF] ^ crc32c_table[6][(v >> 8) & 0xFF] ^
+			crc32c_table[5][(v >> 16) & 0xFF] ^ crc32c_table[4][(v >> 24) & 0xFF] ^
+			crc32c_table[3][(v >> 32) & 0xFF] ^ crc32c_table[2][(v >> 40) & 0xFF] ^
+			crc32c_table[1][(v >> 48) & 0xFF] ^ crc32c_table[0][v >> 56];
+		buf += 8;
+		len -= 8;
+	}
+#endif
+	while (len-- > 0) crc = crc32c_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t *buf, size_t len) {
+	uint64_t c = crc;
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		c = _mm_crc32_u8((uint32_t)c, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		c = _mm_crc32_u64(c, v);
+		buf += 8;
+		len -= 8;
+	}
+	while (len-- > 0) c = _mm_crc32_u8((uint32_t)c, *buf++);
+	return (uint32_t)c;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+uint32_t crc32c_hardware(uint32_t crc, const uint8_t *buf, size_t len) {
+	while (len > 0 && ((uintptr_t)buf & 7) != 0) {
+		crc = __crc32cb(crc, *buf++);
+		len--;
+	}
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		crc = __crc32cd(crc, v);
+		buf += 8;
+		len -= 8;
+	}
+	while (len-- > 0) crc = __crc32cb(crc, *buf++);
+	return crc;
+}
+#endif
+
+// 1 if this CPU has crc32 instructions for CRC32C
+int crc32c_hardware_available() {
+#if defined(__x86_64__)
+	return __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__)
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+	return 0;
+#endif
+}
+
+// fill the slicing-by-8 tables and pick the implementation
+void crc32c_init() {
+	int i, k;
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (k = 0; k < 8; k++) crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++) crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+	}
+	crc32c_update = crc32c_slicing8;
+#if defined(__x86_64__) || defined(__aarch64__)
+	if (crc32c_hardware_available()) crc32c_update = crc32c_hardware;
+#endif
+}
+
+uint32_t crc32c(const void *buf, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return ~crc32c_update(0xFFFFFFFF, (const uint8_t *)buf, len);
+}
+
+// check a data cluster just read against the table, a cluster written during this operation is
+// skipped until its checksum is recomputed; returns 0 on a mismatch
+int crc_check(int cluster, const uint8_t *data) {
+	if (crc_dirty[cluster] || crc32c(data, geo.cluster_bytes) == CRC_memory[1 + cluster]) return 1;
+	STAT_ADD(checksum_errors, 1);
+	if (crc_verify) printf("checksum mismatch in data cluster %d\n", cluster);
+	return 0;
+}
+
+// check a data cluster of the data area in memory unless an earlier operation already did, so a
+// mounted disk isn't checked whole on every operation; a bad one is reported once, fsck finds all
+void crc_first_read(int cluster) {
+	if (CRC_memory == NULL || DATA_memory == NULL || !crc_verify || cluster >= crc_checked_length) return;
+	uint64_t bit = (uint64_t)1 << (cluster % 64);
+	if (__atomic_load_n(&crc_checked[cluster / 64], __ATOMIC_RELAXED) & bit) return;
+	crc_check(cluster, cluster_memory(cluster));
+	__atomic_fetch_or(&crc_checked[cluster / 64], bit, __ATOMIC_RELAXED);
+}
+
+// note that a write touched these bytes, see crc_flush
+void crc_touch(off_t offset, size_t len) {
+	int first = offset >> geo.cluster_shift;
+	int last = (offset + len - 1) >> geo.cluster_shift;
+	int i;
+	crc_pending = 1;
+	for (i = first; i <= last; i++) {
+		if (i >= MBR_memory->fat_start && i < MBR_memory->fat_start + MBR_memory->fat_length) crc_fat_dirty = 1;
+		else if (i >= MBR_memory->data_start && i < MBR_memory->data_start + MBR_memory->data_length) crc_dirty[i - MBR_memory->data_start] = 1;
+	}
+}
+// **************** end checksum functions *****************//
+
+// ************************** striping related functions ****************//
+// a disk formatted with STRIPES set keeps its MBR, FAT and checksum table in FileSystem.bin and
+// its data area in FileSystem.bin.0 to FileSystem.bin.n-1, mbr_t.stripe_unit clusters to each in
+// turn; any of them can be a symbolic link to a file on another disk
+// the disk I/O functions keep using offsets into the disk as if it were one file and these turn a
+// transfer into a request per file: the units a file holds of a run of the disk follow each other
+// in the file, so its share is one preadv or pwritev, and once a transfer is STRIPE_PARALLEL_BYTES
+// the files are read or written at the same time, a thread each
+#define STRIPE_MAX 16
+#define STRIPE_PARALLEL_BYTES (256 * 1024)
+
+int STRIPES = 0; // set by --stripes, format then stripes the data area across that many files
+int STRIPE_UNIT = 16; // clusters of a stripe unit, set by --stripe-unit
+
+// layout of the open disk, taken from its MBR by disk_open
+int stripe_count = 0; // 0 if the data area is in the disk file
+off_t stripe_unit_bytes;
+off_t stripe_data_offset; // where the data area starts in the disk, and its length
+off_t stripe_data_bytes;
+
+// one file's share of a transfer: bytes that follow each other in the file, to or from the
+// pieces of every stripe_count-th unit of the buffers
+typedef struct {
+	int fd;
+	off_t at;
+	struct iovec *iov;
+	int n;
+	int write;
+	int failed;
+} stripe_job_t;
+
+// name of stripe file i of the disk
+void stripe_name(char *name, int i) {
+	sprintf(name, "%s.%d", DISK_NAME, i);
+}
+
+// take the layout of the disk from its MBR, returns the number of stripe files or -1 if it can't be read
+int stripe_layout(mbr_t *mbr) {
+	stripe_count = 0;
+	if (mbr->magic != FS_MAGIC || mbr->version < 4 || mbr->stripe_count == 0) return 0;
+	if (mbr->stripe_count > STRIPE_MAX || mbr->stripe_unit == 0 || !geometry_valid(mbr->sector_size, mbr->cluster_size)) {
+		printf("disk_open: %s has %d stripes of %d clusters, at most %d of at least 1 can be read\n", DISK_NAME,
+			mbr->stripe_count, mbr->stripe_unit, STRIPE_MAX);
+		return -1;
+	}
+	int shift = log2_exact(mbr->sector_size) + log2_exact(mbr->cluster_size);
+	stripe_count = mbr->stripe_count;
+	stripe_unit_bytes = (off_t)mbr->stripe_unit << shift;
+	stripe_data_offset = (off_t)mbr->data_start << shift;
+	stripe_data_bytes = (off_t)mbr->data_length << shift;
+	return stripe_count;
+}
+
+// open the stripe files of the disk into fds, returns -1 with none of them open if one can't be
+int stripe_open(int *fds, int flags) {
+	char name[sizeof(DISK_NAME) + 16];
+	int i;
+	for (i = 0; i < stripe_count; i++) {
+		stripe_name(name, i);
+		fds[i] = open(name, flags);
+		if (fds[i] == -1 && (flags & O_DIRECT) && errno == EINVAL) fds[i] = open(name, flags & ~O_DIRECT);
+		if (fds[i] == -1) {
+			printf("disk_open: unable to open %s\n", name);
+			while (i-- > 0) close(fds[i]);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void stripe_close(int *fds) {
+	int i;
+	for (i = 0; i < stripe_count; i++) close(fds[i]);
+}
+
+// find where len bytes at offset of the disk are: *file is the stripe file the first of them are
+// in, -1 for the disk file and -2 past the end of the data area, and *at their offset in it
+// returns how many of the bytes follow each other there
+size_t stripe_extent(off_t offset, size_t len, int *file, off_t *at) {
+	if (stripe_count == 0 || offset < stripe_data_offset) {
+		*file = -1;
+		*at = offset;
+		if (stripe_count == 0 || offset + (off_t)len <= stripe_data_offset) return len;
+		return stripe_data_offset - offset;
+	}
+	off_t from = offset - stripe_data_offset;
+	if (from >= stripe_data_bytes) {
+		*file = -2;
+		*at = 0;
+		return len;
+	}
+	off_t unit = from / stripe_unit_bytes;
+	off_t in_unit = from % stripe_unit_bytes;
+	*file = unit % stripe_count;
+	*at = unit / stripe_count * stripe_unit_bytes + in_unit;
+	off_t n = stripe_unit_bytes - in_unit;
+	if (n > stripe_data_bytes - from) n = stripe_data_bytes - from;
+	return (off_t)len < n ? len : (size_t)n;
+}
+
+// move one file's share, IOV_MAX buffers at a time; past the end of the file it reads zeros
+void *stripe_run(void *arg) {
+	stripe_job_t *job = (stripe_job_t *)arg;
+	off_t at = job->at;
+	int i, k;
+	for (i = 0; i < job->n; i += IOV_MAX) {
+		int count = job->n - i < IOV_MAX ? job->n - i : IOV_MAX;
+		size_t want = 0;
+		for (k = i; k < i + count; k++) want += job->iov[k].iov_len;
+		ssize_t m = job->write ? pwritev(job->fd, job->iov + i, count, at) : preadv(job->fd, job->iov + i, count, at);
+		if (!job->write && m >= 0 && (size_t)m < want) {
+			size_t skip = m;
+			for (k = i; k < i + count; k++) {
+				size_t n = skip < job->iov[k].iov_len ? skip : job->iov[k].iov_len;
+				memset((uint8_t *)job->iov[k].iov_base + n, 0, job->iov[k].iov_len - n);
+				skip -= n;
+			}
+		} else if (m != (ssize_t)want) {
+			job->failed = 1;
+		}
+		at += want;
 	}
 	return NULL;
 }
 
-// find length of the linked list
-int get_length(node_t **headRef) {
-	if (*headRef == NULL) return 0;
-	node_t *current = *headRef;
-	int count = 0;
-	while (current->next != NULL) {
-		count++;
-		current = current->next;
+// read or write the n buffers of iov one after another from offset of the disk, whose disk file is
+// fd and stripe files fds; past the end of the data area the bytes read as zeros and aren't written
+// returns the number of bytes moved, or -1 if a file couldn't be read or written
+ssize_t stripe_transfer(int fd, int *fds, int write, const struct iovec *iov, int n, off_t offset) {
+	size_t total = 0;
+	int i;
+	for (i = 0; i < n; i++) total += iov[i].iov_len;
+	int file;
+	off_t at;
+	if (stripe_extent(offset, total, &file, &at) == total && file != -2) {
+		int f = file == -1 ? fd : fds[file];
+		return write ? pwritev(f, iov, n, at) : preadv(f, iov, n, at);
 	}
-	return count;
+	STAT_ADD(stripe_transfers, 1);
+
+	// cut the buffers where the files change, counting each file's pieces first and then filling them in
+	stripe_job_t jobs[STRIPE_MAX + 1]; // the disk file's share is the last
+	int counts[STRIPE_MAX + 1];
+	memset(jobs, 0, sizeof(jobs));
+	memset(counts, 0, sizeof(counts));
+	struct iovec *pieces = NULL;
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			int used = 0;
+			for (i = 0; i <= STRIPE_MAX; i++) used += counts[i];
+			pieces = (struct iovec *)malloc(sizeof(struct iovec) * (used > 0 ? used : 1));
+			for (i = 0, used = 0; i <= STRIPE_MAX; i++) {
+				jobs[i].iov = pieces + used;
+				used += counts[i];
+			}
+		}
+		int k = 0;
+		size_t in_iov = 0, left = total;
+		off_t pos = offset;
+		while (left > 0) {
+			size_t len = stripe_extent(pos, left, &file, &at);
+			stripe_job_t *job = &jobs[file == -1 ? STRIPE_MAX : file < 0 ? 0 : file];
+			if (pass == 1 && file != -2 && job->n == 0) {
+				job->fd = file == -1 ? fd : fds[file];
+				job->at = at;
+				job->write = write;
+			}
+			size_t piece = len;
+			while (piece > 0) {
+				size_t take = iov[k].iov_len - in_iov < piece ? iov[k].iov_len - in_iov : piece;
+				uint8_t *base = (uint8_t *)iov[k].iov_base + in_iov;
+				if (file == -2) {
+					if (pass == 1 && !write) memset(base, 0, take);
+				} else if (pass == 0) {
+					counts[file == -1 ? STRIPE_MAX : file]++;
+				} else if (take > 0) {
+					job->iov[job->n].iov_base = base;
+					job->iov[job->n].iov_len = take;
+					job->n++;
+				}
+				in_iov += take;
+				piece -= take;
+				if (in_iov == iov[k].iov_len) {
+					k++;
+					in_iov = 0;
+				}
+			}
+			pos += len;
+			left -= len;
+		}
+	}
+
+	// this thread takes the first file once a thread is started for each of the others
+	int active = 0;
+	for (i = 0; i <= STRIPE_MAX; i++) active += jobs[i].n > 0;
+	int parallel = active > 1 && total >= STRIPE_PARALLEL_BYTES;
+	if (parallel) STAT_ADD(stripe_parallel, 1);
+	pthread_t threads[STRIPE_MAX + 1];
+	int started[STRIPE_MAX + 1];
+	int first = -1;
+	for (i = 0; i <= STRIPE_MAX; i++) {
+		started[i] = 0;
+		if (jobs[i].n == 0) continue;
+		if (parallel && first == -1) first = i;
+		else if (parallel && pthread_create(&threads[i], NULL, stripe_run, &jobs[i]) == 0) started[i] = 1;
+		else stripe_run(&jobs[i]);
+	}
+	if (first != -1) stripe_run(&jobs[first]);
+	int failed = 0;
+	for (i = 0; i <= STRIPE_MAX; i++) {
+		if (started[i]) pthread_join(threads[i], NULL);
+		failed |= jobs[i].failed;
+	}
+	free(pieces);
+	return failed ? -1 : (ssize_t)total;
 }
 
-// free the memory used by a list
-void empty_list(node_t **headRef) {
-	node_t *current = *headRef;
-	if (current->next == NULL) {
-		free(current);
-	} else {
-		while (current->next != NULL) {
-			node_t *temp = current;
-			current = current->next;
-			free(temp);
+ssize_t stripe_pread(int fd, int *fds, void *buf, size_t len, off_t offset) {
+	struct iovec iov = { buf, len };
+	return stripe_transfer(fd, fds, 0, &iov, 1, offset);
+}
+
+ssize_t stripe_pwrite(int fd, int *fds, const void *buf, size_t len, off_t offset) {
+	struct iovec iov = { (void *)buf, len };
+	return stripe_transfer(fd, fds, 1, &iov, 1, offset);
+}
+
+// punch a hole in len bytes at offset of the disk, file by file; returns -1 if the host can't
+int stripe_punch(int fd, int *fds, off_t offset, size_t len) {
+	while (len > 0) {
+		int file;
+		off_t at;
+		size_t n = stripe_extent(offset, len, &file, &at);
+		if (file != -2 && fallocate(file == -1 ? fd : fds[file], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, n) != 0) return -1;
+		offset += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// create the stripe files of a disk format just wrote the MBR of, the first with root in its first
+// cluster; stripe files an earlier format left past the last one are removed
+void stripe_create(mbr_t *mbr, uint8_t *root) {
+	char name[sizeof(DISK_NAME) + 16];
+	int cluster_size_bytes = mbr->sector_size * mbr->cluster_size;
+	off_t unit_bytes = (off_t)mbr->stripe_unit * cluster_size_bytes;
+	off_t units = mbr->stripe_count == 0 ? 0 : (mbr->data_length + mbr->stripe_unit - 1) / mbr->stripe_unit;
+	int i;
+	for (i = 0; i < mbr->stripe_count; i++) {
+		stripe_name(name, i);
+		int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || ftruncate(fd, (units - i + mbr->stripe_count - 1) / mbr->stripe_count * unit_bytes) != 0 ||
+			(i == 0 && pwrite(fd, root, cluster_size_bytes, 0) != cluster_size_bytes)) {
+			printf("format: unable to create %s\n", name);
 		}
+		if (fd != -1) close(fd);
+	}
+	for (i = mbr->stripe_count; i < STRIPE_MAX; i++) {
+		stripe_name(name, i);
+		unlink(name);
+	}
+}
+// **************** end striping functions *****************//
+
+// ************************** disk I/O related functions ****************//
+// every read and write of the disk goes through disk_read and disk_write, and from there through
+// the striping functions to the disk file or the stripe files holding its bytes
+// buffered mode (the default) uses pread/pwrite and relies on the kernel page cache
+// direct mode (--direct) opens the disk with O_DIRECT so the kernel page cache is bypassed,
+// and the block cache below is the only copy of the disk held in memory
+// a striped disk goes through the block cache in buffered mode too, with the page cache under it:
+// its data area can't be mapped in one piece the way load_disk maps that of a disk file
+// writes reach the disk when the outermost disk_close is called, sorted by offset and with
+// neighbours merged into one pwritev: the dirty blocks of the block cache when there is one, in
+// buffered mode the writes queued since disk_open; a queued write goes out early when a read or a
+// punch touches its bytes, or when IO_QUEUE_BYTES are queued, and queued writes that overlap go
+// out in the order they were made; reads that touch none of them go to the disk ahead of them
+#define DIRECT_ALIGN 4096 // O_DIRECT offsets, lengths and buffers are multiples of this
+#define CACHE_BYTES (4 * 1024 * 1024) // memory budget of the block cache
+#define IO_QUEUE_BYTES (4 * 1024 * 1024)
+
+// a block of the disk held by the block cache
+typedef struct {
+	off_t offset; // offset of the block on disk, -1 if the slot is unused
+	int dirty;
+	int next; // next slot in the same hash chain, -1 at the end of the chain
+	uint64_t last_used;
+} cache_block_t;
+
+int DIRECT_IO = 0; // 1 when running in direct mode
+int disk_cached = 0; // the data area goes through the block cache: in direct mode, and for a striped disk
+int SHARED_MOUNT = 0; // 1 when mounted with --shared, see the shared mount functions
+int disk_written = 0; // the disk was written since the shared mount's lock was taken
+int disk_fd = -1;
+int stripe_fds[STRIPE_MAX]; // stripe files of the open disk
+uint8_t *disk_boot = NULL; // aligned buffer disk_open reads the MBR into
+int disk_users = 0; // number of nested disk_open calls that are still open
+off_t disk_bytes; // size of the disk when it was opened
+
+cache_block_t *cache = NULL;
+int *cache_hash = NULL; // first slot of each hash chain
+int cache_slots = 0;
+size_t block_bytes = 0; // a multiple of the cluster size, so a cluster never spans two blocks
+size_t block_mask = 0; // block_bytes - 1, the sizes are all powers of two
+uint8_t *cache_pool = NULL; // block buffers, slot i at i * block_bytes
+uint64_t cache_local_clock = 0;
+uint64_t *cache_clock = &cache_local_clock; // in the shared segment when the cache is
+int *cache_order = NULL; // dirty slots in order of offset, while they are written back
+
+// a write waiting in the queue, buffered mode only
+typedef struct {
+	off_t offset;
+	size_t len;
+	size_t at; // where its bytes are in io_queue_data
+	int seq; // order it was made in
+} io_write_t;
+
+io_write_t *io_queue = NULL;
+int io_queued = 0;
+int io_queue_capacity = 0;
+uint8_t *io_queue_data = NULL;
+size_t io_queue_used = 0;
+size_t io_queue_size = 0;
+
+// least common multiple, used to find a block size that is aligned for O_DIRECT
+size_t lcm(size_t a, size_t b) {
+	size_t x = a, y = b;
+	while (y != 0) {
+		size_t t = x % y;
+		x = y;
+		y = t;
+	}
+	return a / x * b;
+}
+
+// buffer of the block in a slot
+static inline uint8_t *cache_data(int slot) {
+	return cache_pool + (size_t)slot * block_bytes;
+}
+
+// empty every slot
+void cache_reset() {
+	int i;
+	for (i = 0; i < cache_slots; i++) {
+		cache[i].offset = -1;
+		cache[i].dirty = 0;
+		cache[i].next = -1;
+		cache[i].last_used = 0;
+		cache_hash[i] = -1;
+	}
+}
+
+// set up the block cache for a disk with the given geometry
+// every block buffer comes from one pool aligned to both DIRECT_ALIGN and the sector size
+void cache_init(uint16_t sector_size, int cluster_size_bytes) {
+	size_t align = lcm(DIRECT_ALIGN, sector_size);
+	block_bytes = lcm(align, cluster_size_bytes);
+	block_mask = block_bytes - 1;
+	cache_slots = CACHE_BYTES / block_bytes;
+	if (cache_slots < 4) cache_slots = 4;
+	if (shm_cache_init()) return;
+	if (posix_memalign((void **)&cache_pool, align, block_bytes * cache_slots) != 0) {
+		printf("cache_init: unable to allocate %zu bytes for the block cache\n", block_bytes * cache_slots);
+		exit(1);
+	}
+	cache = (cache_block_t *)malloc(sizeof(cache_block_t) * cache_slots);
+	cache_hash = (int *)malloc(sizeof(int) * cache_slots);
+	cache_order = (int *)malloc(sizeof(int) * cache_slots);
+	cache_reset();
+}
+
+// drop every block without writing it back, used when the disk is formatted again
+void cache_free() {
+	if (shm_cache_free()) return;
+	free(cache_pool);
+	free(cache);
+	free(cache_hash);
+	free(cache_order);
+	cache_pool = NULL;
+	cache = NULL;
+	cache_hash = NULL;
+	cache_order = NULL;
+	cache_slots = 0;
+	block_bytes = 0;
+	block_mask = 0;
+}
+
+// write a dirty block back to disk
+void cache_write_back(int slot) {
+	TRACE_BEGIN("cache_write_back");
+	if (stripe_pwrite(disk_fd, stripe_fds, cache_data(slot), block_bytes, cache[slot].offset) != (ssize_t)block_bytes) {
+		printf("cache_write_back: write of block at %lld failed\n", (long long)cache[slot].offset);
+	}
+	STAT_ADD(bytes_written, block_bytes);
+	STAT_ADD(write_requests, 1);
+	STAT_ADD(write_calls, 1);
+	cache[slot].dirty = 0;
+	TRACE_END("cache_write_back");
+}
+
+// write n buffers to the open disk one after another from offset, in one system call
+void io_writev(struct iovec *iov, int n, off_t offset) {
+	size_t total = 0;
+	int i;
+	for (i = 0; i < n; i++) total += iov[i].iov_len;
+	ssize_t m = stripe_transfer(disk_fd, stripe_fds, 1, iov, n, offset);
+	if (m != (ssize_t)total) printf("disk_write: write of %zu bytes at %lld failed\n", total, (long long)offset);
+	if (m > 0) STAT_ADD(bytes_written, m);
+	STAT_ADD(write_calls, 1);
+}
+
+int compare_cache_offset(const void *a, const void *b) {
+	off_t x = cache[*(const int *)a].offset, y = cache[*(const int *)b].offset;
+	return x < y ? -1 : x > y;
+}
+
+// write every dirty block back, neighbouring blocks at once
+void cache_write_dirty() {
+	int i, n = 0;
+	for (i = 0; i < cache_slots; i++) {
+		if (cache[i].offset != -1 && cache[i].dirty) cache_order[n++] = i;
+	}
+	if (n == 0) return;
+	TRACE_BEGIN("cache_write_dirty");
+	qsort(cache_order, n, sizeof(int), compare_cache_offset);
+	struct iovec iov[IOV_MAX];
+	int count = 0;
+	for (i = 0; i < n; i++) {
+		cache_block_t *block = &cache[cache_order[i]];
+		if (count > 0 && (count == IOV_MAX || block->offset != cache[cache_order[i - 1]].offset + (off_t)block_bytes)) {
+			io_writev(iov, count, cache[cache_order[i - count]].offset);
+			count = 0;
+		}
+		iov[count].iov_base = cache_data(cache_order[i]);
+		iov[count].iov_len = block_bytes;
+		count++;
+		block->dirty = 0;
+	}
+	io_writev(iov, count, cache[cache_order[n - count]].offset);
+	STAT_ADD(write_requests, n);
+	TRACE_END("cache_write_dirty");
+}
+
+int compare_write_offset(const void *a, const void *b) {
+	const io_write_t *x = (const io_write_t *)a, *y = (const io_write_t *)b;
+	if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+	return x->seq - y->seq;
+}
+
+int compare_write_seq(const void *a, const void *b) {
+	return ((const io_write_t *)a)->seq - ((const io_write_t *)b)->seq;
+}
+
+// send the queued writes to the open disk
+void io_drain() {
+	if (io_queued == 0) return;
+	TRACE_BEGIN("io_drain");
+	qsort(io_queue, io_queued, sizeof(io_write_t), compare_write_offset);
+	off_t end = 0;
+	int i, overlap = 0;
+	for (i = 0; i < io_queued; i++) {
+		if (i > 0 && io_queue[i].offset < end) overlap = 1;
+		if (io_queue[i].offset + (off_t)io_queue[i].len > end) end = io_queue[i].offset + io_queue[i].len;
+	}
+	if (overlap) qsort(io_queue, io_queued, sizeof(io_write_t), compare_write_seq);
+	struct iovec iov[IOV_MAX];
+	int count = 0;
+	off_t start = 0;
+	for (i = 0; i < io_queued; i++) {
+		io_write_t *w = &io_queue[i];
+		if (count > 0 && (count == IOV_MAX || w->offset != end)) {
+			io_writev(iov, count, start);
+			count = 0;
+		}
+		if (count == 0) start = w->offset;
+		iov[count].iov_base = io_queue_data + w->at;
+		iov[count].iov_len = w->len;
+		count++;
+		end = w->offset + w->len;
+	}
+	io_writev(iov, count, start);
+	io_queued = 0;
+	io_queue_used = 0;
+	TRACE_END("io_drain");
+}
+
+// 1 if a queued write touches any of len bytes at offset
+int io_queue_touches(size_t len, off_t offset) {
+	int i;
+	for (i = 0; i < io_queued; i++) {
+		if (io_queue[i].offset < offset + (off_t)len && offset < io_queue[i].offset + (off_t)io_queue[i].len) return 1;
+	}
+	return 0;
+}
+
+// queue a write of len bytes of buf at offset
+void io_queue_write(const void *buf, size_t len, off_t offset) {
+	if (io_queued == io_queue_capacity) {
+		io_queue_capacity = io_queue_capacity ? io_queue_capacity * 2 : 256;
+		io_queue = (io_write_t *)realloc(io_queue, sizeof(io_write_t) * io_queue_capacity);
+	}
+	if (io_queue_used + len > io_queue_size) {
+		while (io_queue_used + len > io_queue_size) io_queue_size = io_queue_size ? io_queue_size * 2 : 65536;
+		io_queue_data = (uint8_t *)realloc(io_queue_data, io_queue_size);
+	}
+	io_write_t *w = &io_queue[io_queued];
+	w->offset = offset;
+	w->len = len;
+	w->at = io_queue_used;
+	w->seq = io_queued++;
+	memcpy(io_queue_data + io_queue_used, buf, len);
+	io_queue_used += len;
+	STAT_ADD(write_requests, 1);
+	if (io_queue_used >= IO_QUEUE_BYTES) io_drain();
+}
+
+int disk_open(char *disk_name);
+void disk_close();
+
+// the slot holding the block starting at offset, -1 if the cache doesn't have it
+int cache_find(off_t offset) {
+	int i;
+	for (i = cache_hash[(offset / block_bytes) % cache_slots]; i != -1; i = cache[i].next) {
+		if (cache[i].offset == offset) return i;
+	}
+	return -1;
+}
+
+// give the block starting at offset a slot, its bytes are then read in by the caller
+// an unused slot is taken if there is one, otherwise the least recently used block is evicted
+int cache_claim(off_t offset) {
+	int victim = 0;
+	int i;
+	for (i = 0; i < cache_slots; i++) {
+		if (cache[i].offset == -1) {
+			victim = i;
+			break;
+		}
+		if (cache[i].last_used < cache[victim].last_used) victim = i;
+	}
+	if (cache[victim].offset != -1) {
+		if (cache[victim].dirty) cache_write_back(victim);
+		int *link = &cache_hash[(cache[victim].offset / block_bytes) % cache_slots];
+		while (*link != victim) link = &cache[*link].next;
+		*link = cache[victim].next;
+	}
+	int h = (offset / block_bytes) % cache_slots;
+	cache[victim].offset = offset;
+	cache[victim].dirty = 0;
+	cache[victim].last_used = ++*cache_clock;
+	cache[victim].next = cache_hash[h];
+	cache_hash[h] = victim;
+	return victim;
+}
+
+// the block in slot was read in and n of its bytes came from the disk
+void cache_loaded(int slot, ssize_t n) {
+	// the last block may run past the end of the disk, the missing bytes read as zero
+	if (n < 0) n = 0;
+	if (n > (ssize_t)block_bytes) n = block_bytes;
+	memset(cache_data(slot) + n, 0, block_bytes - n);
+	STAT_ADD(cache_misses, 1);
+	STAT_ADD(bytes_read, n);
+
+	// data clusters are checked as they come in, once load_disk has read the checksum table
+	if (CRC_memory != NULL) {
+		off_t offset = cache[slot].offset, at;
+		for (at = offset; at < offset + n; at += geo.cluster_bytes) {
+			int cluster = at < geo.data_offset ? -1 : (at - geo.data_offset) >> geo.cluster_shift;
+			if (cluster >= 0 && cluster < MBR_memory->data_length) crc_check(cluster, cache_data(slot) + (at - offset));
+		}
+	}
+}
+
+// return the cache slot holding the block starting at offset, reading it from disk on a miss
+int cache_get(off_t offset) {
+	int slot = cache_find(offset);
+	if (slot != -1) {
+		cache[slot].last_used = ++*cache_clock;
+		STAT_ADD(cache_hits, 1);
+		return slot;
+	}
+	// data_cluster can miss between operations' disk_open and disk_close, so the disk is opened here if it isn't
+	int opened = disk_fd == -1;
+	if (opened) disk_open(DISK_NAME);
+	slot = cache_claim(offset);
+	TRACE_BEGIN("cache_miss");
+	ssize_t n = stripe_pread(disk_fd, stripe_fds, cache_data(slot), block_bytes, offset);
+	TRACE_END("cache_miss");
+	cache_loaded(slot, n);
+	if (opened) disk_close();
+	return slot;
+}
+
+// bring the blocks of len bytes at offset into the cache, up to half of it, reading each run of
+// them it doesn't have at once: one system call rather than one a block, and on a striped disk
+// one for each stripe file, made at the same time
+void cache_fill(off_t offset, size_t len) {
+	off_t at = offset - (offset & block_mask);
+	off_t end = offset + (off_t)len;
+	int filled = 0;
+	int opened = disk_fd == -1;
+	if (opened) disk_open(DISK_NAME);
+	TRACE_BEGIN("cache_fill");
+	struct iovec iov[IOV_MAX];
+	int slots[IOV_MAX];
+	while (at < end && filled < cache_slots / 2) {
+		off_t start = at;
+		int count = 0;
+		while (at < end && filled < cache_slots / 2 && count < IOV_MAX && cache_find(at) == -1) {
+			slots[count] = cache_claim(at);
+			iov[count].iov_base = cache_data(slots[count]);
+			iov[count].iov_len = block_bytes;
+			count++;
+			filled++;
+			at += block_bytes;
+		}
+		if (count == 0) {
+			at += block_bytes;
+			continue;
+		}
+		ssize_t n = stripe_transfer(disk_fd, stripe_fds, 0, iov, count, start);
+		int i;
+		for (i = 0; i < count; i++) cache_loaded(slots[i], n - (ssize_t)(i * block_bytes));
+	}
+	TRACE_END("cache_fill");
+	if (opened) disk_close();
+}
+
+// give up on a disk disk_open opened, its disk_close is still expected
+int disk_fail() {
+	close(disk_fd);
+	disk_fd = -1;
+	stripe_count = 0;
+	return -1;
+}
+
+// open the disk, calls may be nested and only the outermost disk_close closes it
+// returns -1 if it can't be opened
+int disk_open(char *disk_name) {
+	if (disk_users++ > 0) return disk_fd == -1 ? -1 : 0;
+	if (DIRECT_IO) {
+		disk_fd = open(disk_name, O_RDWR | O_DIRECT);
+		if (disk_fd == -1 && errno == EINVAL) {
+			// the host filesystem does not support O_DIRECT, keep using the block cache anyway
+			disk_fd = open(disk_name, O_RDWR);
+		}
+	} else {
+		disk_fd = open(disk_name, O_RDWR);
+	}
+	if (disk_fd == -1) {
+		printf("disk_open: unable to open %s\n", disk_name);
+		return -1;
+	}
+	struct stat st;
+	fstat(disk_fd, &st);
+	disk_bytes = st.st_size;
+
+	// the MBR says whether the data area is striped, and in direct mode how big the blocks are
+	// once the block cache holds it, it is taken from there rather than read from the disk on every open
+	if (disk_boot == NULL && posix_memalign((void **)&disk_boot, DIRECT_ALIGN, DIRECT_ALIGN) != 0) {
+		printf("disk_open: out of memory\n");
+		return disk_fail();
+	}
+	mbr_t *mbr = (mbr_t *)disk_boot;
+	int slot = cache != NULL ? cache_find(0) : -1;
+	if (slot != -1) {
+		memcpy(mbr, cache_data(slot), sizeof(mbr_t));
+	} else if (pread(disk_fd, disk_boot, DIRECT_ALIGN, 0) < (ssize_t)sizeof(mbr_t)) {
+		if (DIRECT_IO) {
+			printf("disk_open: unable to read the MBR of %s\n", disk_name);
+			return disk_fail();
+		}
+		memset(mbr, 0, sizeof(mbr_t));
+	}
+	int stripes = stripe_layout(mbr);
+	if (stripes == -1) return disk_fail();
+	if (stripes > 0) {
+		// O_DIRECT needs each file's piece of a block aligned, which takes an aligned data area and stripe unit
+		int aligned = stripe_data_offset % DIRECT_ALIGN == 0 && stripe_unit_bytes % DIRECT_ALIGN == 0;
+		if (DIRECT_IO && !aligned) fcntl(disk_fd, F_SETFL, fcntl(disk_fd, F_GETFL) & ~O_DIRECT);
+		if (stripe_open(stripe_fds, O_RDWR | (DIRECT_IO && aligned ? O_DIRECT : 0)) == -1) return disk_fail();
+	}
+	disk_cached = DIRECT_IO || stripe_count > 0;
+	if (disk_cached && cache == NULL) cache_init(mbr->sector_size, mbr->sector_size * mbr->cluster_size);
+	return 0;
+}
+
+// close the disk, every queued write and in direct mode every dirty block is written back first
+void disk_close() {
+	if (--disk_users > 0 || disk_fd == -1) return;
+	TRACE_BEGIN("disk_close");
+	io_drain();
+	if (disk_cached) {
+		cache_write_dirty();
+		// writing back the last block may have grown the file past the end of the disk
+		struct stat st;
+		fstat(disk_fd, &st);
+		if (st.st_size > disk_bytes && ftruncate(disk_fd, disk_bytes) != 0) {
+			printf("disk_close: unable to restore the size of the disk\n");
+		}
+	}
+	stripe_close(stripe_fds);
+	close(disk_fd);
+	disk_fd = -1;
+	TRACE_END("disk_close");
+}
+
+// write what is queued or dirty now, so it reaches the disk file before anything written after
+// the queue and the block cache write in order of offset, which only keeps an ordering that
+// runs from lower offsets to higher ones, the FAT before the data area for one
+void disk_barrier() {
+	if (disk_fd == -1) return;
+	io_drain();
+	if (disk_cached) cache_write_dirty();
+}
+
+// number of clusters touched by len bytes at offset
+uint64_t clusters_spanned(size_t len, off_t offset) {
+	if (geo.cluster_bytes == 0 || len == 0) return 0;
+	return ((offset + len - 1) >> geo.cluster_shift) - (offset >> geo.cluster_shift) + 1;
+}
+
+// read len bytes at offset from the open disk
+void disk_read(void *buf, size_t len, off_t offset) {
+	STAT_ADD(cluster_reads, clusters_spanned(len, offset));
+	TRACE_BEGIN("disk_read");
+	if (!disk_cached) {
+		if (io_queued > 0 && io_queue_touches(len, offset)) io_drain();
+		ssize_t n = stripe_pread(disk_fd, stripe_fds, buf, len, offset);
+		if (n > 0) STAT_ADD(bytes_read, n);
+		TRACE_END("disk_read");
+		return;
+	}
+	uint8_t *dst = (uint8_t *)buf;
+	while (len > 0) {
+		size_t in_block = offset & block_mask;
+		size_t count = block_bytes - in_block;
+		if (count > len) count = len;
+		// a read of several blocks brings in the ones after this one with it
+		if (count < len && cache_find(offset - in_block) == -1) cache_fill(offset - in_block, in_block + len);
+		memcpy(dst, cache_data(cache_get(offset - in_block)) + in_block, count);
+		dst += count;
+		offset += count;
+		len -= count;
+	}
+	TRACE_END("disk_read");
+}
+
+// write len bytes at offset to the open disk
+// in direct mode the bytes land in the block cache and reach the disk when it is closed
+void disk_write(const void *buf, size_t len, off_t offset) {
+	STAT_ADD(cluster_writes, clusters_spanned(len, offset));
+	TRACE_BEGIN("disk_write");
+	disk_written = 1;
+	if (CRC_memory != NULL && len > 0) crc_touch(offset, len);
+	if (!disk_cached) {
+		io_queue_write(buf, len, offset);
+		// keep the copy of the data area loaded by load_disk up to date
+		if (DATA_memory != NULL && MBR_memory != NULL) {
+			if (offset >= geo.data_offset) memmove(DATA_memory + (offset - geo.data_offset), buf, len);
+		}
+		TRACE_END("disk_write");
+		return;
+	}
+	const uint8_t *src = (const uint8_t *)buf;
+	while (len > 0) {
+		size_t in_block = offset & block_mask;
+		size_t count = block_bytes - in_block;
+		if (count > len) count = len;
+		int slot = cache_get(offset - in_block);
+		memcpy(cache_data(slot) + in_block, src, count);
+		cache[slot].dirty = 1;
+		src += count;
+		offset += count;
+		len -= count;
+	}
+	TRACE_END("disk_write");
+}
+
+// give len bytes at offset of the open disk back to the host filesystem, they read as zeros from
+// then on; where the host can't punch holes the bytes are left as they are
+void disk_punch(off_t offset, size_t len) {
+	TRACE_BEGIN("disk_punch");
+	if (io_queued > 0 && io_queue_touches(len, offset)) io_drain();
+	if (stripe_punch(disk_fd, stripe_fds, offset, len) != 0) {
+		TRACE_END("disk_punch");
+		return;
+	}
+	disk_written = 1;
+	if (CRC_memory != NULL && len > 0) crc_touch(offset, len);
+	// copies held in memory read as zeros too, a dirty block writes its zeros back over the hole
+	if (!disk_cached) {
+		if (DATA_memory != NULL && MBR_memory != NULL) {
+			if (offset >= geo.data_offset) memset(DATA_memory + (offset - geo.data_offset), 0, len);
+		}
+	} else {
+		int i;
+		for (i = 0; i < cache_slots; i++) {
+			if (cache[i].offset == -1) continue;
+			off_t from = offset > cache[i].offset ? offset : cache[i].offset;
+			off_t to = offset + (off_t)len < cache[i].offset + (off_t)block_bytes ? offset + (off_t)len : cache[i].offset + (off_t)block_bytes;
+			if (from < to) memset(cache_data(i) + (from - cache[i].offset), 0, to - from);
+		}
+	}
+	TRACE_END("disk_punch");
+}
+
+// return the in-memory copy of data cluster dh
+// buffered mode keeps the whole data area in DATA_memory, direct mode and a striped disk read it
+// through the block cache
+uint8_t *data_cluster(int dh) {
+	if (!disk_cached) {
+		crc_first_read(dh);
+		return cluster_memory(dh);
+	}
+	STAT_ADD(cluster_reads, 1);
+	off_t offset = cluster_offset(dh);
+	size_t in_block = offset & block_mask;
+	return cache_data(cache_get(offset - in_block)) + in_block;
+}
+
+// a thread that can't go through the block cache reads data clusters into a window of its own,
+// so fsck and walk threads hold a few blocks each rather than a copy of the data area
+// once the data area is in DATA_memory the window isn't needed, the clusters come from there
+#define READER_BYTES (64 * 1024)
+
+void *arena_alloc(size_t size);
+
+// read the data area in once for the threads, if it is no bigger than the block cache's budget
+void reader_load_small() {
+	size_t data_bytes = (size_t)MBR_memory->data_length << geo.cluster_shift;
+	if (DATA_memory != NULL || data_bytes > CACHE_BYTES) return;
+	DATA_memory = (uint8_t *)arena_alloc(data_bytes);
+	disk_open(DISK_NAME);
+	disk_read(DATA_memory, data_bytes, geo.data_offset);
+	disk_close();
+}
+
+typedef struct {
+	uint8_t *window; // aligned, bytes long
+	size_t bytes; // a multiple of block_bytes
+	off_t offset; // disk offset of the window, -1 while it holds nothing
+} cluster_reader_t;
+
+void reader_open(cluster_reader_t *reader, size_t bytes) {
+	reader->window = NULL;
+	reader->offset = -1;
+	if (DATA_memory != NULL) return;
+	reader->bytes = (bytes + block_mask) & ~block_mask;
+	if (posix_memalign((void **)&reader->window, DIRECT_ALIGN, reader->bytes) != 0) {
+		printf("reader_open: out of memory\n");
+		exit(1);
+	}
+}
+
+void reader_close(cluster_reader_t *reader) {
+	free(reader->window);
+	reader->window = NULL;
+}
+
+// return data cluster c, valid until the reader is next used; the disk must be open
+// the window is moved to start at the block holding c, past the end of the disk it reads zeros
+uint8_t *reader_cluster(cluster_reader_t *reader, int c) {
+	if (reader->window == NULL) {
+		crc_first_read(c);
+		return cluster_memory(c);
+	}
+	off_t offset = cluster_offset(c);
+	if (reader->offset == -1 || offset < reader->offset || offset + geo.cluster_bytes > reader->offset + (off_t)reader->bytes) {
+		reader->offset = offset & ~(off_t)block_mask;
+		ssize_t n = stripe_pread(disk_fd, stripe_fds, reader->window, reader->bytes, reader->offset);
+		if (n < 0) n = 0;
+		memset(reader->window + n, 0, reader->bytes - n);
+		STAT_ADD(bytes_read, n);
+	}
+	return reader->window + (offset - reader->offset);
+}
+// **************** end disk I/O functions *****************//
+
+// ************************** memory pool related functions *************//
+// entry_t, entry_ptr_t and node_t come from fixed-size slab pools: a freed object goes on the
+// free list of its pool and is handed out again by the next slab_alloc, so once the pools are
+// warm a lookup or a mkdir never reaches malloc
+// the disk loaded by load_disk lives in a per-operation arena that unload_disk resets in one step
+#define SLAB_OBJECTS 64 // number of objects in each chunk a slab pool grows by
+#define ARENA_ALIGN 16
+#define ARENA_GROWTH (1024 * 1024)
+
+uint64_t alloc_count = 0; // number of calls that reached malloc
+
+typedef struct {
+	size_t object_size;
+	void *free_list; // every free object starts with a pointer to the next free object
+} slab_t;
+
+// counting allocator, every pool and arena allocation goes through here
+void *fs_malloc(size_t size) {
+	void *p = malloc(size);
+	if (p == NULL) {
+		printf("fs_malloc: out of memory\n");
+		exit(1);
+	}
+	alloc_count++;
+	return p;
+}
+
+// take an object from a slab pool, growing the pool by SLAB_OBJECTS when it is empty
+void *slab_alloc(slab_t *slab) {
+	if (slab->free_list == NULL) {
+		// round up so the free list link stored in a free object is aligned
+		size_t size = (slab->object_size + sizeof(void *) - 1) / sizeof(void *) * sizeof(void *);
+		uint8_t *chunk = (uint8_t *)fs_malloc(size * SLAB_OBJECTS);
+		int i;
+		for (i = SLAB_OBJECTS - 1; i >= 0; i--) {
+			*(void **)(chunk + i * size) = slab->free_list;
+			slab->free_list = chunk + i * size;
+		}
+	}
+	void *object = slab->free_list;
+	slab->free_list = *(void **)object;
+	return object;
+}
+
+// return an object to its slab pool
+void slab_free(slab_t *slab, void *object) {
+	if (object == NULL) return;
+	*(void **)object = slab->free_list;
+	slab->free_list = object;
+}
+
+slab_t entry_slab = { sizeof(entry_t), NULL };
+slab_t ptr_slab = { sizeof(entry_ptr_t), NULL };
+
+// the arena is one chunk that is bumped through during an operation
+// requests that do not fit get their own overflow chunk, and the next reset grows the
+// main chunk to the size the operation needed so the following operation fits
+uint8_t *arena_base = NULL;
+size_t arena_size = 0;
+size_t arena_used = 0;
+size_t arena_wanted = 0; // bytes requested since the last reset, including overflow
+void *arena_overflow = NULL; // overflow chunks, each starts with a pointer to the next
+
+void *arena_alloc(size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	arena_wanted += size;
+	if (arena_used + size <= arena_size) {
+		void *p = arena_base + arena_used;
+		arena_used += size;
+		return p;
+	}
+	uint8_t *chunk = (uint8_t *)fs_malloc(ARENA_ALIGN + size);
+	*(void **)chunk = arena_overflow;
+	arena_overflow = chunk;
+	return chunk + ARENA_ALIGN;
+}
+
+// release everything allocated from the arena since the last reset
+void arena_reset() {
+	while (arena_overflow != NULL) {
+		void *next = *(void **)arena_overflow;
+		free(arena_overflow);
+		arena_overflow = next;
+	}
+	if (arena_wanted > arena_size) {
+		// rounded up, so an operation needing a few more bytes each time doesn't get a fresh chunk each time
+		size_t size = (arena_wanted + ARENA_GROWTH - 1) / ARENA_GROWTH * ARENA_GROWTH;
+		free(arena_base);
+		arena_base = (uint8_t *)fs_malloc(size);
+		arena_size = size;
+	}
+	arena_used = 0;
+	arena_wanted = 0;
+}
+// **************** end memory pool functions *****************//
+
+// ************************** FAT related functions *********************//
+// the FAT is read in FAT_PAGE_ENTRIES entry pages when an entry in them is first touched, and
+// at most FAT_BUDGET pages are held; a page changed by the operation stays until fat_write_back
+// has written it, only clean pages are evicted, so the budget is exceeded rather than a change lost
+// the clusters of each page form a group whose free space is kept in a fat_group_t, so
+// find_free_cluster skips full groups without reading their pages; the groups, and a hint of where
+// the first free cluster is, are checkpointed in cluster 0 at the end of an operation and read back
+// at mount; mbr_t.generation is bumped before an operation first writes the FAT, so a checkpoint
+// left behind by an operation that didn't finish no longer matches and the groups are counted again
+#define FAT_PAGE_SHIFT 11
+#define FAT_PAGE_ENTRIES (1 << FAT_PAGE_SHIFT) // 4 KB of FAT
+#define FAT_BUDGET 8 // pages held at once, 32 KB
+
+int fat_pages; // pages in the FAT of the loaded disk
+int *fat_slot; // slot holding each page, -1 if it isn't loaded
+int *fat_page; // page held by each slot
+uint16_t **fat_buffer; // buffer of each slot, NULL until the slot is first used
+uint8_t *fat_dirty; // changed since it was read or last written, per slot
+uint8_t *fat_used; // touched since the clock hand last passed, per slot
+int fat_slots; // slots in use, only past FAT_BUDGET when they are all dirty
+int fat_clock;
+int fat_pinned; // every page is loaded and none will be evicted, see fat_load_all
+uint16_t fat_written; // free_count as it was last read or written
+int fat_free_hint; // no data cluster below it is free, find_free_cluster starts there
+fat_group_t *fat_groups; // free space of each page's clusters
+uint8_t *fat_group_stale; // head, tail and longest of the group are out of date, free is kept up to date
+int fat_generation_bumped; // this operation has bumped mbr_t.generation
+int fat_checkpoint_due; // the groups differ from the checkpoint on disk
+int fat_extent_start, fat_extent_length; // longest run of free clusters, length -1 until it is known again
+int fat_reserved = 0; // free clusters promised to buffered writes, see the write-back functions
+int fat_goal = -1; // where find_free_cluster takes clusters from while fat_goal_length is set, -1 until found
+int fat_goal_length = 0; // clusters about to be taken one after another, 0 for the first free one each time
+
+// entries in a page, the last one is cut short by the end of the FAT
+int fat_page_entries(int page) {
+	int left = MBR_memory->data_length - (page << FAT_PAGE_SHIFT);
+	return left < FAT_PAGE_ENTRIES ? left : FAT_PAGE_ENTRIES;
+}
+
+off_t fat_page_offset(int page) {
+	return ((off_t)MBR_memory->fat_start << geo.cluster_shift) + ((off_t)page << (FAT_PAGE_SHIFT + 1));
+}
+
+// read a page into a free slot, or over the first clean page the clock hand finds unused
+// like cache_get, it opens the disk if the operation doesn't hold it open
+int fat_fault(int page) {
+	int slot = -1;
+	int i;
+	if (fat_slots >= FAT_BUDGET) {
+		// two turns, the first clears the used bits the second may stop at
+		for (i = 0; i < 2 * fat_slots && slot == -1; i++) {
+			int s = fat_clock;
+			fat_clock = (fat_clock + 1) % fat_slots;
+			if (fat_dirty[s]) continue;
+			if (fat_used[s]) fat_used[s] = 0;
+			else slot = s;
+		}
+		if (slot != -1) {
+			fat_slot[fat_page[slot]] = -1;
+			STAT_ADD(fat_evictions, 1);
+		}
+	}
+	if (slot == -1) {
+		slot = fat_slots++;
+		fat_buffer[slot] = (uint16_t *)arena_alloc(sizeof(uint16_t) * FAT_PAGE_ENTRIES);
+	}
+	int opened = disk_fd == -1;
+	if (opened) disk_open(DISK_NAME);
+	disk_read(fat_buffer[slot], sizeof(uint16_t) * fat_page_entries(page), fat_page_offset(page));
+	if (opened) disk_close();
+	STAT_ADD(fat_faults, 1);
+	fat_page[slot] = page;
+	fat_slot[page] = slot;
+	fat_dirty[slot] = 0;
+	fat_used[slot] = 1;
+	return slot;
+}
+
+// FAT entry of data cluster c, 0xFFFF (free) past the end of the FAT
+uint16_t fat_get(int c) {
+	if (c < 0 || c >= MBR_memory->data_length) return 0xFFFF;
+	int page = c >> FAT_PAGE_SHIFT;
+	int slot = fat_slot[page];
+	if (slot == -1) slot = fat_fault(page);
+	else if (!fat_pinned) fat_used[slot] = 1; // pinned pages may be read by several threads
+	return fat_buffer[slot][c & (FAT_PAGE_ENTRIES - 1)];
+}
+
+// change the FAT entry of data cluster c, keeping the free cluster summary in step
+void fat_set(int c, uint16_t value) {
+	if (c < 0 || c >= MBR_memory->data_length) return;
+	int page = c >> FAT_PAGE_SHIFT;
+	int slot = fat_slot[page];
+	if (slot == -1) slot = fat_fault(page);
+	uint16_t *entry = &fat_buffer[slot][c & (FAT_PAGE_ENTRIES - 1)];
+	if (*entry == 0xFFFF && value != 0xFFFF) {
+		MBR_memory->free_count--;
+		fat_groups[page].free--;
+	} else if (*entry != 0xFFFF && value == 0xFFFF) {
+		MBR_memory->free_count++;
+		fat_groups[page].free++;
+		if (c < fat_free_hint) fat_free_hint = c;
+	}
+	fat_group_stale[page] = 1;
+	fat_extent_length = -1;
+	*entry = value;
+	fat_dirty[slot] = 1;
+	fat_used[slot] = 1;
+}
+
+// write the pages changed by this operation, and the summary if it moved, to the open disk
+void fat_write_back() {
+	int i;
+	for (i = 0; i < fat_slots; i++) {
+		if (!fat_dirty[i]) continue;
+		// the checkpoint stops matching before the FAT it describes changes
+		if (!fat_generation_bumped) {
+			MBR_memory->generation++;
+			disk_write(&MBR_memory->generation, sizeof(uint16_t), offsetof(mbr_t, generation));
+			fat_generation_bumped = 1;
+			fat_checkpoint_due = 1;
+		}
+		disk_write(fat_buffer[i], sizeof(uint16_t) * fat_page_entries(fat_page[i]), fat_page_offset(fat_page[i]));
+		fat_dirty[i] = 0;
+	}
+	if (MBR_memory->free_count != fat_written) {
+		disk_write(&MBR_memory->free_count, sizeof(uint16_t), offsetof(mbr_t, free_count));
+		fat_written = MBR_memory->free_count;
+	}
+}
+
+// load every page and stop evicting, so threads can call fat_get without the page table changing
+void fat_load_all() {
+	int page;
+	disk_open(DISK_NAME);
+	for (page = 0; page < fat_pages; page++) {
+		if (fat_slot[page] != -1) continue;
+		// grow past the budget, evicting now would drop pages loaded a moment ago
+		int slot = fat_slots++;
+		fat_buffer[slot] = (uint16_t *)arena_alloc(sizeof(uint16_t) * FAT_PAGE_ENTRIES);
+		fat_page[slot] = page;
+		fat_slot[page] = slot;
+		fat_dirty[slot] = 0;
+		disk_read(fat_buffer[slot], sizeof(uint16_t) * fat_page_entries(page), fat_page_offset(page));
+		STAT_ADD(fat_faults, 1);
+	}
+	disk_close();
+	fat_pinned = 1;
+}
+
+// CRC32C of the FAT as it is on disk, a clean page is taken from memory and the rest is read
+uint32_t fat_crc() {
+	pthread_once(&crc32c_once, crc32c_init);
+	uint16_t *scratch = (uint16_t *)arena_alloc(sizeof(uint16_t) * FAT_PAGE_ENTRIES);
+	uint32_t crc = 0xFFFFFFFF;
+	int page;
+	disk_open(DISK_NAME);
+	for (page = 0; page < fat_pages; page++) {
+		int slot = fat_slot[page];
+		size_t bytes = sizeof(uint16_t) * fat_page_entries(page);
+		uint16_t *entries = scratch;
+		if (slot != -1 && !fat_dirty[slot]) entries = fat_buffer[slot];
+		else disk_read(scratch, bytes, fat_page_offset(page));
+		crc = crc32c_update(crc, (const uint8_t *)entries, bytes);
+	}
+	disk_close();
+	return ~crc;
+}
+
+// summarize the free space of a page's clusters, returns the first free one or -1
+int fat_group_count(int page, fat_group_t *group) {
+	int first = page << FAT_PAGE_SHIFT;
+	int entries = fat_page_entries(page);
+	int run = 0, first_free = -1;
+	int i;
+	group->free = 0;
+	group->head = 0;
+	group->longest = 0;
+	for (i = 0; i < entries; i++) {
+		if (fat_get(first + i) != 0xFFFF) {
+			run = 0;
+			continue;
+		}
+		if (first_free == -1) first_free = first + i;
+		group->free++;
+		run++;
+		if (run == i + 1) group->head = run;
+		if (run > group->longest) group->longest = run;
+	}
+	group->tail = run;
+	return first_free;
+}
+
+// count the free space of every group, the free clusters and the first free one
+void fat_count(fat_group_t *groups, int *free_count, int *free_hint) {
+	int page;
+	*free_count = 0;
+	*free_hint = MBR_memory->data_length;
+	for (page = 0; page < fat_pages; page++) {
+		int first_free = fat_group_count(page, &groups[page]);
+		if (*free_count == 0 && first_free != -1) *free_hint = first_free;
+		*free_count += groups[page].free;
+	}
+}
+
+// count the groups, free_count and the hint again, they are checkpointed at the end of the operation
+void fat_rebuild() {
+	int free_count;
+	fat_count(fat_groups, &free_count, &fat_free_hint);
+	MBR_memory->free_count = free_count;
+	memset(fat_group_stale, 0, fat_pages);
+	fat_extent_length = -1;
+	fat_checkpoint_due = 1;
+	STAT_ADD(fat_rebuilds, 1);
+}
+
+// longest run of free clusters on the disk, found from the groups with little reading of the FAT
+// returns its length and sets start to its first cluster, -1 if no cluster is free
+int fat_largest_extent(int *start) {
+	if (fat_extent_length != -1) {
+		*start = fat_extent_start;
+		return fat_extent_length;
+	}
+	int best = 0, run = 0, page;
+	*start = -1;
+	for (page = 0; page < fat_pages; page++) {
+		if (fat_group_stale[page]) {
+			fat_group_count(page, &fat_groups[page]);
+			fat_group_stale[page] = 0;
+		}
+		fat_group_t *group = &fat_groups[page];
+		int entries = fat_page_entries(page);
+		int from = (page << FAT_PAGE_SHIFT) - run; // where the run into this group started
+		if (group->free == entries) {
+			run += entries;
+			if (run > best) {
+				best = run;
+				*start = from;
+			}
+			continue;
+		}
+		if (run + group->head > best) {
+			best = run + group->head;
+			*start = from;
+		}
+		if (group->longest > best) {
+			// the longest run is somewhere inside the group, find where
+			int c, length = 0;
+			int end = (page << FAT_PAGE_SHIFT) + entries;
+			for (c = page << FAT_PAGE_SHIFT; c < end && length < group->longest; c++) length = fat_get(c) == 0xFFFF ? length + 1 : 0;
+			best = group->longest;
+			*start = c - length;
+		}
+		run = group->tail;
+	}
+	fat_extent_start = *start;
+	fat_extent_length = best;
+	return best;
+}
+
+// first cluster of the first run of at least n free clusters, or of the longest run if none is
+// that long; -1 if no cluster is free
+int fat_first_extent(int n) {
+	int run = 0, page;
+	for (page = 0; page < fat_pages; page++) {
+		if (fat_group_stale[page]) {
+			fat_group_count(page, &fat_groups[page]);
+			fat_group_stale[page] = 0;
+		}
+		fat_group_t *group = &fat_groups[page];
+		int entries = fat_page_entries(page);
+		int from = (page << FAT_PAGE_SHIFT) - run;
+		if (group->free == entries) {
+			run += entries;
+			if (run >= n) return from;
+			continue;
+		}
+		if (run + group->head >= n) return from;
+		if (group->longest >= n) {
+			int c, length = 0;
+			int end = (page << FAT_PAGE_SHIFT) + entries;
+			for (c = page << FAT_PAGE_SHIFT; c < end; c++) {
+				length = fat_get(c) == 0xFFFF ? length + 1 : 0;
+				if (length == n) return c + 1 - n;
+			}
+		}
+		run = group->tail;
+	}
+	int start;
+	fat_largest_extent(&start);
+	return start;
+}
+
+// where the checkpoint goes in cluster 0, -1 if the cluster is too small to hold it
+off_t fat_checkpoint_offset() {
+	size_t bytes = sizeof(mbr_t) + sizeof(fat_checkpoint_t) + sizeof(fat_group_t) * fat_pages;
+	return bytes <= (size_t)geo.cluster_bytes ? (off_t)sizeof(mbr_t) : -1;
+}
+
+// set up an empty page table for the disk being loaded, its pages come in as they are touched,
+// and take the groups from the checkpoint if it matches the MBR, or count them
+void fat_init() {
+	fat_pages = (MBR_memory->data_length + FAT_PAGE_ENTRIES - 1) >> FAT_PAGE_SHIFT;
+	fat_slot = (int *)arena_alloc(sizeof(int) * (fat_pages + 1));
+	fat_page = (int *)arena_alloc(sizeof(int) * (fat_pages + 1));
+	fat_buffer = (uint16_t **)arena_alloc(sizeof(uint16_t *) * (fat_pages + 1));
+	fat_dirty = (uint8_t *)arena_alloc(fat_pages + 1);
+	fat_used = (uint8_t *)arena_alloc(fat_pages + 1);
+	fat_groups = (fat_group_t *)arena_alloc(sizeof(fat_group_t) * (fat_pages + 1));
+	fat_group_stale = (uint8_t *)arena_alloc(fat_pages + 1);
+	int i;
+	for (i = 0; i < fat_pages; i++) {
+		fat_slot[i] = -1;
+		fat_buffer[i] = NULL;
+	}
+	memset(fat_group_stale, 0, fat_pages);
+	fat_slots = 0;
+	fat_clock = 0;
+	fat_pinned = 0;
+	fat_generation_bumped = 0;
+	fat_checkpoint_due = 0;
+	fat_extent_length = -1;
+	fat_written = MBR_memory->free_count;
+
+	off_t offset = fat_checkpoint_offset();
+	if (offset != -1) {
+		size_t bytes = sizeof(fat_checkpoint_t) + sizeof(fat_group_t) * fat_pages;
+		fat_checkpoint_t *checkpoint = (fat_checkpoint_t *)arena_alloc(bytes);
+		disk_read(checkpoint, bytes, offset);
+		if (checkpoint->generation == MBR_memory->generation && checkpoint->groups == fat_pages &&
+			checkpoint->crc == crc32c((uint8_t *)checkpoint + sizeof(uint32_t), bytes - sizeof(uint32_t))) {
+			memcpy(fat_groups, checkpoint + 1, sizeof(fat_group_t) * fat_pages);
+			fat_free_hint = checkpoint->free_hint;
+			fat_extent_start = checkpoint->largest_start == 0xFFFF ? -1 : checkpoint->largest_start;
+			fat_extent_length = checkpoint->largest_length;
+			return;
+		}
+	}
+	fat_rebuild();
+}
+
+// write the groups to cluster 0 at the end of an operation that changed them
+// when the operation gave up on changes it never wrote, the groups don't describe the FAT on
+// disk: the checkpoint is left behind the MBR's generation and the next mount counts them again
+void fat_checkpoint() {
+	if (MBR_memory == NULL || !fat_checkpoint_due) return;
+	int i;
+	for (i = 0; i < fat_slots; i++) {
+		if (fat_dirty[i]) return;
+	}
+	off_t offset = fat_checkpoint_offset();
+	if (offset == -1) return;
+	size_t bytes = sizeof(fat_checkpoint_t) + sizeof(fat_group_t) * fat_pages;
+	fat_checkpoint_t *checkpoint = (fat_checkpoint_t *)arena_alloc(bytes);
+	disk_open(DISK_NAME);
+	int start;
+	int length = fat_largest_extent(&start);
+	checkpoint->generation = MBR_memory->generation;
+	checkpoint->groups = fat_pages;
+	checkpoint->free_hint = fat_free_hint;
+	checkpoint->largest_start = start == -1 ? 0xFFFF : start;
+	checkpoint->largest_length = length;
+	checkpoint->reserved = 0xFFFF;
+	memcpy(checkpoint + 1, fat_groups, sizeof(fat_group_t) * fat_pages);
+	checkpoint->crc = crc32c((uint8_t *)checkpoint + sizeof(uint32_t), bytes - sizeof(uint32_t));
+	fat_write_back(); // only the summary in the MBR, when a rebuild moved it
+	disk_write(checkpoint, bytes, offset);
+	disk_close();
+	fat_checkpoint_due = 0;
+}
+// **************** end FAT functions *****************//
+
+// ************************** linked list related functions *************//
+// structures and functions associated with linked lists
+// linked list is used to store a path (parameter of fs_opendir)
+typedef struct node {
+	char *dir;
+	struct node *next;
+} node_t;
+
+slab_t node_slab = { sizeof(node_t), NULL };
+
+// insert at end of list
+// e.g /root/OS/hw yields root->OS->hw->null
+void insert(node_t **headRef, char* dir) {
+	node_t *newNode = (node_t *)slab_alloc(&node_slab);
+	newNode->dir = dir;
+	newNode->next = NULL;
+	if (*headRef == NULL) {
+		*headRef = newNode;
+	} else {
+		node_t *current = *headRef;
+		while (current->next != NULL) {
+			current = current->next;
+		}
+		current->next = newNode;
+	}
+}
+
+// given a directory, find the next directory in the list
+char *get_next_dir(node_t **headRef, char* current_dir) {
+	if (*headRef == NULL) return NULL;
+	node_t *current = *headRef;
+	while (current->next != NULL) {
+		if (strcmp(current->dir, current_dir) == 0) {
+			return current->next->dir;
+		}
+		current = current->next;
+	}
+	return NULL;
+}
+
+// find length of the linked list
+int get_length(node_t **headRef) {
+	if (*headRef == NULL) return 0;
+	node_t *current = *headRef;
+	int count = 0;
+	while (current->next != NULL) {
+		count++;
+		current = current->next;
+	}
+	return count;
+}
+
+// free the memory used by a list
+void empty_list(node_t **headRef) {
+	node_t *current = *headRef;
+	while (current != NULL) {
+		node_t *temp = current;
+		current = current->next;
+		slab_free(&node_slab, temp);
+	}
+	*headRef = NULL;
+}
+
+void print(node_t **headRef) {
+	printf("printing list\n");
+	node_t *current = *headRef;
+	if (current == NULL) {
+		printf("List is empty\n");
+	} else {
+		while (current->next != NULL) {
+			printf("%s\n", current->dir);
+			current = current->next;
+		}
+	}
+}
+// **************** end linked list functions *****************//
+
+// format the date for creation_date and creation_time fields of entry_t struct
+// pack the date into an unsigned 32 bit integer that is later split into two 16 bit integers
+uint32_t date_format() {
+	time_t t = time(NULL);
+	struct tm *tptr = localtime(&t);
+	uint32_t time_stamp;
+	time_stamp = ((tptr->tm_year-80)<<25) + ((tptr->tm_mon+1)<<21) + ((tptr->tm_mday)<<16) + (tptr->tm_hour<<11) + (tptr->tm_min<<5) + ((tptr->tm_sec)%60)/2;
+	return time_stamp;
+}
+
+// create a entry_t struct to initialize a directory
+entry_t *create_directory_entry(char *dir_name) {
+	entry_t *dir = (entry_t *)slab_alloc(&entry_slab);
+	uint32_t time_stamp = date_format();
+	dir->entry_type = 1;
+	dir->creation_date = (time_stamp>>16) & 0xFFFF;
+	dir->creation_time = time_stamp & 0xFFFF;
+	dir->name_len = strlen(dir_name);
+	memset(dir->name, 0, 16);
+	strcpy(dir->name, dir_name);		  
+	dir->size = 0; // a directory is always size 0	
+	dir->children_count = 0;
+	return dir;
+}
+
+// create an entry_ptr_t struct
+entry_ptr_t *create_ptr(int type, int child_cluster) {
+	entry_ptr_t *ptr = (entry_ptr_t *)slab_alloc(&ptr_slab);
+	ptr->type = type;
+	ptr->reserved = 0;
+	ptr->start = child_cluster;
+	return ptr;
+}
+
+// ************************** snapshot area related functions ***********//
+// the snapshot area is read in whole by load_disk and written back whole, after the FAT
+int cow_clusters; // clusters in the snapshot area chain
+uint16_t *cow_forward = NULL; // cluster each live cluster was copied to, 0xFFFF if it wasn't
+int cow_forward_length = 0;
+int cow_dirty = 0; // clusters were copied since the snapshot area was last written
+
+// point COW_header, COW_memory and SNAP_memory into an in memory copy of the snapshot area
+void cow_map(uint8_t *area) {
+	COW_header = (cow_header_t *)area;
+	COW_memory = (cow_t *)(area + sizeof(cow_header_t));
+	SNAP_memory = (snapshot_t *)(COW_memory + MBR_memory->data_length);
+}
+
+// read the snapshot area, following its FAT chain from mbr_t.cow_start
+void cow_load() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int cluster = MBR_memory->cow_start;
+	cow_clusters = 0;
+	while (cluster < MBR_memory->data_length && cow_clusters < MBR_memory->data_length) {
+		cow_clusters++;
+		if (fat_get(cluster) == 0xFFFE) break;
+		cluster = fat_get(cluster);
+	}
+	uint8_t *area = (uint8_t *)arena_alloc(cow_clusters * cluster_size_bytes);
+	int i;
+	for (i = 0, cluster = MBR_memory->cow_start; i < cow_clusters; i++, cluster = fat_get(cluster)) {
+		disk_read(area + i * cluster_size_bytes, cluster_size_bytes, cluster_offset(cluster));
+		crc_first_read(cluster);
+	}
+	cow_map(area);
+}
+
+// write the FAT and then the snapshot area back to disk
+void cow_write_back() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	disk_open(DISK_NAME);
+	fat_write_back();
+	int i;
+	int cluster = MBR_memory->cow_start;
+	for (i = 0; i < cow_clusters; i++, cluster = fat_get(cluster)) {
+		disk_write((uint8_t *)COW_header + i * cluster_size_bytes, cluster_size_bytes, cluster_offset(cluster));
+	}
+	disk_close();
+}
+// **************** end snapshot area functions *****************//
+
+// ************************** checksum table related functions **********//
+// read the checksum table after the MBR and FAT, checking both of them and the table itself
+void crc_load() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int table_bytes = sizeof(uint32_t) * (MBR_memory->data_length + 1);
+	uint32_t *table = (uint32_t *)arena_alloc(table_bytes);
+	disk_read(table, table_bytes, (off_t)MBR_memory->crc_start * cluster_size_bytes);
+	crc_dirty = (uint8_t *)arena_alloc(MBR_memory->data_length);
+	memset(crc_dirty, 0, MBR_memory->data_length);
+	crc_fat_dirty = 0;
+	crc_pending = 0;
+	CRC_memory = table;
+	// the clusters checked stay checked while the table is the one this process last read or wrote,
+	// a format, a migration or another process writing the disk starts them over
+	if (crc_checked_length != MBR_memory->data_length || crc_checked_table != MBR_memory->crc_table) {
+		free(crc_checked);
+		crc_checked_length = MBR_memory->data_length;
+		crc_checked = (uint64_t *)calloc((crc_checked_length + 63) / 64, sizeof(uint64_t));
+		if (crc_checked == NULL) {
+			printf("crc_load: out of memory\n");
+			exit(1);
+		}
+		crc_checked_table = MBR_memory->crc_table;
+	}
+	// in direct mode the blocks read so far can hold the first data clusters, which came in before the table
+	if (disk_cached) {
+		off_t end = ((off_t)(MBR_memory->crc_start + MBR_memory->crc_length) * cluster_size_bytes + block_bytes - 1) / block_bytes * block_bytes;
+		int i;
+		for (i = 0; i < MBR_memory->data_length && cluster_offset(i) < end; i++) crc_check(i, data_cluster(i));
+	}
+	const char *bad = NULL;
+	if (crc32c(MBR_memory, offsetof(mbr_t, crc_mbr)) != MBR_memory->crc_mbr) bad = "the MBR";
+	else if (crc32c(CRC_memory, table_bytes) != MBR_memory->crc_table) bad = "the checksum table";
+	else if (fat_crc() != CRC_memory[0]) bad = "the FAT";
+	if (bad != NULL) {
+		STAT_ADD(checksum_errors, 1);
+		if (crc_verify) printf("checksum mismatch in %s\n", bad);
+	}
+}
+
+// recompute the checksums of what this operation wrote, then write the table and the MBR
+// the FAT and MBR are read back rather than taken from memory, which may hold changes that were
+// never written
+void crc_flush() {
+	if (CRC_memory == NULL || !crc_pending) return;
+	int cluster_size_bytes = geo.cluster_bytes;
+	int table_bytes = sizeof(uint32_t) * (MBR_memory->data_length + 1);
+	int i;
+	for (i = 0; i < MBR_memory->data_length; i++) {
+		if (crc_dirty[i]) CRC_memory[1 + i] = crc32c(data_cluster(i), cluster_size_bytes);
+	}
+	disk_open(DISK_NAME);
+	if (crc_fat_dirty) CRC_memory[0] = fat_crc();
+	disk_write(CRC_memory, table_bytes, (off_t)MBR_memory->crc_start * cluster_size_bytes);
+	mbr_t mbr;
+	disk_read(&mbr, sizeof(mbr_t), 0);
+	mbr.crc_table = crc32c(CRC_memory, table_bytes);
+	crc_checked_table = mbr.crc_table;
+	mbr.crc_mbr = crc32c(&mbr, offsetof(mbr_t, crc_mbr));
+	disk_write(&mbr, sizeof(mbr_t), 0);
+	disk_close();
+	memset(crc_dirty, 0, MBR_memory->data_length);
+	crc_fat_dirty = 0;
+	crc_pending = 0;
+}
+// **************** end checksum table functions *****************//
+
+// format the file system:
+// determine FAT area length and Data area length
+// write the Master Boot Record to file, initialize the FAT area, and create the root dir
+void do_format(uint16_t sector_size, uint16_t cluster_size, uint16_t disk_size) {
+	if (!geometry_valid(sector_size, cluster_size)) {
+		printf("format: sector size %d and cluster size %d must be powers of two, with sectors of at least 64 bytes\n", sector_size, cluster_size);
+		return;
+	}
+	if (STRIPES < 0 || STRIPES > STRIPE_MAX || STRIPE_UNIT < 1 || STRIPE_UNIT > 32768) {
+		printf("format: a disk can be striped across at most %d files, in units of 1 to 32768 clusters\n", STRIPE_MAX);
+		return;
+	}
+	wb_drop(-1);
+	mbr_t *MBR = (mbr_t *)arena_alloc(sizeof(mbr_t));
+	MBR->sector_size = sector_size;
+	MBR->cluster_size = cluster_size;
+	MBR->disk_size = disk_size;
+	MBR->fat_start = 1;
+	memset(MBR->disk_name, 0, sizeof(MBR->disk_name));
+	strcpy(MBR->disk_name, "A");
+	// a stripe unit is whole pages and O_DIRECT blocks, so load_disk can map it and direct mode read it
+	int unit_align = lcm(DIRECT_ALIGN, sysconf(_SC_PAGESIZE)) / (sector_size * cluster_size);
+	MBR->stripe_count = STRIPES;
+	MBR->stripe_unit = STRIPES == 0 ? 0 : unit_align <= 1 ? STRIPE_UNIT : (STRIPE_UNIT + unit_align - 1) / unit_align * unit_align;
+	MBR->magic = FS_MAGIC;
+	MBR->version = FS_VERSION;
+	MBR->generation = 0;
+	MBR->cow_start = 0xFFFF;
+	MBR->crc_start = 0xFFFF;
+	MBR->crc_length = 0xFFFF;
+	MBR->crc_table = 0xFFFFFFFF;
+	MBR->crc_mbr = 0xFFFFFFFF;
+
+	// determine the size (in clusters) of the FAT and Data areas
+	int i;
+	int cluster_size_bytes = sector_size * cluster_size; // number of bytes per cluster
+	int max_data_length;
+	for (max_data_length = disk_size - 2, i = 1; max_data_length >= 0 && !CHECKSUMS; max_data_length--, i++) {
+		if (max_data_length * 2 <= cluster_size_bytes * i) {
+			MBR->fat_length = disk_size - max_data_length - 1;
+			MBR->data_start = MBR->fat_start + MBR->fat_length;
+			MBR->data_length = max_data_length;
+			break;
+		}
+	}
+	// with checksums the table takes 4 bytes per data cluster, plus 4 for the FAT, after the FAT
+	for (max_data_length = disk_size - 3; max_data_length >= 0 && CHECKSUMS; max_data_length--) {
+		int fat_length = (max_data_length * 2 + cluster_size_bytes - 1) / cluster_size_bytes;
+		int crc_length = ((max_data_length + 1) * 4 + cluster_size_bytes - 1) / cluster_size_bytes;
+		if (fat_length < 1) fat_length = 1;
+		if (1 + fat_length + crc_length + max_data_length <= disk_size) {
+			MBR->crc_length = crc_length;
+			MBR->fat_length = disk_size - max_data_length - crc_length - 1;
+			MBR->crc_start = MBR->fat_start + MBR->fat_length;
+			MBR->data_start = MBR->crc_start + MBR->crc_length;
+			MBR->data_length = max_data_length;
+			break;
+		}
+	}
+
+	// initialization operations
+	// - initialize the file system by writing 0xFF to every byte before the data area
+	// size of resulting file should be equal to sector_size * cluster_size * disk_size
+	// written one cluster at a time, so large disks don't need a disk sized buffer
+	// the free data area is left as a hole on the host, it reads as zeros and takes no space
+	FILE *fs;
+	fs = fopen(DISK_NAME, "wb");
+	uint8_t *init_fs = (uint8_t *)arena_alloc(cluster_size_bytes);
+	memset(init_fs, 0xFF, cluster_size_bytes);
+	for (i=0; i < MBR->data_start; i++) {
+		fwrite(init_fs, sizeof(uint8_t), cluster_size_bytes, fs);	
+	}
+	fflush(fs);
+	if (ftruncate(fileno(fs), (off_t)(MBR->stripe_count > 0 ? MBR->data_start : disk_size) * cluster_size_bytes) != 0) {
+		printf("format: unable to size %s\n", DISK_NAME);
+	}
+	fclose(fs);
+
+	fs = fopen(DISK_NAME, "rb+");
+
+	// write the MBR, every data cluster but the root's is free
+	MBR->free_count = MBR->data_length - 1;
+	fwrite(MBR, sizeof(mbr_t), 1, fs);
+	
+	// create the root directory
+	// root directory information is held in the first data cluster
+	// update the FAT entry from 0xFFFF to 0xFFFe
+	fseek(fs, sector_size*cluster_size, SEEK_SET);
+	uint16_t allocate = 0xFFFE;
+	fwrite(&allocate, sizeof(uint16_t), 1, fs);
+
+	// the root's slots are empty, 0xFF like those of every new directory
+	// a striped disk has its data area in the stripe files, so the root goes to the first of them
+	entry_t *root = create_directory_entry("root");
+	memcpy(init_fs, root, sizeof(entry_t));
+	if (MBR->stripe_count == 0) {
+		fseek(fs, sector_size*cluster_size*MBR->data_start, SEEK_SET);
+		fwrite(init_fs, sizeof(uint8_t), cluster_size_bytes, fs);	
+	}
+	stripe_create(MBR, init_fs);
+
+	// checksums of the FAT and data clusters as they are now, then of the table and the MBR
+	if (CHECKSUMS) {
+		int table_bytes = sizeof(uint32_t) * (MBR->data_length + 1);
+		uint32_t *table = (uint32_t *)arena_alloc(table_bytes);
+		uint16_t *fat = (uint16_t *)arena_alloc(sizeof(uint16_t) * (MBR->data_length + 1));
+		memset(fat, 0xFF, sizeof(uint16_t) * MBR->data_length);
+		fat[0] = 0xFFFE;
+		table[0] = crc32c(fat, sizeof(uint16_t) * MBR->data_length);
+		table[1] = crc32c(init_fs, cluster_size_bytes);
+		memset(init_fs, 0, cluster_size_bytes);
+		uint32_t free_crc = crc32c(init_fs, cluster_size_bytes);
+		for (i = 1; i < MBR->data_length; i++) table[1 + i] = free_crc;
+		fseeko(fs, (off_t)cluster_size_bytes * MBR->crc_start, SEEK_SET);
+		fwrite(table, sizeof(uint8_t), table_bytes, fs);
+		MBR->crc_table = crc32c(table, table_bytes);
+		MBR->crc_mbr = crc32c(MBR, offsetof(mbr_t, crc_mbr));
+		fseek(fs, 0, SEEK_SET);
+		fwrite(MBR, sizeof(mbr_t), 1, fs);
+	}
+	slab_free(&entry_slab, root);
+
+	// finished initilizing the file system, close the file
+	fclose(fs);	
+
+	// anything cached belongs to the old disk, and so do handles of copied directories
+	disk_written = 1;
+	if (cache != NULL) cache_free();
+	free(cow_forward);
+	cow_forward = NULL;
+	cow_forward_length = 0;
+	free(dedup_key);
+	dedup_key = NULL;
+	dedup_length = 0;
+	arena_reset();
+
+}
+
+void *data_map = NULL; // mapping of the data area made by load_disk, NULL if it was read in instead
+size_t data_map_bytes;
+
+// load the disk into memory, the memory is released by unload_disk
+// returns -1 if it can't be loaded, and then there is nothing to unload
+int load_disk(char *disk_name) {
+	TRACE_BEGIN("load_disk");
+	// allocate memory for an mbr_t structure
+	MBR_memory = (mbr_t *)arena_alloc(sizeof(mbr_t));
+	int loaded = disk_open(disk_name);
+	if (loaded == 0) {
+		disk_read(MBR_memory, sizeof(mbr_t), 0);
+		loaded = geometry_init(MBR_memory);
+	}
+	if (loaded == -1) {
+		disk_close();
+		arena_reset();
+		MBR_memory = NULL;
+		TRACE_END("load_disk");
+		return -1;
+	}
+	// the FAT comes in a page at a time as it is used
+	fat_init();
+	CRC_memory = NULL;
+	if (MBR_memory->crc_start != 0xFFFF) crc_load();
+	
+	// map the data area, the host reads a page of it in when it is first touched
+	// the mapping is private: disk_write and disk_punch change it along with the disk, and
+	// defrag moves clusters around in it, without the host writing anything back
+	// in direct mode, and for a striped disk, the data area is read on demand through the block cache instead
+	DATA_memory = NULL;
+	if (!disk_cached) {
+		size_t data_bytes = (size_t)MBR_memory->data_length << geo.cluster_shift;
+		off_t map_offset = geo.data_offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+		if (geo.data_offset + (off_t)data_bytes <= disk_bytes) {
+			data_map_bytes = data_bytes + (geo.data_offset - map_offset);
+			data_map = mmap(NULL, data_map_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, disk_fd, map_offset);
+			if (data_map != MAP_FAILED) DATA_memory = (uint8_t *)data_map + (geo.data_offset - map_offset);
+			else data_map = NULL;
+		}
+		// a disk cut short, or a host that can't map it, is read in whole
+		if (DATA_memory == NULL) {
+			DATA_memory = (uint8_t *)arena_alloc(data_bytes);
+			disk_read(DATA_memory, data_bytes, geo.data_offset);
+		}
+	}
+
+	COW_header = NULL;
+	COW_memory = NULL;
+	SNAP_memory = NULL;
+	if (MBR_memory->cow_start != 0xFFFF) cow_load();
+
+	disk_close();
+	TRACE_END("load_disk");
+	return 0;
+}
+
+// release the memory filled by load_disk, called at the end of every operation
+void unload_disk() {
+	fat_checkpoint();
+	crc_flush();
+	arena_reset();
+	if (data_map != NULL) munmap(data_map, data_map_bytes);
+	data_map = NULL;
+	MBR_memory = NULL;
+	DATA_memory = NULL;
+	COW_header = NULL;
+	COW_memory = NULL;
+	SNAP_memory = NULL;
+	CRC_memory = NULL;
+}
+
+// fill entry struct from disk, release it with slab_free(&entry_slab, ...)
+entry_t *fill_entry (int dh) {
+	TRACE_BEGIN("fill_entry");
+	entry_t *e = (entry_t *)slab_alloc(&entry_slab);
+	// read where the data area is already held, the copy loaded or the block cache
+	if (dh >= 0 && dh < MBR_memory->data_length) memcpy(e, data_cluster(dh), sizeof(entry_t));
+	else memset(e, 0, sizeof(entry_t));
+	TRACE_END("fill_entry");
+	return e; 	
+}
+
+// first free cluster in [from, to), or -1
+int fat_first_free(int from, int to) {
+	int c;
+	for (c = from; c < to; c++) {
+		if (fat_groups[c >> FAT_PAGE_SHIFT].free == 0) {
+			c |= FAT_PAGE_ENTRIES - 1; // nothing free in the rest of the group, its page isn't read
+			continue;
+		}
+		if (fat_get(c) == 0xFFFF) break;
+	}
+	STAT_ADD(fat_scan_length, c < to ? c + 1 - from : to - from);
+	return c < to ? c : -1;
+}
+
+// find the next free cluster available, returns -1 if disk is full
+// the scan starts at the summary's hint, so the lowest free cluster is still the one taken,
+// and a full disk is known from free_count without scanning at all; the clusters reserved for
+// buffered writes count as taken, and while they are placed they come from one free run
+int find_free_cluster() {
+	STAT_ADD(fat_scans, 1);
+	TRACE_BEGIN("find_free_cluster");
+	int child_cluster = -1, from_goal = 0;
+	if (fat_goal_length > 0 && MBR_memory->free_count > 0) {
+		if (fat_goal == -1) fat_goal = fat_first_extent(fat_goal_length);
+		if (fat_goal != -1 && fat_goal < MBR_memory->data_length && fat_get(fat_goal) == 0xFFFF) {
+			child_cluster = fat_goal++;
+			from_goal = 1;
+		} else {
+			fat_goal = -1;
+		}
+	}
+	if (child_cluster == -1 && MBR_memory->free_count > fat_reserved) {
+		int hint = fat_free_hint < MBR_memory->data_length ? fat_free_hint : MBR_memory->data_length;
+		child_cluster = fat_first_free(hint, MBR_memory->data_length);
+		// nothing past the hint can only come from a damaged summary, fsck puts it right
+		if (child_cluster == -1) child_cluster = fat_first_free(0, hint);
+	}
+	if (child_cluster != -1) {
+		fat_set(child_cluster, 0xFFFE);
+		// a cluster from the goal can have free ones below it, the hint stays where they are
+		if (!from_goal || child_cluster == fat_free_hint) fat_free_hint = child_cluster + 1;
+		if (COW_memory != NULL) {
+			COW_memory[child_cluster].refs = 1;
+			COW_memory[child_cluster].birth = COW_header->generation;
+		}
+		if (child_cluster < cow_forward_length) cow_forward[child_cluster] = 0xFFFF;
+		if (child_cluster < dedup_length) dedup_key[child_cluster] = 0;
+	}
+	TRACE_END("find_free_cluster");
+	return child_cluster;
+}
+
+// fill space from the summary, the FAT is only read for groups changed since the last checkpoint
+// returns 0, or -1 if the disk can't be loaded
+int do_space(space_t *space) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	space->clusters = MBR_memory->data_length;
+	space->free = MBR_memory->free_count - fat_reserved; // the rest is promised to buffered writes
+	space->largest_length = fat_largest_extent(&space->largest_start);
+	space->groups = fat_pages;
+	unload_disk();
+	return 0;
+}
+
+// ************************** directory slot related functions **********//
+// a directory cluster holds its entry_t followed by entry_ptr_t slots
+// when every other slot of a cluster is used, its last slot becomes a link (type 2) to an
+// overflow cluster made up only of slots, and so on down the chain
+// a slot whose type isn't 0, 1 or 2 is free, and children_count counts children but not links
+
+// position in the slots of a directory, advanced by next_child
+typedef struct {
+	int cluster; // cluster of the next slot
+	int offset; // byte offset of the next slot in that cluster
+	int hops; // overflow links followed, stops the walk if the links loop
+	off_t link; // disk offset of the link slot that led to cluster, -1 in the first cluster
+} slot_cursor_t;
+
+void slot_cursor_init(slot_cursor_t *cursor, int dh) {
+	cursor->cluster = dh;
+	cursor->offset = sizeof(entry_t);
+	cursor->hops = 0;
+	cursor->link = -1;
+}
+
+// disk offset of the slot last returned by next_child
+off_t cursor_location(slot_cursor_t *cursor) {
+	return cluster_offset(cursor->cluster) + cursor->offset - sizeof(entry_ptr_t);
+}
+
+// return the next slot holding a child, following overflow links, or NULL after the last child
+// the slot points into memory that the next disk access may reuse, read it straight away
+// next_child for clusters of cluster_size_bytes, always inlined so the common sizes get a copy of
+// the slot scan whose bounds are constants; free slots are skipped without leaving the cluster
+static inline __attribute__((always_inline)) uint8_t *next_child_sized(slot_cursor_t *cursor, int cluster_size_bytes) {
+	while (cursor->offset + (int)sizeof(entry_ptr_t) <= cluster_size_bytes) {
+		uint8_t *data = data_cluster(cursor->cluster);
+		uint8_t *slot = data + cursor->offset;
+		uint8_t *last = data + cluster_size_bytes - sizeof(entry_ptr_t);
+		while (slot < last && slot[0] > 2) slot += sizeof(entry_ptr_t);
+		cursor->offset = slot - data + sizeof(entry_ptr_t);
+		if (slot[0] == 0 || slot[0] == 1) return slot;
+		if (slot[0] == 2) {
+			int next = le16(slot + 2);
+			if (next >= MBR_memory->data_length || ++cursor->hops > MBR_memory->data_length) return NULL;
+			cursor->link = cursor_location(cursor);
+			cursor->cluster = next;
+			cursor->offset = 0;
+		}
+	}
+	return NULL;
+}
+
+uint8_t *next_child(slot_cursor_t *cursor) {
+	if (geo.cluster_bytes == 512) return next_child_sized(cursor, 512);
+	if (geo.cluster_bytes == 4096) return next_child_sized(cursor, 4096);
+	return next_child_sized(cursor, geo.cluster_bytes);
+}
+
+// return the slot of child number child_num of the directory at cluster dh, NULL if there is none
+uint8_t *child_slot(int dh, int child_num) {
+	slot_cursor_t cursor;
+	slot_cursor_init(&cursor, dh);
+	uint8_t *slot;
+	do {
+		slot = next_child(&cursor);
+	} while (slot != NULL && child_num-- > 0);
+	return slot;
+}
+
+// find a free slot for a new pointer in the directory at cluster dh, linking a new overflow
+// cluster onto the chain when every slot is used
+// returns the disk offset of the slot, or -1 when there is no free cluster for the overflow
+off_t open_slot(int dh) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int cluster = dh;
+	int first = sizeof(entry_t);
+	int hops = 0;
+	while (1) {
+		uint8_t *data = data_cluster(cluster);
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		off_t cluster_location = cluster_offset(cluster);
+		int s;
+		for (s = 0; s < slots - 1; s++) {
+			uint8_t type = data[first + s * sizeof(entry_ptr_t)];
+			if (type != 0 && type != 1 && type != 2) return cluster_location + first + s * sizeof(entry_ptr_t);
+		}
+		uint8_t *last = data + first + (slots - 1) * sizeof(entry_ptr_t);
+		if (last[0] == 2) {
+			cluster = le16(last + 2);
+			first = 0;
+			if (cluster >= MBR_memory->data_length || ++hops > MBR_memory->data_length) return -1;
+			continue;
+		}
+		if (last[0] == 0 || last[0] == 1) return -1; // no room for a link
+
+		// every slot is used, start a new overflow cluster and link it from the last slot
+		int overflow = find_free_cluster();
+		if (overflow == -1) return -1;
+		uint8_t *empty = (uint8_t *)arena_alloc(cluster_size_bytes);
+		memset(empty, 0xFF, cluster_size_bytes);
+		off_t overflow_location = cluster_offset(overflow);
+		disk_write(empty, cluster_size_bytes, overflow_location);
+		entry_ptr_t *link_ptr = create_ptr(2, overflow);
+		disk_write(link_ptr, sizeof(entry_ptr_t), cluster_location + first + (slots - 1) * sizeof(entry_ptr_t));
+		slab_free(&ptr_slab, link_ptr);
+		return overflow_location;
+	}
+}
+// **************** end directory slot functions *****************//
+
+// ************************** snapshot related functions ****************//
+// taking a snapshot stores the live root in a snapshot_t and counts one more reference to it,
+// nothing else is copied; a cluster reachable from a snapshot is never written in place again
+// instead it's copied first, the copy takes over the reference of its parent and counts one
+// reference to everything the original points to, so sharing is pushed down a level at a time
+// a cluster born after the newest snapshot can't be shared; an older directory is found by
+// walking down from the live root, copying every directory on the way that is still shared
+// handles to a copied directory are forwarded to the copy for the rest of the process, handles
+// into a snapshot carry SNAPSHOT_HANDLE and are read-only
+#define SNAPSHOT_HANDLE 0x10000
+
+// cluster of the live root directory
+int live_root() {
+	return COW_header != NULL ? COW_header->root : 0;
+}
+
+// 1 while some snapshot may share clusters with the live tree
+int cow_active() {
+	return COW_header != NULL && COW_header->snapshot_count > 0;
+}
+
+// cluster a live directory handle refers to now
+int cow_resolve(int dh) {
+	int hops = 0;
+	while (dh >= 0 && dh < cow_forward_length && cow_forward[dh] != 0xFFFF && hops++ < cow_forward_length) {
+		dh = cow_forward[dh];
+	}
+	return dh;
+}
+
+// cluster a handle reads from, whether it's live or into a snapshot
+int handle_cluster(int dh) {
+	return dh & SNAPSHOT_HANDLE ? dh & 0xFFFF : cow_resolve(dh);
+}
+
+// copy the shared cluster x to a new one; ref is the disk offset of the slot or link pointing
+// to x, or -1 for the live root, and first is where the slots of x start
+// returns the copy, or -1 when the disk is full
+int cow_copy(int x, off_t ref, int first) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int copy = find_free_cluster();
+	if (copy == -1) return -1;
+	uint8_t *data = (uint8_t *)arena_alloc(cluster_size_bytes);
+	memcpy(data, data_cluster(x), cluster_size_bytes);
+	int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+	int s;
+	for (s = 0; s < slots; s++) {
+		uint8_t *slot = data + first + s * sizeof(entry_ptr_t);
+		int target = le16(slot + 2);
+		if ((slot[0] == 0 || slot[0] == 1 || slot[0] == 2) && target < MBR_memory->data_length) COW_memory[target].refs++;
+	}
+	if (fat_get(x) != 0xFFFE && fat_get(x) < MBR_memory->data_length) {
+		fat_set(copy, fat_get(x));
+		COW_memory[fat_get(x)].refs++;
+	}
+	COW_memory[x].refs--;
+
+	disk_open(DISK_NAME);
+	disk_write(data, cluster_size_bytes, cluster_offset(copy));
+	if (ref == -1) {
+		COW_header->root = copy;
+	} else {
+		uint16_t start = copy;
+		disk_write(&start, sizeof(uint16_t), ref + offsetof(entry_ptr_t, start));
+	}
+	disk_close();
+
+	if (cow_forward == NULL) {
+		cow_forward_length = MBR_memory->data_length;
+		cow_forward = (uint16_t *)fs_malloc(sizeof(uint16_t) * cow_forward_length);
+		memset(cow_forward, 0xFF, sizeof(uint16_t) * cow_forward_length);
+	}
+	if (x < cow_forward_length) cow_forward[x] = copy;
+	cow_dirty = 1;
+	STAT_ADD(clusters_copied, 1);
+	return copy;
+}
+
+// copy the shared overflow clusters of the directory at dh, which only the live tree reaches
+// returns 0, or -1 when the disk is full
+int cow_chain(int dh) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int cluster = dh;
+	int first = sizeof(entry_t);
+	int hops = 0;
+	while (1) {
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		uint8_t *last = data_cluster(cluster) + first + (slots - 1) * sizeof(entry_ptr_t);
+		int next = le16(last + 2);
+		if (last[0] != 2 || next >= MBR_memory->data_length || ++hops > MBR_memory->data_length) return 0;
+		if (COW_memory[next].refs > 1) {
+			off_t ref = cluster_offset(cluster) + first + (slots - 1) * sizeof(entry_ptr_t);
+			next = cow_copy(next, ref, 0);
+			if (next == -1) return -1;
+		}
+		cluster = next;
+		first = 0;
+	}
+}
+
+// fill path with the directories from the live root down to dh
+// returns their number, 0 if dh isn't a directory of the live tree
+int cow_path(int dh, int *path) {
+	int data_length = MBR_memory->data_length;
+	int *parent = (int *)arena_alloc(sizeof(int) * data_length); // -2 until the directory is reached
+	int *queue = (int *)arena_alloc(sizeof(int) * data_length);
+	int i;
+	for (i = 0; i < data_length; i++) parent[i] = -2;
+	int head = 0, tail = 0;
+	parent[live_root()] = -1;
+	queue[tail++] = live_root();
+	while (head < tail && parent[dh] == -2) {
+		slot_cursor_t cursor;
+		slot_cursor_init(&cursor, queue[head]);
+		uint8_t *slot;
+		while ((slot = next_child(&cursor)) != NULL) {
+			int child = le16(slot + 2);
+			if (slot[0] != 1 || child >= data_length || parent[child] != -2) continue;
+			parent[child] = queue[head];
+			queue[tail++] = child;
+		}
+		head++;
+	}
+	if (parent[dh] == -2) return 0;
+	int length = 0;
+	for (i = dh; i != -1; i = parent[i]) length++;
+	int n = length;
+	for (i = dh; i != -1; i = parent[i]) path[--n] = i;
+	return length;
+}
+
+// copy what cow_dir needs copied, returns the cluster dh lives in afterwards or -1
+int cow_dir_copy(int dh) {
+	dh = cow_resolve(dh);
+	if (!cow_active() || dh >= MBR_memory->data_length) return dh;
+	if (COW_memory[dh].birth > COW_header->snapshot_generation) return cow_chain(dh) == -1 ? -1 : dh;
+
+	// each directory on the path is only copied once its parent belongs to the live tree alone
+	int *path = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int length = cow_path(dh, path);
+	if (length == 0) return -1;
+	int parent = -1;
+	int i;
+	for (i = 0; i < length; i++) {
+		int d = path[i];
+		if (COW_memory[d].refs > 1) {
+			off_t ref = -1;
+			if (parent != -1) {
+				slot_cursor_t cursor;
+				slot_cursor_init(&cursor, parent);
+				uint8_t *slot;
+				while ((slot = next_child(&cursor)) != NULL) {
+					if (slot[0] == 1 && le16(slot + 2) == d) break;
+				}
+				if (slot == NULL) return -1;
+				ref = cursor_location(&cursor);
+			}
+			d = cow_copy(d, ref, sizeof(entry_t));
+			if (d == -1) return -1;
+		}
+		if (cow_chain(d) == -1) return -1;
+		parent = d;
+	}
+	return parent;
+}
+
+// make the live directory at handle dh safe to write in place; whatever was copied is on disk,
+// FAT and reference counts included, before anything is written to it
+// returns the cluster it lives in now, or -1 when the disk is full or dh isn't a live directory
+int cow_dir(int dh) {
+	if (dh & SNAPSHOT_HANDLE) return -1;
+	dh = cow_dir_copy(dh);
+	if (cow_dirty) {
+		cow_write_back();
+		cow_dirty = 0;
+	}
+	return dh;
+}
+
+// directory of the live tree with a slot pointing to the file at fh, -1 if there is none
+int cow_parent(int fh) {
+	int data_length = MBR_memory->data_length;
+	uint8_t *seen = (uint8_t *)arena_alloc(data_length);
+	int *queue = (int *)arena_alloc(sizeof(int) * data_length);
+	memset(seen, 0, data_length);
+	int head = 0, tail = 0;
+	seen[live_root()] = 1;
+	queue[tail++] = live_root();
+	while (head < tail) {
+		int dh = queue[head++];
+		slot_cursor_t cursor;
+		slot_cursor_init(&cursor, dh);
+		uint8_t *slot;
+		while ((slot = next_child(&cursor)) != NULL) {
+			int child = le16(slot + 2);
+			if (slot[0] == 0 && child == fh) return dh;
+			if (slot[0] != 1 || child >= data_length || seen[child]) continue;
+			seen[child] = 1;
+			queue[tail++] = child;
+		}
+	}
+	return -1;
+}
+
+// make the live file at handle fh safe to write in place up to cluster last of its chain: its
+// directory as cow_dir does, then its entry cluster and every cluster of the chain up to last that
+// is still shared, with a snapshot or with another file by deduplication; the chain copies are
+// linked through the FAT rather than a slot, each takes over one reference to the rest of the chain
+// returns the cluster the file lives in now, or -1 when the disk is full or fh isn't a live file
+int cow_file(int fh, int last) {
+	if (fh & SNAPSHOT_HANDLE) return -1;
+	fh = cow_resolve(fh);
+	if (COW_header == NULL || fh >= MBR_memory->data_length) return fh;
+	int cluster_size_bytes = geo.cluster_bytes;
+	if (cow_active() && COW_memory[fh].birth <= COW_header->snapshot_generation) {
+		int dh = cow_parent(fh);
+		if (dh != -1) dh = cow_dir(dh);
+		if (dh == -1) return -1;
+		if (COW_memory[fh].refs > 1) {
+			slot_cursor_t cursor;
+			slot_cursor_init(&cursor, dh);
+			uint8_t *slot;
+			while ((slot = next_child(&cursor)) != NULL) {
+				if (slot[0] == 0 && le16(slot + 2) == fh) break;
+			}
+			if (slot == NULL) return -1;
+			// the rest of a file's entry cluster isn't slots
+			fh = cow_copy(fh, cursor_location(&cursor), cluster_size_bytes);
+			if (fh == -1) return -1;
+		}
+	}
+	int prev = fh;
+	int hops = 0;
+	while (fat_get(prev) < MBR_memory->data_length && hops <= last && hops++ < MBR_memory->data_length) {
+		int x = fat_get(prev);
+		if (COW_memory[x].refs > 1) {
+			int copy = find_free_cluster();
+			if (copy == -1) {
+				// the copies made so far are already linked in on disk, so they are written back first
+				fh = -1;
+				break;
+			}
+			uint8_t *data = (uint8_t *)arena_alloc(cluster_size_bytes);
+			memcpy(data, data_cluster(x), cluster_size_bytes);
+			disk_open(DISK_NAME);
+			disk_write(data, cluster_size_bytes, cluster_offset(copy));
+			disk_close();
+			if (fat_get(x) < MBR_memory->data_length) {
+				fat_set(copy, fat_get(x));
+				COW_memory[fat_get(x)].refs++;
+			}
+			COW_memory[x].refs--;
+			fat_set(prev, copy);
+			cow_dirty = 1;
+			STAT_ADD(clusters_copied, 1);
+			x = copy;
+		}
+		prev = x;
+	}
+	if (cow_dirty) {
+		cow_write_back();
+		cow_dirty = 0;
+	}
+	return fh;
+}
+
+// index of the snapshot called name, -1 if there is none
+int snapshot_find(char *name) {
+	if (COW_header == NULL) return -1;
+	int i;
+	for (i = 0; i < COW_header->snapshot_count; i++) {
+		if (strncmp(SNAP_memory[i].name, name, 16) == 0) return i;
+	}
+	return -1;
+}
+
+// create the snapshot area; until now every allocated cluster had exactly one parent, so each
+// starts with one reference
+// returns 0, or -1 when the disk is full
+int cow_create() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int data_length = MBR_memory->data_length;
+	int bytes = sizeof(cow_header_t) + sizeof(cow_t) * data_length + sizeof(snapshot_t);
+	int clusters = (bytes + cluster_size_bytes - 1) / cluster_size_bytes;
+	int first = -1, last = -1;
+	int i;
+	for (i = 0; i < clusters; i++) {
+		int cluster = find_free_cluster();
+		if (cluster == -1) {
+			for (i = first; i != -1 && i != 0xFFFE; i = cluster) {
+				cluster = fat_get(i);
+				fat_set(i, 0xFFFF);
+			}
+			return -1;
+		}
+		if (last == -1) first = cluster;
+		else fat_set(last, cluster);
+		last = cluster;
+	}
+	uint8_t *area = (uint8_t *)arena_alloc(clusters * cluster_size_bytes);
+	memset(area, 0xFF, clusters * cluster_size_bytes);
+	MBR_memory->cow_start = first;
+	cow_clusters = clusters;
+	cow_map(area);
+	COW_header->root = 0;
+	COW_header->generation = 1;
+	COW_header->snapshot_count = 0;
+	COW_header->snapshot_generation = 0;
+	for (i = 0; i < data_length; i++) {
+		COW_memory[i].refs = fat_get(i) != 0xFFFF;
+		COW_memory[i].birth = 0;
+	}
+	return 0;
+}
+
+// make room for one more snapshot_t, adding a cluster to the snapshot area if needed
+// returns 0, or -1 when the disk is full
+int cow_reserve() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int bytes = sizeof(cow_header_t) + sizeof(cow_t) * MBR_memory->data_length + sizeof(snapshot_t) * (COW_header->snapshot_count + 1);
+	if (bytes <= cow_clusters * cluster_size_bytes) return 0;
+	int cluster = find_free_cluster();
+	if (cluster == -1) return -1;
+	int last = MBR_memory->cow_start;
+	while (fat_get(last) != 0xFFFE) last = fat_get(last);
+	fat_set(last, cluster);
+	uint8_t *area = (uint8_t *)arena_alloc((cow_clusters + 1) * cluster_size_bytes);
+	memset(area, 0xFF, (cow_clusters + 1) * cluster_size_bytes);
+	memcpy(area, COW_header, cow_clusters * cluster_size_bytes);
+	cow_clusters++;
+	cow_map(area);
+	return 0;
+}
+
+// **************** end snapshot functions *****************//
+
+// 1 if cluster holds a directory's entry, for handles that come from outside such as fsd's clients
+int is_directory(int cluster) {
+	if (cluster < 0 || cluster >= MBR_memory->data_length || fat_get(cluster) == 0xFFFF) return 0;
+	entry_t *entry = (entry_t *)data_cluster(cluster);
+	return entry->entry_type == 1 && entry->name_len <= 16;
+}
+
+// return a child, if any of a directory, release it with slab_free(&entry_slab, ...)
+entry_t *do_ls(int dh, int child_num) {
+	if (load_disk(DISK_NAME) == -1) return NULL;
+	int cluster = handle_cluster(dh);
+	uint8_t *slot = is_directory(cluster) ? child_slot(cluster, child_num) : NULL;
+	if (slot == NULL) {
+		unload_disk();
+		return NULL;
+	}
+	entry_ptr_t ptr;
+	ptr.type = slot[0];
+	ptr.reserved = slot[1];
+	ptr.start = le16(slot + 2);
+	entry_t *child = NULL;
+	if (ptr.type == 0 || ptr.type == 1) {
+		child = fill_entry((int)ptr.start);
+		if (ptr.type == 0) child->size = wb_size(ptr.start, child->size);
+	}
+	unload_disk();
+	return child;
+}
+
+// make a new directory where the parent is located at the data cluster indicated by dh
+// returns 0, or -1 if it wasn't made
+int do_mkdir(int dh, char* child_name) {
+	if (strlen(child_name) > 16) {
+		printf("Directory \"%s\" not made: name of directory must not exceed 16 bytes\n", child_name);
+		return -1;
+	}
+	if (dh & SNAPSHOT_HANDLE) {
+		printf("Directory \"%s\" not made: snapshots are read-only\n", child_name);
+		return -1;
+	}
+
+	if (load_disk(DISK_NAME) == -1) return -1;
+	if (!is_directory(handle_cluster(dh))) {
+		printf("Directory \"%s\" not made: %d isn't a directory handle\n", child_name, dh);
+		unload_disk();
+		return -1;
+	}
+
+	// a directory shared with a snapshot is copied before it's written
+	dh = cow_dir(dh);
+	if (dh == -1) {
+		printf("fs_mkdir: directory not made\nno free space left on disk to copy the parent directory\n");
+		unload_disk();
+		return -1;
+	}
+	
+	// open disk
+	disk_open(DISK_NAME);
+	int cluster_size_bytes = geo.cluster_bytes;
+
+	// update children count of parent directory
+	off_t parent_location = cluster_offset(dh);
+	entry_t *parent = fill_entry(dh);
+	parent->children_count++;
+
+	// create the child directory and write to disk
+	// find the next available spot to write to disk, then a slot in the parent to point to it
+	int child_cluster = find_free_cluster();
+	//printf("child_cluster = %d\n", child_cluster);
+	off_t ptr_offset = child_cluster == -1 ? -1 : open_slot(dh);
+	if (ptr_offset == -1) {
+		printf("fs_mkdir: directory not made\nno free space left on disk for new directory\n");
+		disk_close();
+		slab_free(&entry_slab, parent);
+		unload_disk();
+		return -1;
+	}
+	// the rest of the cluster is free slots, whatever the cluster held before
+	entry_t *child = create_directory_entry(child_name);
+	off_t child_location = cluster_offset(child_cluster);
+	uint8_t *child_data = (uint8_t *)arena_alloc(cluster_size_bytes);
+	memset(child_data, 0xFF, cluster_size_bytes);
+	memcpy(child_data, child, sizeof(entry_t));
+	disk_write(child_data, cluster_size_bytes, child_location);
+
+	// pointer to the new directory, 1 indicates pointer to a directory
+	entry_ptr_t *ptr_to_child = create_ptr(1, child_cluster);
+	disk_write(ptr_to_child, sizeof(entry_ptr_t), ptr_offset);
+
+	// write the updated parent to disk
+	disk_write(parent, sizeof(entry_t), parent_location);
+	
+	// write the updated FAT area to disk
+	TRACE_BEGIN("fat_write_back");
+	if (COW_header != NULL) cow_write_back();
+	else fat_write_back();
+	TRACE_END("fat_write_back");
+
+	disk_close();	
+
+	// free up any allocated memory
+	slab_free(&entry_slab, child);
+	slab_free(&entry_slab, parent);
+	slab_free(&ptr_slab, ptr_to_child);
+	unload_disk();
+	return 0;
+}
+
+
+// open a directory with the absolute path name, in the snapshot called snapshot unless it's NULL
+int do_opendir(char *absolute_path, char *snapshot) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int root_cluster = live_root();
+	int handle_flags = 0;
+	if (snapshot != NULL) {
+		int i = snapshot_find(snapshot);
+		if (i == -1) {
+			unload_disk();
+			return -1;
+		}
+		root_cluster = SNAP_memory[i].root;
+		handle_flags = SNAPSHOT_HANDLE;
+	}
+
+	// while parsing the path given by absolute_path, add each directory name to a linked list
+	node_t *root = NULL; // head pointer/root of linked list of directories in the path
+	char *token; // each token is a directory
+	//printf("absolute path: %s\n", absolute_path);
+	// check that path isn't empty
+	if (strlen(absolute_path) == 0) {
+		unload_disk();
+		return -1;
+	}
+	token = strtok(absolute_path, "/");
+	// if root is not first directory given in path, then return -1
+	if (token == NULL || strcmp(token, "root") != 0) {
+		unload_disk();
+		return -1;
+	}
+	// start building the list, that will be checked farther down
+	insert(&root, token);
+	while (token != NULL) {
+		//printf("%s\n", token);
+		token = strtok(NULL, "/");
+		insert(&root, token);
+	}
+	//print(&root);
+
+	// start checking the linked list of directories
+	if (get_length(&root) <= 1) {
+		// length 0 shouldn't ever happen, but inserted just in case
+		// if length of list of directories is 1, then only directory is "root"
+		int dh = get_length(&root) == 1 ? root_cluster | handle_flags : -1;
+		empty_list(&root);
+		unload_disk();
+		return dh;
+	} else {
+		int dh_current = root_cluster; // the cluster that the current directory is held
+		char *dir_current = "root"; // current directory
+		char *dir_next = get_next_dir(&root, dir_current); // next directory in the path
+		int i;
+		int path_length = get_length(&root);
+		for (i=0; i<path_length-1; i++) {
+			slot_cursor_t cursor; // walks the pointer slots of the current directory
+			slot_cursor_init(&cursor, dh_current);
+			STAT_ADD(lookups, 1);
+			//printf("current and next dir = %s, %s\n", dir_current, dir_next);
+			
+			while(1) {
+				uint8_t *slot = next_child(&cursor);
+				// no child present, or no child matches the directory being searched for, return -1
+				if (slot == NULL) {
+					//printf("child returned was NULL\n");
+					empty_list(&root);
+					unload_disk();
+					return -1;
+				}
+				STAT_ADD(lookup_entries, 1);
+				if (slot[0] != 1) continue; // only directories are on a path
+				// pull the pointer location of the child from the data that is in memory
+				int dh_child = le16(slot + 2);
+				entry_t *child = fill_entry(dh_child);
+				// child found with matching name
+				if (strcmp(child->name, dir_next) == 0) {
+					dh_current = dh_child; // update
+					//printf("child name, dh %s %d\n", child->name, dh_current);
+					slab_free(&entry_slab, child);
+					break;
+				}
+				slab_free(&entry_slab, child);
+			}
+
+			dir_current = dir_next; // update current directory
+			dir_next = get_next_dir(&root, dir_current); // find the next directory in path 
+		
+		}
+		empty_list(&root);
+		unload_disk();
+		//printf("dh_current %d\n", dh_current);	
+		return dh_current | handle_flags;
+	}
+
+	empty_list(&root);	
+	unload_disk();
+	return -1;
+}
+
+// ************************** reclaim related functions *****************//
+// fs_rmdir and fs_unlink only take the entry out of its parent, the clusters below it stay
+// allocated until the reclaim thread returns them to the FAT
+// the thread frees at most RECLAIM_BATCH clusters per batch, each batch under fs_lock, so
+// removing a large tree or file returns at once and never holds up other operations for long
+#define RECLAIM_BATCH 1024
+
+enum { RECLAIM_DIR, RECLAIM_OVERFLOW, RECLAIM_FILE, RECLAIM_CLUSTER };
+
+typedef struct {
+	int cluster;
+	int kind; // a directory or overflow cluster also frees what it points to, a file its FAT chain
+} reclaim_item_t;
+
+reclaim_item_t *reclaim_stack = NULL;
+int reclaim_count = 0;
+int reclaim_capacity = 0;
+int reclaim_active = 0; // 1 while a batch is running
+int reclaim_started = 0;
+pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER; // taken after fs_lock, never before it
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+
+// add a cluster to the reclaim stack, reclaim_lock must be held
+void reclaim_add(int cluster, int kind) {
+	if (reclaim_count == reclaim_capacity) {
+		reclaim_capacity = reclaim_capacity ? reclaim_capacity * 2 : 64;
+		reclaim_stack = (reclaim_item_t *)realloc(reclaim_stack, sizeof(reclaim_item_t) * reclaim_capacity);
+	}
+	reclaim_stack[reclaim_count].cluster = cluster;
+	reclaim_stack[reclaim_count].kind = kind;
+	reclaim_count++;
+}
+
+int compare_int(const void *a, const void *b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+// free up to RECLAIM_BATCH clusters from the stack and write the FAT back once, then punch
+// the freed clusters out of the disk file, each run of neighbours at once
+void reclaim_batch() {
+	io_lock();
+	TRACE_BEGIN("reclaim_batch");
+	if (load_disk(DISK_NAME) == -1) {
+		// the clusters stay allocated until fsck returns them as leaked, rather than the thread trying forever
+		pthread_mutex_lock(&reclaim_lock);
+		printf("reclaim: %d clusters not freed\n", reclaim_count);
+		reclaim_count = 0;
+		pthread_mutex_unlock(&reclaim_lock);
+		TRACE_END("reclaim_batch");
+		io_unlock();
+		return;
+	}
+	int cluster_size_bytes = geo.cluster_bytes;
+	int freed = 0;
+	int *punch = (int *)arena_alloc(sizeof(int) * RECLAIM_BATCH);
+	pthread_mutex_lock(&reclaim_lock);
+	while (reclaim_count > 0 && freed < RECLAIM_BATCH) {
+		reclaim_item_t item = reclaim_stack[--reclaim_count];
+		int cluster = item.cluster;
+		if (cluster >= MBR_memory->data_length || fat_get(cluster) == 0xFFFF) continue;
+		// a cluster a snapshot or another copy still points to only loses a reference
+		if (COW_memory != NULL && COW_memory[cluster].refs > 1) {
+			COW_memory[cluster].refs--;
+			continue;
+		}
+		if (COW_memory != NULL) COW_memory[cluster].refs = 0;
+		if (item.kind == RECLAIM_DIR || item.kind == RECLAIM_OVERFLOW) {
+			uint8_t *data = data_cluster(cluster);
+			int first = item.kind == RECLAIM_DIR ? sizeof(entry_t) : 0;
+			int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+			int s;
+			for (s = 0; s < slots; s++) {
+				uint8_t *slot = data + first + s * sizeof(entry_ptr_t);
+				int target = le16(slot + 2);
+				if (slot[0] == 0) reclaim_add(target, RECLAIM_FILE);
+				else if (slot[0] == 1) reclaim_add(target, RECLAIM_DIR);
+				else if (slot[0] == 2) reclaim_add(target, RECLAIM_OVERFLOW);
+			}
+		} else if (item.kind == RECLAIM_FILE && fat_get(cluster) != 0xFFFE) {
+			reclaim_add(fat_get(cluster), RECLAIM_FILE);
+		}
+		fat_set(cluster, 0xFFFF);
+		if (cluster < dedup_length) dedup_key[cluster] = 0;
+		wb_drop(cluster); // a file removed with its directory
+		punch[freed++] = cluster;
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	disk_open(DISK_NAME);
+	if (COW_header != NULL) {
+		cow_write_back();
+	} else {
+		fat_write_back();
+	}
+	qsort(punch, freed, sizeof(int), compare_int);
+	int i, j;
+	for (i = 0; i < freed; i = j) {
+		for (j = i + 1; j < freed && punch[j] == punch[j - 1] + 1; j++);
+		disk_punch(cluster_offset(punch[i]), (size_t)(j - i) * cluster_size_bytes);
+	}
+	disk_close();
+	unload_disk();
+	STAT_ADD(reclaim_batches, 1);
+	STAT_ADD(clusters_reclaimed, freed);
+	TRACE_END("reclaim_batch");
+	io_unlock();
+}
+
+void *reclaim_worker(void *arg) {
+	fs_io_class(IO_BACKGROUND);
+	pthread_mutex_lock(&reclaim_lock);
+	while (1) {
+		while (reclaim_count == 0) pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+		reclaim_active = 1;
+		pthread_mutex_unlock(&reclaim_lock);
+		reclaim_batch();
+		pthread_mutex_lock(&reclaim_lock);
+		reclaim_active = 0;
+		pthread_cond_broadcast(&reclaim_cond);
+	}
+	return NULL;
+}
+
+// hand a cluster to the reclaim thread, starting the thread on first use
+// a shared mount has no thread, the clusters are reclaimed before its lock is let go
+void reclaim_queue(int cluster, int kind) {
+	pthread_mutex_lock(&reclaim_lock);
+	if (!reclaim_started && !SHARED_MOUNT) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, reclaim_worker, NULL);
+		pthread_detach(thread);
+		reclaim_started = 1;
+	}
+	reclaim_add(cluster, kind);
+	pthread_cond_broadcast(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+// reclaim every queued cluster on this thread, for operations that need the FAT to be complete
+// with fs_lock held no batch of the reclaim thread is running, only waiting for the lock
+void reclaim_drain() {
+	pthread_mutex_lock(&reclaim_lock);
+	while (reclaim_count > 0) {
+		pthread_mutex_unlock(&reclaim_lock);
+		reclaim_batch();
+		pthread_mutex_lock(&reclaim_lock);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+// wait until every queued cluster is back in the FAT, must not be called with fs_lock held
+void fs_reclaim_wait() {
+	pthread_mutex_lock(&reclaim_lock);
+	while (reclaim_count > 0 || reclaim_active) pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+// **************** end reclaim functions *****************//
+
+// ************************** shared mount related functions ************//
+// with --shared, the processes using a disk mount it together: a POSIX shared memory segment
+// named after the disk holds a lock that every operation runs under, across processes as fs_lock
+// is within one, and in direct mode the block cache, so the processes share one cache rather than
+// each holding a copy of the disk; in buffered mode the kernel page cache is already shared
+// an operation reads the MBR, the FAT and the free space summary from the disk as it starts, so
+// once operations take turns their metadata updates can't clobber each other; what a process
+// keeps from one operation to the next (the dedup index, where copied directories went) is
+// dropped once another process has written the disk, and a shared mount writes through and
+// reclaims removed clusters before it lets go of the lock, since buffered pages and pending
+// reclaims of one process would be invisible to the others
+// the lock is robust: if its holder dies during an operation, the next process to take it drops
+// the shared cache as a crash would, leaving the disk as the operation had written it
+// every process using the disk has to mount it shared
+#define SHM_MAGIC 0x4D485348 // "HSHM"
+#define SHM_SLOTS (CACHE_BYTES / DIRECT_ALIGN) // most blocks the shared cache holds
+#define SHM_POOL_ALIGN 65536 // the largest sector size, so the pool suits O_DIRECT with any of them
+
+typedef struct {
+	uint32_t magic; // set once the creator has set the segment up
+	int processes; // attached to it
+	pthread_mutex_t lock; // robust and process shared
+	uint64_t changes; // operations that wrote the disk
+	size_t block_bytes; // of the shared block cache, 0 until a process in direct mode sets it up
+	int cache_slots;
+	uint64_t cache_clock;
+} shm_header_t;
+
+shm_header_t *shm = NULL;
+char shm_name[32];
+uint64_t shm_changes; // changes as this process last saw them
+int shm_exit_registered = 0;
+
+size_t shm_blocks_offset() {
+	return (sizeof(shm_header_t) + 63) & ~(size_t)63;
+}
+
+size_t shm_hash_offset() {
+	return shm_blocks_offset() + sizeof(cache_block_t) * SHM_SLOTS;
+}
+
+size_t shm_pool_offset() {
+	return (shm_hash_offset() + sizeof(int) * SHM_SLOTS + SHM_POOL_ALIGN - 1) & ~(size_t)(SHM_POOL_ALIGN - 1);
+}
+
+size_t shm_bytes() {
+	return shm_pool_offset() + CACHE_BYTES;
+}
+
+// take the lock, putting things right if its last holder died with it
+void shm_lock() {
+	int result = pthread_mutex_lock(&shm->lock);
+	if (result == EOWNERDEAD) {
+		printf("shared mount: a process died during an operation, what it hadn't written is lost, run --fsck\n");
+		shm->block_bytes = 0;
+		shm->changes++;
+		shm->processes--; // it won't detach
+		pthread_mutex_consistent(&shm->lock);
+	} else if (result != 0) {
+		printf("shared mount: unable to take the lock of %s\n", shm_name);
+		exit(1);
+	}
+}
+
+// point the block cache at the one in the segment
+void shm_cache_map() {
+	uint8_t *base = (uint8_t *)shm;
+	cache = (cache_block_t *)(base + shm_blocks_offset());
+	cache_hash = (int *)(base + shm_hash_offset());
+	cache_pool = base + shm_pool_offset();
+	cache_clock = &shm->cache_clock;
+	if (cache_order == NULL) cache_order = (int *)malloc(sizeof(int) * SHM_SLOTS);
+}
+
+// stop using the block cache in the segment, the next disk_open finds it or sets it up again
+void shm_cache_unmap() {
+	cache = NULL;
+	cache_hash = NULL;
+	cache_pool = NULL;
+	cache_clock = &cache_local_clock;
+	cache_slots = 0;
+	block_bytes = 0;
+	block_mask = 0;
+}
+
+// from cache_init: set the block cache up in the segment for the block size worked out,
+// returns 0 if the disk isn't mounted shared
+int shm_cache_init() {
+	if (shm == NULL) return 0;
+	if ((size_t)cache_slots * block_bytes > CACHE_BYTES) {
+		printf("shared mount: blocks of %zu bytes don't fit the shared block cache\n", block_bytes);
+		exit(1);
+	}
+	shm_cache_map();
+	cache_reset();
+	shm->block_bytes = block_bytes;
+	shm->cache_slots = cache_slots;
+	shm->cache_clock = 0;
+	return 1;
+}
+
+// from cache_free: drop the shared block cache, returns 0 if the disk isn't mounted shared
+int shm_cache_free() {
+	if (shm == NULL) return 0;
+	shm->block_bytes = 0;
+	shm_cache_unmap();
+	return 1;
+}
+
+// detach from the segment and end the shared mount, the last process to detach removes it
+void shm_detach() {
+	SHARED_MOUNT = 0;
+	if (shm == NULL) return;
+	// exiting during an operation leaves the lock to be found with its holder dead
+	if (io_held == 0) {
+		shm_lock();
+		if (--shm->processes == 0) shm_unlink(shm_name);
+		pthread_mutex_unlock(&shm->lock);
+	}
+	if (cache_pool == (uint8_t *)shm + shm_pool_offset()) shm_cache_unmap();
+	munmap(shm, shm_bytes());
+	shm = NULL;
+}
+
+// attach to the segment of the disk, creating it if no process has
+void shm_attach() {
+	char path[PATH_MAX];
+	if (getcwd(path, sizeof(path) - sizeof(DISK_NAME) - 1) == NULL) strcpy(path, ".");
+	strcat(path, "/" DISK_NAME);
+	snprintf(shm_name, sizeof(shm_name), "/hw4-%08x", crc32c(path, strlen(path)));
+	while (shm == NULL) {
+		int created = 1;
+		int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1 && errno == EEXIST) {
+			created = 0;
+			fd = shm_open(shm_name, O_RDWR, 0600);
+			if (fd == -1 && errno == ENOENT) continue; // removed by its last process meanwhile
+		}
+		if (fd == -1 || (created && ftruncate(fd, shm_bytes()) != 0)) {
+			printf("shared mount: unable to create %s\n", shm_name);
+			exit(1);
+		}
+		// the creator sizes the segment and then sets it up, wait for both
+		struct stat st;
+		int tries;
+		for (tries = 0; fstat(fd, &st) == 0 && st.st_size < (off_t)shm_bytes() && tries < 1000; tries++) usleep(1000);
+		shm_header_t *header = (shm_header_t *)mmap(NULL, shm_bytes(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (st.st_size < (off_t)shm_bytes() || header == MAP_FAILED) {
+			printf("shared mount: unable to map %s\n", shm_name);
+			exit(1);
+		}
+		if (created) {
+			pthread_mutexattr_t attr;
+			pthread_mutexattr_init(&attr);
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+			pthread_mutex_init(&header->lock, &attr);
+			pthread_mutexattr_destroy(&attr);
+			header->processes = 0;
+			header->changes = 0;
+			header->block_bytes = 0;
+			__atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+		}
+		for (tries = 0; __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC && tries < 1000; tries++) usleep(1000);
+		if (header->magic != SHM_MAGIC) {
+			printf("shared mount: %s was never set up, remove it from /dev/shm\n", shm_name);
+			exit(1);
+		}
+		if (cache != NULL) cache_free(); // a cache of this process from before the mount
+		shm = header;
+		shm_lock();
+		// the last process may have detached and removed the name before the lock was taken,
+		// then a new segment is where the others will look
+		struct stat now;
+		int again = shm_open(shm_name, O_RDWR, 0600);
+		if (again == -1 || fstat(again, &now) != 0 || now.st_ino != st.st_ino) {
+			pthread_mutex_unlock(&shm->lock);
+			munmap(shm, shm_bytes());
+			shm = NULL;
+		} else {
+			shm->processes++;
+			shm_changes = shm->changes;
+			pthread_mutex_unlock(&shm->lock);
+		}
+		if (again != -1) close(again);
+		close(fd);
+	}
+	if (!shm_exit_registered) atexit(shm_detach);
+	shm_exit_registered = 1;
+}
+
+// from io_lock, once fs_lock is held: take the lock of the shared mount
+void shm_acquire() {
+	if (!SHARED_MOUNT) return;
+	if (shm == NULL) shm_attach();
+	TRACE_BEGIN("shm_lock_wait");
+	shm_lock();
+	TRACE_END("shm_lock_wait");
+	if (shm->changes != shm_changes) {
+		free(cow_forward);
+		cow_forward = NULL;
+		cow_forward_length = 0;
+		free(dedup_key);
+		dedup_key = NULL;
+		dedup_length = 0;
+		shm_changes = shm->changes;
+	}
+	// the shared block cache may have been dropped, or set up again for another block size
+	if (DIRECT_IO || disk_cached) {
+		if (shm->block_bytes == 0) {
+			shm_cache_unmap();
+		} else if (cache == NULL || block_bytes != shm->block_bytes) {
+			block_bytes = shm->block_bytes;
+			block_mask = block_bytes - 1;
+			cache_slots = shm->cache_slots;
+			shm_cache_map();
+		}
+	}
+	disk_written = 0;
+}
+
+// from io_unlock, before fs_lock is let go: reclaim what was removed, then let go of the lock
+void shm_release() {
+	if (shm == NULL) return;
+	reclaim_drain();
+	if (disk_written) {
+		shm->changes++;
+		// a buffered write went around the shared block cache
+		if (!disk_cached) shm->block_bytes = 0;
+	}
+	shm_changes = shm->changes;
+	pthread_mutex_unlock(&shm->lock);
+}
+// **************** end shared mount functions *****************//
+
+// find the child called name of the directory at cluster dh, type is 1 for a directory, 0 for a
+// file or -1 for either; the cursor is left on the child's slot
+// returns the cluster of the child, or -1 if there is none
+int find_child(int dh, char *name, int type, slot_cursor_t *cursor) {
+	slot_cursor_init(cursor, dh);
+	uint8_t *slot;
+	while ((slot = next_child(cursor)) != NULL) {
+		if (type != -1 && slot[0] != type) continue;
+		int child_cluster = le16(slot + 2);
+		if (child_cluster >= MBR_memory->data_length) continue;
+		// compared where the entry is held, the slot has been read by now
+		if (strncmp(((entry_t *)data_cluster(child_cluster))->name, name, 16) == 0) return child_cluster;
+	}
+	return -1;
+}
+
+// clear the slot the cursor is on in the directory at cluster dh and update its children count
+// an overflow cluster left without children is taken out of the chain, the link that led to it
+// now points wherever its own last slot did, and the cluster is reclaimed
+void clear_slot(int dh, slot_cursor_t *cursor) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	disk_open(DISK_NAME);
+	uint8_t free_slot[sizeof(entry_ptr_t)];
+	memset(free_slot, 0xFF, sizeof(entry_ptr_t));
+	disk_write(free_slot, sizeof(entry_ptr_t), cursor_location(cursor));
+
+	// update children count of parent directory
+	off_t parent_location = cluster_offset(dh);
+	entry_t *parent = fill_entry(dh);
+	parent->children_count--;
+	disk_write(parent, sizeof(entry_t), parent_location);
+	slab_free(&entry_slab, parent);
+
+	if (cursor->cluster != dh) {
+		uint8_t *data = data_cluster(cursor->cluster);
+		int slots = cluster_size_bytes / sizeof(entry_ptr_t);
+		int empty = 1;
+		int s;
+		for (s = 0; s < slots - 1; s++) {
+			if (data[s * sizeof(entry_ptr_t)] == 0 || data[s * sizeof(entry_ptr_t)] == 1) empty = 0;
+		}
+		if (empty) {
+			uint8_t last[sizeof(entry_ptr_t)];
+			memcpy(last, data + (slots - 1) * sizeof(entry_ptr_t), sizeof(entry_ptr_t));
+			disk_write(last, sizeof(entry_ptr_t), cursor->link);
+			reclaim_queue(cursor->cluster, RECLAIM_CLUSTER);
+		}
+	}
+	disk_close();
+}
+
+// remove the child called name from the directory at cluster dh, type is 1 for a directory and
+// 0 for a file; the parent's slot is cleared now and the child's clusters are reclaimed later
+// returns 0, or -1 if the directory has no such child or dh isn't a live directory
+int do_remove(int dh, char *name, int type) {
+	if (dh & SNAPSHOT_HANDLE) return -1;
+	if (load_disk(DISK_NAME) == -1) return -1;
+	dh = is_directory(handle_cluster(dh)) ? cow_dir(dh) : -1;
+	slot_cursor_t cursor;
+	int target = dh == -1 ? -1 : find_child(dh, name, type, &cursor);
+	if (target == -1) {
+		unload_disk();
+		return -1;
+	}
+	clear_slot(dh, &cursor);
+	if (type == 0) wb_drop(target); // what it had buffered never reaches the disk
+	reclaim_queue(target, type == 1 ? RECLAIM_DIR : RECLAIM_FILE);
+	unload_disk();
+	return 0;
+}
+
+// copy path into parent without trailing slashes and split it at the last slash
+// returns the last name, which lives in parent after the end of the parent path, or NULL for "root"
+char *split_path(char *path, char *parent) {
+	strcpy(parent, path);
+	size_t len = strlen(parent);
+	while (len > 0 && parent[len - 1] == '/') parent[--len] = '\0';
+	char *slash = strrchr(parent, '/');
+	if (slash == NULL) return NULL;
+	*slash = '\0';
+	return slash + 1;
+}
+
+// rename or move the entry at old_path to new_path, both absolute paths like fs_opendir takes
+// only the slot pointing at the entry moves, so the cost doesn't depend on what is below it
+// the new slot is written before the old one is cleared, so a crash in between leaves a
+// cross-link for fsck rather than losing the entry
+// returns 0, or -1 if old_path doesn't exist, new_path already does or is below old_path
+int do_rename(char *old_path, char *new_path) {
+	char old_parent[strlen(old_path) + 1];
+	char new_parent[strlen(new_path) + 1];
+	char *old_name = split_path(old_path, old_parent);
+	char *new_name = split_path(new_path, new_parent);
+	if (old_name == NULL || new_name == NULL || strlen(new_name) == 0 || strlen(new_name) > 16) return -1;
+
+	// a directory can't be moved below itself
+	size_t old_len = strlen(old_parent) + 1 + strlen(old_name);
+	char new_full[strlen(new_path) + 1];
+	sprintf(new_full, "%s/%s", new_parent, new_name);
+	char old_full[old_len + 1];
+	sprintf(old_full, "%s/%s", old_parent, old_name);
+	if (strcmp(old_full, new_full) == 0) return 0;
+	if (strncmp(new_full, old_full, old_len) == 0 && new_full[old_len] == '/') return -1;
+
+	// fs_opendir tokenizes its argument, so it gets copies
+	char path[strlen(old_parent) + strlen(new_parent) + 2];
+	strcpy(path, old_parent);
+	int src = do_opendir(path, NULL);
+	strcpy(path, new_parent);
+	int dst = do_opendir(path, NULL);
+	if (src == -1 || dst == -1) return -1;
+
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	slot_cursor_t cursor;
+	slot_cursor_t existing;
+	src = cow_dir(src);
+	dst = src == -1 ? -1 : cow_dir(dst);
+	int target = dst == -1 ? -1 : find_child(src, old_name, -1, &cursor);
+	if (target == -1 || find_child(dst, new_name, -1, &existing) != -1) {
+		unload_disk();
+		return -1;
+	}
+	uint8_t type = data_cluster(cursor.cluster)[cursor.offset - sizeof(entry_ptr_t)];
+	// the entry itself is renamed in place, so it can't be shared either
+	if (cow_active() && COW_memory[target].refs > 1) {
+		target = cow_copy(target, cursor_location(&cursor), type == 1 ? sizeof(entry_t) : cluster_size_bytes);
+		if (target == -1) {
+			cow_write_back();
+			cow_dirty = 0;
+			unload_disk();
+			return -1;
+		}
+	}
+
+	disk_open(DISK_NAME);
+	if (src != dst) {
+		off_t ptr_offset = open_slot(dst);
+		if (ptr_offset == -1) {
+			printf("fs_rename: not moved\nno free space left on disk for the new parent\n");
+			disk_close();
+			// the entry may have been copied out of a snapshot into its old slot already
+			if (cow_dirty) {
+				cow_write_back();
+				cow_dirty = 0;
+			}
+			unload_disk();
+			return -1;
+		}
+		entry_ptr_t *ptr = create_ptr(type, target);
+		disk_write(ptr, sizeof(entry_ptr_t), ptr_offset);
+		slab_free(&ptr_slab, ptr);
+		entry_t *parent = fill_entry(dst);
+		parent->children_count++;
+		disk_write(parent, sizeof(entry_t), cluster_offset(dst));
+		slab_free(&entry_slab, parent);
+		// open_slot may have taken a cluster for an overflow
+		if (COW_header != NULL) cow_write_back();
+		else fat_write_back();
+		disk_barrier();
+		clear_slot(src, &cursor);
+	}
+
+	// the name is changed in place in the entry itself
+	entry_t *child = fill_entry(target);
+	child->name_len = strlen(new_name);
+	memset(child->name, 0, 16);
+	memcpy(child->name, new_name, child->name_len);
+	disk_write(child, sizeof(entry_t), cluster_offset(target));
+	slab_free(&entry_slab, child);
+	disk_close();
+	if (cow_dirty) {
+		cow_write_back();
+		cow_dirty = 0;
+	}
+	unload_disk();
+	return 0;
+}
+
+// take a read-only snapshot of the volume called name, in constant time
+// returns 0, or -1 if the name is taken or too long, or the disk is full
+int do_snapshot(char *name) {
+	if (strlen(name) == 0 || strlen(name) > 16) return -1;
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int created = 0;
+	if (COW_header == NULL) {
+		if (cow_create() == -1) {
+			printf("fs_snapshot: snapshot not taken\nno free space left on disk for the snapshot area\n");
+			unload_disk();
+			return -1;
+		}
+		created = 1;
+	}
+	if (snapshot_find(name) != -1 || COW_header->generation == 0xFFFF || cow_reserve() == -1) {
+		unload_disk();
+		return -1;
+	}
+	snapshot_t *snapshot = &SNAP_memory[COW_header->snapshot_count++];
+	memset(snapshot->name, 0, 16);
+	memcpy(snapshot->name, name, strlen(name));
+	snapshot->root = live_root();
+	snapshot->generation = COW_header->generation;
+	COW_memory[snapshot->root].refs++;
+	COW_header->snapshot_generation = COW_header->generation++;
+
+	// the area is on disk before the MBR points to it
+	cow_write_back();
+	if (created) {
+		disk_open(DISK_NAME);
+		disk_barrier();
+		disk_write(&MBR_memory->cow_start, sizeof(uint16_t), offsetof(mbr_t, cow_start));
+		disk_close();
+	}
+	unload_disk();
+	return 0;
+}
+
+// delete the snapshot called name, its clusters no other tree reaches are reclaimed later
+// returns 0, or -1 if there is no such snapshot
+int do_snapshot_delete(char *name) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int i = snapshot_find(name);
+	if (i == -1) {
+		unload_disk();
+		return -1;
+	}
+	int root = SNAP_memory[i].root;
+	memmove(&SNAP_memory[i], &SNAP_memory[i + 1], sizeof(snapshot_t) * (COW_header->snapshot_count - i - 1));
+	COW_header->snapshot_count--;
+	COW_header->snapshot_generation = 0;
+	for (i = 0; i < COW_header->snapshot_count; i++) {
+		if (SNAP_memory[i].generation > COW_header->snapshot_generation) COW_header->snapshot_generation = SNAP_memory[i].generation;
+	}
+	cow_write_back();
+	reclaim_queue(root, RECLAIM_DIR);
+	unload_disk();
+	return 0;
+}
+
+// copy snapshot number n into snapshot, returns 0 or -1 after the last snapshot
+int do_snapshot_ls(int n, snapshot_t *snapshot) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int found = COW_header != NULL && n >= 0 && n < COW_header->snapshot_count;
+	if (found) memcpy(snapshot, &SNAP_memory[n], sizeof(snapshot_t));
+	unload_disk();
+	return found ? 0 : -1;
+}
+
+// ************************** compression related functions *************//
+// chunks of compressed files use the LZ4 block format: every sequence starts with a token holding
+// the number of literals in its high nibble and the match length less 4 in its low one, where a
+// nibble of 15 goes on in bytes added to it up to the first one below 255; then come the literals
+// and a 2 byte little endian offset back into the output to copy the match from
+// the last sequence is literals only, so no match reaches into the last LZ4_LAST_LITERALS bytes
+#define LZ4_HASH_BITS 12
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MATCH_LIMIT 12 // no match starts in the last 12 bytes
+
+// write the part of a length that didn't fit in its nibble, returns the new output position
+int lz4_put_length(uint8_t *dst, int o, int length) {
+	while (length >= 255) {
+		dst[o++] = 255;
+		length -= 255;
+	}
+	dst[o++] = length;
+	return o;
+}
+
+// add the bytes following a nibble of 15 to length, returns -1 if they run past n
+int lz4_get_length(const uint8_t *src, int n, int *i, int length) {
+	int b;
+	do {
+		if (*i >= n) return -1;
+		b = src[(*i)++];
+		length += b;
+	} while (b == 255);
+	return length;
+}
+
+// compress n bytes of src into dst, returns the compressed length or 0 if it's over capacity
+int lz4_compress(const uint8_t *src, int n, uint8_t *dst, int capacity) {
+	uint32_t table[1 << LZ4_HASH_BITS]; // where each hash of 4 bytes was last seen
+	memset(table, 0, sizeof(table));
+	int anchor = 0; // first byte not written out yet
+	int o = 0;
+	int i = 0;
+	while (i < n - LZ4_MATCH_LIMIT) {
+		uint32_t sequence, candidate;
+		memcpy(&sequence, src + i, 4);
+		uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+		int ref = table[hash];
+		table[hash] = i;
+		memcpy(&candidate, src + ref, 4);
+		if (ref >= i || i - ref > 0xFFFF || candidate != sequence) {
+			i++;
+			continue;
+		}
+		while (i > anchor && ref > 0 && src[i - 1] == src[ref - 1]) {
+			i--;
+			ref--;
+		}
+		int length = 4;
+		while (i + length < n - LZ4_LAST_LITERALS && src[i + length] == src[ref + length]) length++;
+		int literals = i - anchor;
+		if (o + 1 + literals / 255 + 1 + literals + 2 + (length - 4) / 255 + 1 > capacity) return 0;
+		uint8_t *token = dst + o++;
+		*token = (literals < 15 ? literals : 15) << 4 | (length - 4 < 15 ? length - 4 : 15);
+		if (literals >= 15) o = lz4_put_length(dst, o, literals - 15);
+		memcpy(dst + o, src + anchor, literals);
+		o += literals;
+		dst[o++] = (i - ref) & 0xFF;
+		dst[o++] = (i - ref) >> 8;
+		if (length - 4 >= 15) o = lz4_put_length(dst, o, length - 4 - 15);
+		i += length;
+		anchor = i;
+	}
+	int literals = n - anchor;
+	if (o + 1 + literals / 255 + 1 + literals > capacity) return 0;
+	dst[o++] = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15) o = lz4_put_length(dst, o, literals - 15);
+	memcpy(dst + o, src + anchor, literals);
+	return o + literals;
+}
+
+// decompress n bytes of src into dst, returns the decompressed length or -1 if src is corrupt or
+// decompresses to more than capacity
+int lz4_decompress(const uint8_t *src, int n, uint8_t *dst, int capacity) {
+	int i = 0, o = 0;
+	while (i < n) {
+		int token = src[i++];
+		int literals = token >> 4;
+		if (literals == 15 && (literals = lz4_get_length(src, n, &i, literals)) == -1) return -1;
+		if (literals > n - i || literals > capacity - o) return -1;
+		memcpy(dst + o, src + i, literals);
+		i += literals;
+		o += literals;
+		if (i == n) break;
+		if (n - i < 2) return -1;
+		int offset = src[i] | src[i + 1] << 8;
+		i += 2;
+		int length = (token & 15) + 4;
+		if ((token & 15) == 15 && (length = lz4_get_length(src, n, &i, length)) == -1) return -1;
+		if (offset == 0 || offset > o || length > capacity - o) return -1;
+		if (offset >= length) {
+			memcpy(dst + o, dst + o - offset, length);
+		} else {
+			int k;
+			for (k = 0; k < length; k++) dst[o + k] = dst[o + k - offset];
+		}
+		o += length;
+	}
+	return o;
+}
+
+// a chunk being written, compressed by whichever pool thread takes it
+typedef struct {
+	uint8_t *plain; // CHUNK_BYTES of the chunk as it reads
+	int length; // bytes of it inside the file
+	uint8_t *stored; // what goes on disk, plain itself when it didn't shrink
+	int stored_bytes;
+	int raw;
+} chunk_job_t;
+
+chunk_job_t *compress_jobs;
+int compress_count;
+int compress_next;
+
+void *compress_worker(void *arg) {
+	while (1) {
+		int i = __atomic_fetch_add(&compress_next, 1, __ATOMIC_RELAXED);
+		if (i >= compress_count) return NULL;
+		chunk_job_t *job = &compress_jobs[i];
+		// a chunk of zeros is stored as a hole
+		if (job->plain[0] == 0 && memcmp(job->plain, job->plain + 1, job->length - 1) == 0) {
+			job->stored_bytes = 0;
+			job->raw = 0;
+			continue;
+		}
+		job->stored_bytes = lz4_compress(job->plain, job->length, job->stored, job->length - 1);
+		job->raw = job->stored_bytes == 0;
+		if (job->raw) {
+			job->stored = job->plain;
+			job->stored_bytes = job->length;
+		}
+	}
+}
+
+// compress count chunks, on a thread per processor when there are several chunks
+void compress_chunks(chunk_job_t *jobs, int count) {
+	TRACE_BEGIN("compress_chunks");
+	compress_jobs = jobs;
+	compress_count = count;
+	compress_next = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > count) nthreads = count;
+	if (nthreads <= 1) {
+		compress_worker(NULL);
+	} else {
+		pthread_t threads[nthreads];
+		int i;
+		for (i = 0; i < nthreads; i++) pthread_create(&threads[i], NULL, compress_worker, NULL);
+		for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	}
+	TRACE_END("compress_chunks");
+}
+// **************** end compression functions *****************//
+
+// ************************** dedup related functions *******************//
+// files that end in the same clusters can share them: a FAT chain can only be shared from some
+// cluster to its end, so each cluster of a file gets a key covering its contents and everything
+// after it in the chain, and two chains with the same key at some position end the same way
+// the keys of the clusters seen so far are kept in an in-memory index, built up by the writes of
+// this process and by fs_dedup, which scans the live tree a time slice at a time; a match is only
+// shared once the clusters are compared byte for byte
+// sharing counts references in the snapshot area, which is created for it, so a write to a
+// shared cluster copies it first as it does under a snapshot, and reclaim frees it with its last
+// reference; directories are never shared, their entries and slots differ
+int DEDUP = 0; // deduplicate every file written, on top of fs_dedup
+
+typedef struct {
+	uint64_t key; // 0 for an empty slot
+	int cluster;
+} dedup_slot_t;
+
+uint32_t *dedup_hash = NULL; // CRC32C of each data cluster, valid while its dedup_key isn't 0
+dedup_slot_t *dedup_index = NULL; // open addressing, at most one slot per key
+int dedup_index_size = 0; // a power of two, at least twice dedup_length
+int dedup_next = 0; // file of the live tree the next fs_dedup slice starts with
+
+// set up the arrays for the disk loaded, the index starts out empty
+void dedup_init() {
+	if (dedup_key != NULL) return;
+	free(dedup_hash);
+	free(dedup_index);
+	dedup_length = MBR_memory->data_length;
+	dedup_key = (uint64_t *)fs_malloc(sizeof(uint64_t) * dedup_length);
+	memset(dedup_key, 0, sizeof(uint64_t) * dedup_length);
+	dedup_hash = (uint32_t *)fs_malloc(sizeof(uint32_t) * dedup_length);
+	for (dedup_index_size = 1; dedup_index_size < 2 * dedup_length; dedup_index_size <<= 1);
+	dedup_index = (dedup_slot_t *)fs_malloc(sizeof(dedup_slot_t) * dedup_index_size);
+	memset(dedup_index, 0, sizeof(dedup_slot_t) * dedup_index_size);
+	dedup_next = 0;
+}
+
+// key of a cluster with contents hash followed by a chain with key next, 0 at the end of a chain
+uint64_t dedup_chain_key(uint32_t hash, uint64_t next) {
+	uint64_t key = (next ^ hash) * 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	return key * 0xC4CEB9FE1A85EC53ULL | 1;
+}
+
+// cluster indexed under key, -1 if there is none or it has been written or freed since
+int dedup_lookup(uint64_t key) {
+	int mask = dedup_index_size - 1;
+	int i = key & mask;
+	int probes;
+	for (probes = 0; probes < dedup_index_size && dedup_index[i].key != 0; probes++, i = (i + 1) & mask) {
+		if (dedup_index[i].key != key) continue;
+		int cluster = dedup_index[i].cluster;
+		return dedup_key[cluster] == key ? cluster : -1;
+	}
+	return -1;
+}
+
+// index cluster under key, replacing the slot of the same key or else the first stale one
+void dedup_insert(uint64_t key, int cluster) {
+	int mask = dedup_index_size - 1;
+	int i = key & mask;
+	int stale = -1;
+	int probes;
+	dedup_key[cluster] = key;
+	for (probes = 0; probes < dedup_index_size && dedup_index[i].key != 0; probes++, i = (i + 1) & mask) {
+		if (dedup_index[i].key == key) break;
+		if (stale == -1 && dedup_key[dedup_index[i].cluster] != dedup_index[i].key) stale = i;
+	}
+	if (probes == dedup_index_size || dedup_index[i].key == 0) {
+		if (stale != -1) i = stale;
+		else if (probes == dedup_index_size) i = key & mask;
+	}
+	dedup_index[i].key = key;
+	dedup_index[i].cluster = cluster;
+}
+
+// 1 if the count clusters of chain hold the same bytes as the chain from cluster d, which ends with them
+int dedup_same(int *chain, int count, int d) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	uint8_t *copy = (uint8_t *)arena_alloc(cluster_size_bytes);
+	int i;
+	for (i = 0; i < count; i++) {
+		if (d >= MBR_memory->data_length || fat_get(d) == 0xFFFF) return 0;
+		// data_cluster may reuse its buffer in direct mode
+		memcpy(copy, data_cluster(chain[i]), cluster_size_bytes);
+		if (memcmp(copy, data_cluster(d), cluster_size_bytes) != 0) return 0;
+		d = fat_get(d);
+	}
+	return d == 0xFFFE;
+}
+
+// share the longest end of the chain of the live file at fh that the index already knows of,
+// then index the rest of the chain; clusters first to last of the chain were written since they
+// were last hashed, the others are hashed again only if their key isn't known
+// returns the number of clusters given back to the reclaim thread
+int dedup_file(int fh, int first, int last) {
+	uint64_t start = now_ns();
+	TRACE_BEGIN("dedup_file");
+	dedup_init();
+	int cluster_size_bytes = geo.cluster_bytes;
+	int *chain = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int length = 0;
+	int x = fat_get(fh);
+	while (x < MBR_memory->data_length && length < MBR_memory->data_length) {
+		chain[length++] = x;
+		x = fat_get(x);
+	}
+	uint64_t *keys = (uint64_t *)arena_alloc(sizeof(uint64_t) * (length + 1));
+	uint64_t next = 0;
+	int i, hashed = 0;
+	for (i = length - 1; i >= 0; i--) {
+		if (dedup_key[chain[i]] == 0 || (i >= first && i <= last)) {
+			dedup_hash[chain[i]] = crc32c(data_cluster(chain[i]), cluster_size_bytes);
+			hashed++;
+		}
+		next = keys[i] = dedup_chain_key(dedup_hash[chain[i]], next);
+	}
+	int shared = 0;
+	for (i = 0; i < length; i++) {
+		int d = dedup_lookup(keys[i]);
+		if (d == -1 || d == chain[i] || !dedup_same(chain + i, length - i, d)) continue;
+		// the area is on disk before the MBR points to it
+		if (COW_header == NULL) {
+			if (cow_create() == -1) break;
+			cow_write_back();
+			disk_open(DISK_NAME);
+			disk_barrier();
+			disk_write(&MBR_memory->cow_start, sizeof(uint16_t), offsetof(mbr_t, cow_start));
+			disk_close();
+		}
+		// the clusters only this file holds are forgotten now, before reclaim frees them
+		int j;
+		for (j = i; j < length && COW_memory[chain[j]].refs == 1; j++) dedup_key[chain[j]] = 0;
+		fat_set(i == 0 ? fh : chain[i - 1], d);
+		COW_memory[d].refs++;
+		reclaim_queue(chain[i], RECLAIM_FILE);
+		shared = length - i;
+		length = i;
+		break;
+	}
+	for (i = 0; i < length; i++) dedup_insert(keys[i], chain[i]);
+	STAT_ADD(clusters_deduped, shared);
+	STAT_ADD(dedup_hashed, hashed);
+	STAT_ADD(dedup_ns, now_ns() - start);
+	TRACE_END("dedup_file");
+	return shared;
+}
+
+// one time slice of the dedup scanner: every file of the live tree, in breadth first order from
+// where the last slice stopped, is deduplicated against those before it; files indexed already
+// are only hashed again where they were written since
+// returns the number of files left, 0 once the scan is over
+int do_dedup(uint64_t slice_ns) {
+	uint64_t start = now_ns();
+	if (load_disk(DISK_NAME) == -1) return -1;
+	dedup_init();
+	int data_length = MBR_memory->data_length;
+	uint8_t *seen = (uint8_t *)arena_alloc(data_length);
+	int *queue = (int *)arena_alloc(sizeof(int) * data_length);
+	int *files = (int *)arena_alloc(sizeof(int) * data_length);
+	memset(seen, 0, data_length);
+	int head = 0, tail = 0, count = 0;
+	seen[live_root()] = 1;
+	queue[tail++] = live_root();
+	while (head < tail) {
+		slot_cursor_t cursor;
+		slot_cursor_init(&cursor, queue[head++]);
+		uint8_t *slot;
+		while ((slot = next_child(&cursor)) != NULL) {
+			int child = le16(slot + 2);
+			if (slot[0] > 1 || child >= data_length || seen[child]) continue;
+			seen[child] = 1;
+			if (slot[0] == 1) queue[tail++] = child;
+			else files[count++] = child;
+		}
+	}
+	int i, shared = 0;
+	for (i = dedup_next; i < count; i++) {
+		if (i > dedup_next && (now_ns() - start > slice_ns || io_preempted())) break;
+		shared += dedup_file(files[i], 0, -1);
+	}
+	dedup_next = i < count ? i : 0;
+	if (shared > 0) cow_write_back();
+	unload_disk();
+	return count - i;
+}
+// **************** end dedup functions *****************//
+
+// ************************** file related functions ********************//
+// a file handle is the cluster of the file's entry, like a directory handle, and a file opened
+// through a snapshot directory gives a read-only handle
+// cluster k of an uncompressed file's chain holds its bytes from k clusters on, unless the file is
+// sparse, when it's the k-th cluster its run map lists; a compressed file
+// is written a whole chunk at a time: the chunks a write touches are read back, patched,
+// compressed on a pool of threads and spliced into the chain in place of their old clusters
+
+// number of chunk_t that fit after the entry_t, which caps the size of a compressed file
+int chunk_capacity() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	return (cluster_size_bytes - sizeof(entry_t)) / sizeof(chunk_t);
+}
+
+// number of run_t that fit after the entry_t of a sparse file
+int run_capacity() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	return (cluster_size_bytes - sizeof(entry_t)) / sizeof(run_t);
+}
+
+// number of runs in a run map
+int run_count(run_t *runs) {
+	int n = 0;
+	while (n < run_capacity() && runs[n].count != 0) n++;
+	return n;
+}
+
+// position in the chain of cluster k of a sparse file, -1 if k is in a hole
+int run_index(run_t *runs, uint32_t k) {
+	int index = 0;
+	int i;
+	for (i = 0; i < run_capacity() && runs[i].count != 0 && runs[i].first <= k; i++) {
+		if (k - runs[i].first < runs[i].count) return index + (k - runs[i].first);
+		index += runs[i].count;
+	}
+	return -1;
+}
+
+// number of clusters of a sparse file up to and including cluster k that are in the chain
+int run_through(run_t *runs, uint32_t k) {
+	int n = 0;
+	int i;
+	for (i = 0; i < run_capacity() && runs[i].count != 0 && runs[i].first <= k; i++) {
+		n += k - runs[i].first < runs[i].count ? k - runs[i].first + 1 : runs[i].count;
+	}
+	return n;
+}
+
+// add a new cluster for cluster k, which is in a hole, to the chain and run map of the sparse file
+// at fh; runs never touch, a cluster next to one joins it and may join it to the next one
+// returns the cluster's position in the chain, or -1 when the disk is full
+int run_insert(int fh, run_t *runs, int *chain, int *length, uint32_t k) {
+	int n = run_count(runs);
+	int r = 0, index = 0;
+	while (r < n && runs[r].first < k) index += runs[r++].count;
+	int cluster = find_free_cluster();
+	if (cluster == -1) return -1;
+	fat_set(cluster, index < *length ? chain[index] : 0xFFFE);
+	fat_set(index == 0 ? fh : chain[index - 1], cluster);
+	memmove(chain + index + 1, chain + index, sizeof(int) * (*length - index));
+	chain[index] = cluster;
+	(*length)++;
+	int before = r > 0 && runs[r - 1].first + runs[r - 1].count == k;
+	int after = r < n && runs[r].first == k + 1;
+	if (before && after) {
+		runs[r - 1].count += 1 + runs[r].count;
+		memmove(runs + r, runs + r + 1, sizeof(run_t) * (n - r - 1));
+		memset(runs + n - 1, 0, sizeof(run_t));
+	} else if (before) {
+		runs[r - 1].count++;
+	} else if (after) {
+		runs[r].first = k;
+		runs[r].count++;
+	} else {
+		memmove(runs + r + 1, runs + r, sizeof(run_t) * (n - r));
+		runs[r].first = k;
+		runs[r].count = 1;
+	}
+	return index;
+}
+
+// fill chain with the clusters after the entry cluster of the file at fh, returns their number
+int file_chain(int fh, int *chain) {
+	int n = 0;
+	int cluster = fat_get(fh);
+	while (cluster < MBR_memory->data_length && n < MBR_memory->data_length) {
+		chain[n++] = cluster;
+		cluster = fat_get(cluster);
+	}
+	return n;
+}
+
+// the file entry at fh, NULL if fh isn't a file, release it with slab_free(&entry_slab, ...)
+entry_t *file_entry(int fh) {
+	if (fh < 0 || fh >= MBR_memory->data_length || fat_get(fh) == 0xFFFF) return NULL;
+	entry_t *file = fill_entry(fh);
+	if (file->entry_type != 0) {
+		slab_free(&entry_slab, file);
+		return NULL;
+	}
+	return file;
+}
+
+// read chunk k of a compressed file into plain, CHUNK_BYTES long with zeros past what is stored
+// returns 0, or -1 if the chunk map and the chain don't agree or the chunk is corrupt
+int chunk_load(chunk_t *map, int k, int *chain, int length, uint8_t *plain) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int position = 0;
+	int i;
+	for (i = 0; i < k; i++) position += map[i].clusters;
+	memset(plain, 0, CHUNK_BYTES);
+	if (map[k].bytes == 0) return 0;
+	if (position + map[k].clusters > length || map[k].bytes > (uint32_t)map[k].clusters * cluster_size_bytes) return -1;
+	uint8_t *stored = (uint8_t *)arena_alloc(map[k].clusters * cluster_size_bytes);
+	for (i = 0; i < map[k].clusters; i++) memcpy(stored + i * cluster_size_bytes, data_cluster(chain[position + i]), cluster_size_bytes);
+	if (map[k].raw) {
+		if (map[k].bytes > CHUNK_BYTES) return -1;
+		memcpy(plain, stored, map[k].bytes);
+		return 0;
+	}
+	return lz4_decompress(stored, map[k].bytes, plain, CHUNK_BYTES) == -1 ? -1 : 0;
+}
+
+// write into the chain of an uncompressed file, growing it with zeroed clusters as needed
+// bytes between the old size and offset read as zeros afterwards; returns 0, or -1 when the disk is full
+int write_clusters(int fh, int *chain, int length, uint8_t *buf, int len, uint32_t offset, uint32_t size) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	uint64_t end = (uint64_t)offset + len;
+	int needed = (end + cluster_size_bytes - 1) / cluster_size_bytes;
+	int old_length = length;
+	while (length < needed) {
+		int cluster = find_free_cluster();
+		if (cluster == -1) return -1;
+		fat_set(length == 0 ? fh : chain[length - 1], cluster);
+		chain[length++] = cluster;
+	}
+	uint64_t zero_from = size < offset ? size : offset; // zeros from here up to offset
+	uint8_t *data = (uint8_t *)arena_alloc(cluster_size_bytes);
+	int k;
+	disk_open(DISK_NAME);
+	for (k = zero_from / cluster_size_bytes; k < needed; k++) {
+		uint64_t start = (uint64_t)k * cluster_size_bytes;
+		if (k < old_length) memcpy(data, data_cluster(chain[k]), cluster_size_bytes);
+		else memset(data, 0, cluster_size_bytes);
+		uint64_t from = zero_from > start ? zero_from : start;
+		uint64_t to = offset < start + cluster_size_bytes ? offset : start + cluster_size_bytes;
+		if (from < to) memset(data + (from - start), 0, to - from);
+		from = offset > start ? offset : start;
+		to = end < start + cluster_size_bytes ? end : start + cluster_size_bytes;
+		if (from < to) memcpy(data + (from - start), buf + (from - offset), to - from);
+		disk_write(data, cluster_size_bytes, cluster_offset(chain[k]));
+	}
+	disk_close();
+	return 0;
+}
+
+// make room in a full run map for cluster k by filling the hole between the run before k and k
+// with zeroed clusters, or the hole between k and the first run when there's no run before it
+// returns 0, or -1 when the disk is full
+int run_fill(int fh, run_t *runs, int *chain, int *length, uint32_t k) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int n = run_count(runs);
+	int r = 0;
+	while (r < n && runs[r].first < k) r++;
+	if ((r > 0 && runs[r - 1].first + runs[r - 1].count == k) || (r < n && runs[r].first == k + 1)) return 0;
+	uint8_t *zeros = (uint8_t *)arena_alloc(cluster_size_bytes);
+	memset(zeros, 0, cluster_size_bytes);
+	uint32_t from = r > 0 ? runs[r - 1].first + runs[r - 1].count : k + 1;
+	uint32_t to = r > 0 ? k : runs[0].first;
+	uint32_t z;
+	for (z = 0; z < to - from; z++) {
+		// upwards from the run before, so each cluster joins it, or downwards to the first run
+		int index = run_insert(fh, runs, chain, length, r > 0 ? from + z : to - 1 - z);
+		if (index == -1) return -1;
+		disk_write(zeros, cluster_size_bytes, cluster_offset(chain[index]));
+	}
+	return 0;
+}
+
+// write into a sparse file, runs is its run map: the clusters the write covers are filled in, the
+// holes around them are left alone; with the map full, a cluster that would start a new run has
+// the hole between it and the run before (or after) it filled with zeros instead
+// returns 0, or -1 when the disk is full
+int write_sparse(int fh, run_t *runs, int *chain, int *length, uint8_t *buf, int len, uint32_t offset) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	uint64_t end = (uint64_t)offset + len;
+	uint8_t *data = (uint8_t *)arena_alloc(cluster_size_bytes);
+	uint32_t k;
+	disk_open(DISK_NAME);
+	for (k = offset / cluster_size_bytes; k <= (end - 1) / cluster_size_bytes; k++) {
+		int index = run_index(runs, k);
+		memset(data, 0, cluster_size_bytes);
+		if (index != -1) {
+			memcpy(data, data_cluster(chain[index]), cluster_size_bytes);
+		} else if (run_count(runs) < run_capacity() || run_fill(fh, runs, chain, length, k) == 0) {
+			index = run_insert(fh, runs, chain, length, k);
+		}
+		if (index == -1) {
+			disk_close();
+			return -1;
+		}
+		uint64_t start = (uint64_t)k * cluster_size_bytes;
+		uint64_t from = offset > start ? offset : start;
+		uint64_t to = end < start + cluster_size_bytes ? end : start + cluster_size_bytes;
+		memcpy(data + (from - start), buf + (from - offset), to - from);
+		disk_write(data, cluster_size_bytes, cluster_offset(chain[index]));
+	}
+	disk_close();
+	return 0;
+}
+
+// write into a compressed file, map is its chunk map; returns 0, or -1 when the disk is full, the
+// file would outgrow its chunk map or the chunks it touches are corrupt
+int write_chunks(int fh, chunk_t *map, int *chain, int length, uint8_t *buf, int len, uint32_t offset, uint32_t size) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	uint64_t end = (uint64_t)offset + len;
+	uint64_t new_size = end > size ? end : size;
+	int chunks = (new_size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+	if (chunks > chunk_capacity()) {
+		printf("fs_write: a compressed file holds at most %d bytes with this cluster size\n", chunk_capacity() * CHUNK_BYTES);
+		return -1;
+	}
+	int first = offset / CHUNK_BYTES;
+	int last = (end - 1) / CHUNK_BYTES;
+	int count = last - first + 1;
+	chunk_job_t *jobs = (chunk_job_t *)arena_alloc(sizeof(chunk_job_t) * count);
+	int i, k;
+	for (i = 0; i < count; i++) {
+		chunk_job_t *job = &jobs[i];
+		uint64_t start = (uint64_t)(first + i) * CHUNK_BYTES;
+		job->plain = (uint8_t *)arena_alloc(CHUNK_BYTES);
+		if (chunk_load(map, first + i, chain, length, job->plain) == -1) {
+			printf("fs_write: chunk %d of the file at cluster %d is corrupt\n", first + i, fh);
+			return -1;
+		}
+		uint64_t from = offset > start ? offset : start;
+		uint64_t to = end < start + CHUNK_BYTES ? end : start + CHUNK_BYTES;
+		memcpy(job->plain + (from - start), buf + (from - offset), to - from);
+		job->length = new_size - start < CHUNK_BYTES ? new_size - start : CHUNK_BYTES;
+		job->stored = (uint8_t *)arena_alloc(job->length);
+	}
+	compress_chunks(jobs, count);
+
+	// the new chain keeps the clusters of untouched chunks and reuses those of rewritten ones,
+	// nothing is freed until every cluster needed is found
+	int *spliced = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int *surplus = (int *)arena_alloc(sizeof(int) * (length + 1));
+	int n = 0, surplus_count = 0, position = 0;
+	for (k = 0; k < chunks; k++) {
+		int old = map[k].clusters;
+		if (position + old > length) return -1;
+		if (k < first || k > last) {
+			for (i = 0; i < old; i++) spliced[n++] = chain[position + i];
+		} else {
+			chunk_job_t *job = &jobs[k - first];
+			int want = (job->stored_bytes + cluster_size_bytes - 1) / cluster_size_bytes;
+			for (i = 0; i < want; i++) {
+				int cluster = i < old ? chain[position + i] : find_free_cluster();
+				if (cluster == -1) return -1;
+				spliced[n++] = cluster;
+			}
+			for (i = want; i < old; i++) surplus[surplus_count++] = chain[position + i];
+		}
+		position += old;
+	}
+	int prev = fh;
+	for (i = 0; i < n; i++) {
+		fat_set(prev, spliced[i]);
+		prev = spliced[i];
+	}
+	fat_set(prev, 0xFFFE);
+
+	uint8_t *data = (uint8_t *)arena_alloc(cluster_size_bytes);
+	disk_open(DISK_NAME);
+	for (position = 0, k = 0; k <= last; k++) {
+		if (k >= first) {
+			chunk_job_t *job = &jobs[k - first];
+			int want = (job->stored_bytes + cluster_size_bytes - 1) / cluster_size_bytes;
+			for (i = 0; i < want; i++) {
+				int bytes = job->stored_bytes - i * cluster_size_bytes;
+				if (bytes > cluster_size_bytes) bytes = cluster_size_bytes;
+				memset(data, 0, cluster_size_bytes);
+				memcpy(data, job->stored + i * cluster_size_bytes, bytes);
+				disk_write(data, cluster_size_bytes, cluster_offset(spliced[position + i]));
+			}
+			map[k].bytes = job->stored_bytes;
+			map[k].clusters = want;
+			map[k].raw = job->raw;
+			STAT_ADD(chunks_compressed, 1);
+			STAT_ADD(compress_in, job->length);
+			STAT_ADD(compress_out, job->stored_bytes);
+		}
+		position += map[k].clusters;
+	}
+	disk_write(map, sizeof(chunk_t) * chunk_capacity(), cluster_offset(fh) + sizeof(entry_t));
+	disk_close();
+	// the clusters a chunk no longer needs are cut out of the chain above, the FAT is written
+	// back before the reclaim thread can take fs_lock
+	for (i = 0; i < surplus_count; i++) {
+		fat_set(surplus[i], 0xFFFE);
+		reclaim_queue(surplus[i], RECLAIM_CLUSTER);
+	}
+	return 0;
+}
+
+// create an empty file called name in the directory at dh, flags are FILE_ flags
+// returns the file's handle, or -1 if the name is taken or too long, or the disk is full
+int do_create(int dh, char *name, int flags) {
+	if (strlen(name) == 0 || strlen(name) > 16 || (dh & SNAPSHOT_HANDLE)) return -1;
+	if (load_disk(DISK_NAME) == -1) return -1;
+	dh = is_directory(handle_cluster(dh)) ? cow_dir(dh) : -1;
+	slot_cursor_t cursor;
+	if (dh == -1 || find_child(dh, name, -1, &cursor) != -1) {
+		unload_disk();
+		return -1;
+	}
+	disk_open(DISK_NAME);
+	int cluster_size_bytes = geo.cluster_bytes;
+	int fh = find_free_cluster();
+	off_t ptr_offset = fh == -1 ? -1 : open_slot(dh);
+	if (ptr_offset == -1) {
+		printf("fs_create: file not made\nno free space left on disk for new file\n");
+		disk_close();
+		unload_disk();
+		return -1;
+	}
+	// every other file is sparse; the chunk map starts out with every chunk unwritten, the run map empty
+	if (!(flags & FILE_COMPRESSED)) flags |= FILE_SPARSE;
+	entry_t *file = create_directory_entry(name);
+	file->entry_type = 0;
+	file->children_count = flags;
+	uint8_t *data = (uint8_t *)arena_alloc(cluster_size_bytes);
+	memset(data, 0, cluster_size_bytes);
+	memcpy(data, file, sizeof(entry_t));
+	disk_write(data, cluster_size_bytes, cluster_offset(fh));
+	slab_free(&entry_slab, file);
+
+	entry_ptr_t *ptr = create_ptr(0, fh);
+	disk_write(ptr, sizeof(entry_ptr_t), ptr_offset);
+	slab_free(&ptr_slab, ptr);
+	entry_t *parent = fill_entry(dh);
+	parent->children_count++;
+	disk_write(parent, sizeof(entry_t), cluster_offset(dh));
+	slab_free(&entry_slab, parent);
+
+	if (COW_header != NULL) cow_write_back();
+	else fat_write_back();
+	disk_close();
+	unload_disk();
+	return fh;
+}
+
+// handle of the file called name in the directory at dh, -1 if there is none
+int do_open(int dh, char *name) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster = handle_cluster(dh);
+	slot_cursor_t cursor;
+	int fh = is_directory(cluster) ? find_child(cluster, name, 0, &cursor) : -1;
+	unload_disk();
+	return fh == -1 ? -1 : fh | (dh & SNAPSHOT_HANDLE);
+}
+
+// read up to len bytes from offset of the file at fh into buf
+// returns the number of bytes read, 0 at the end of the file, or -1 if fh isn't a file or is corrupt
+int do_read(int fh, void *buf, int len, uint32_t offset) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	fh = handle_cluster(fh);
+	entry_t *file = len < 0 ? NULL : file_entry(fh);
+	if (file == NULL) {
+		unload_disk();
+		return -1;
+	}
+	uint32_t size = wb_size(fh, file->size);
+	int flags = file->children_count;
+	slab_free(&entry_slab, file);
+	if (offset >= size) len = 0;
+	else if (len > size - offset) len = size - offset;
+
+	int *chain = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int length = file_chain(fh, chain);
+	uint8_t *out = (uint8_t *)buf;
+	uint64_t end = (uint64_t)offset + len;
+	uint64_t at = offset;
+	if (flags & FILE_COMPRESSED) {
+		chunk_t *map = (chunk_t *)arena_alloc(sizeof(chunk_t) * chunk_capacity());
+		memcpy(map, data_cluster(fh) + sizeof(entry_t), sizeof(chunk_t) * chunk_capacity());
+		uint8_t *plain = (uint8_t *)arena_alloc(CHUNK_BYTES);
+		while (at < end) {
+			int k = at / CHUNK_BYTES;
+			int in_chunk = at % CHUNK_BYTES;
+			int n = end - at < (uint64_t)(CHUNK_BYTES - in_chunk) ? end - at : CHUNK_BYTES - in_chunk;
+			if (k >= chunk_capacity() || chunk_load(map, k, chain, length, plain) == -1) {
+				printf("fs_read: chunk %d of the file at cluster %d is corrupt\n", k, fh);
+				unload_disk();
+				return -1;
+			}
+			memcpy(out + (at - offset), plain + in_chunk, n);
+			at += n;
+		}
+	} else {
+		// holes of a sparse file read as zeros without touching the disk, and pages in the
+		// write-back cache read in place of the clusters they cover
+		run_t *runs = NULL;
+		if (flags & FILE_SPARSE) {
+			runs = (run_t *)arena_alloc(sizeof(run_t) * run_capacity());
+			memcpy(runs, data_cluster(fh) + sizeof(entry_t), sizeof(run_t) * run_capacity());
+		}
+		int prefetched = -1; // with the block cache, the last cluster of the file cache_fill was asked for
+		while (at < end) {
+			int k = at / cluster_size_bytes;
+			int in_cluster = at % cluster_size_bytes;
+			int n = end - at < (uint64_t)(cluster_size_bytes - in_cluster) ? end - at : cluster_size_bytes - in_cluster;
+			int index = runs != NULL ? run_index(runs, k) : k;
+			uint8_t *page = wb_data(fh, k);
+			if (page == NULL && index >= length) {
+				printf("fs_read: the file at cluster %d is shorter than its size\n", fh);
+				unload_disk();
+				return -1;
+			}
+			// a run of the file's clusters that follow each other on disk comes into the block cache at once
+			if (disk_cached && page == NULL && index != -1 && k > prefetched) {
+				int last = index;
+				for (prefetched = k; (uint64_t)(prefetched + 1) * cluster_size_bytes < end; prefetched++) {
+					int next = runs != NULL ? run_index(runs, prefetched + 1) : prefetched + 1;
+					if (next != last + 1 || next >= length || chain[next] != chain[last] + 1) break;
+					last = next;
+				}
+				if (last > index) cache_fill(cluster_offset(chain[index]), (size_t)(last - index + 1) * cluster_size_bytes);
+			}
+			if (page != NULL) memcpy(out + (at - offset), page + in_cluster, n);
+			else if (index == -1) memset(out + (at - offset), 0, n);
+			else memcpy(out + (at - offset), data_cluster(chain[index]) + in_cluster, n);
+			at += n;
+		}
+	}
+	unload_disk();
+	return len;
+}
+
+// offset of the first byte at or after offset of the file at fh that is data, or with hole set
+// that is in a hole; holes are the unwritten chunks of a compressed file and the clusters outside
+// the runs of a sparse file, and there is always one at the end of the file
+// returns -1 if offset isn't inside the file, or when looking for data and only holes follow
+int64_t do_seek(int fh, uint32_t offset, int hole) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	fh = handle_cluster(fh);
+	entry_t *file = file_entry(fh);
+	if (file == NULL) {
+		unload_disk();
+		return -1;
+	}
+	uint32_t size = file->size;
+	int flags = file->children_count;
+	slab_free(&entry_slab, file);
+	if (offset >= size) {
+		unload_disk();
+		return -1;
+	}
+	int64_t result = hole ? size : offset;
+	if (flags & FILE_COMPRESSED) {
+		chunk_t *map = (chunk_t *)arena_alloc(sizeof(chunk_t) * chunk_capacity());
+		memcpy(map, data_cluster(fh) + sizeof(entry_t), sizeof(chunk_t) * chunk_capacity());
+		int k;
+		result = hole ? (int64_t)size : -1;
+		for (k = offset / CHUNK_BYTES; k < chunk_capacity() && (uint64_t)k * CHUNK_BYTES < size; k++) {
+			if ((map[k].bytes == 0) != hole) continue;
+			result = (uint64_t)k * CHUNK_BYTES > offset ? (uint64_t)k * CHUNK_BYTES : offset;
+			break;
+		}
+	} else if (flags & FILE_SPARSE) {
+		run_t *runs = (run_t *)arena_alloc(sizeof(run_t) * run_capacity());
+		memcpy(runs, data_cluster(fh) + sizeof(entry_t), sizeof(run_t) * run_capacity());
+		int i;
+		result = hole ? (int64_t)size : -1;
+		for (i = 0; i < run_capacity() && runs[i].count != 0; i++) {
+			uint64_t from = (uint64_t)runs[i].first * cluster_size_bytes;
+			uint64_t to = (uint64_t)(runs[i].first + runs[i].count) * cluster_size_bytes;
+			if (to <= offset) continue;
+			// runs never touch, so a hole starts where this one ends
+			if (hole) result = from > offset ? offset : to < size ? to : size;
+			else result = from > offset ? (from < size ? (int64_t)from : -1) : offset;
+			break;
+		}
+	}
+	unload_disk();
+	return result;
+}
+
+// fs_sendfile moves a file's bytes straight from the disk file to another descriptor
+#define SEND_BUFFER 65536 // bytes read at a time when the kernel can't move them itself
+
+enum { SEND_COPY_RANGE, SEND_SENDFILE, SEND_BUFFERED };
+
+// write n bytes of buf to out_fd, returns 0, or -1 if out_fd fails
+int send_buffer(int out_fd, const uint8_t *buf, size_t n) {
+	STAT_ADD(send_copied, n);
+	while (n > 0) {
+		ssize_t m = write(out_fd, buf, n);
+		if (m == -1 && errno == EINTR) continue;
+		if (m <= 0) return -1;
+		buf += m;
+		n -= m;
+	}
+	return 0;
+}
+
+// move n bytes at offset at of the disk file in_fd to out_fd without them passing through this
+// process: copy_file_range first, then sendfile, and a read and write only when the kernel
+// can't do either for these descriptors; mode is the way to start with and is left at the one
+// that worked, so a transfer of many extents gives up on a way once
+// returns 0, or -1 if out_fd fails
+int send_range(int in_fd, int out_fd, int *mode, off_t at, size_t n) {
+	uint8_t *buf = NULL;
+	while (n > 0) {
+		ssize_t m;
+		if (*mode == SEND_COPY_RANGE) {
+			m = copy_file_range(in_fd, &at, out_fd, NULL, n, 0);
+		} else if (*mode == SEND_SENDFILE) {
+			m = sendfile(out_fd, in_fd, &at, n);
+		} else {
+			if (buf == NULL) buf = (uint8_t *)arena_alloc(SEND_BUFFER);
+			m = pread(in_fd, buf, n < SEND_BUFFER ? n : SEND_BUFFER, at);
+			if (m > 0 && send_buffer(out_fd, buf, m) == -1) return -1;
+			if (m > 0) at += m;
+		}
+		if (m == -1 && errno == EINTR) continue;
+		if (m == -1 && *mode != SEND_BUFFERED && (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EBADF)) {
+			(*mode)++;
+			continue;
+		}
+		if (m <= 0) return -1;
+		if (*mode != SEND_BUFFERED) STAT_ADD(send_zero_copy, m);
+		n -= m;
+	}
+	return 0;
+}
+
+// send up to len bytes from offset of the file at fh to out_fd, at its file position
+// the clusters of the file that follow each other on disk go to out_fd as one range of the disk
+// file; holes are sent from a buffer of zeros and compressed chunks once they are decompressed
+// the bytes sent aren't checked against the checksum table, they never reach this process
+// returns the number of bytes sent, 0 at the end of the file, or -1 if fh isn't a file, is
+// corrupt, or out_fd fails
+int do_sendfile(int fh, int out_fd, uint32_t offset, int len) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	fh = handle_cluster(fh);
+	entry_t *file = len < 0 ? NULL : file_entry(fh);
+	if (file == NULL) {
+		unload_disk();
+		return -1;
+	}
+	uint32_t size = file->size;
+	int flags = file->children_count;
+	slab_free(&entry_slab, file);
+	if (offset >= size) len = 0;
+	else if (len > size - offset) len = size - offset;
+
+	int *chain = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int length = file_chain(fh, chain);
+	int in_fd = open(DISK_NAME, O_RDONLY);
+	if (in_fd == -1) {
+		printf("fs_sendfile: unable to open %s\n", DISK_NAME);
+		unload_disk();
+		return -1;
+	}
+	int in_fds[STRIPE_MAX];
+	if (stripe_open(in_fds, O_RDONLY) == -1) {
+		close(in_fd);
+		unload_disk();
+		return -1;
+	}
+	struct stat st;
+	int mode = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) ? SEND_COPY_RANGE : SEND_SENDFILE;
+	uint64_t end = (uint64_t)offset + len;
+	uint64_t at = offset;
+	int result = 0;
+	if (flags & FILE_COMPRESSED) {
+		chunk_t *map = (chunk_t *)arena_alloc(sizeof(chunk_t) * chunk_capacity());
+		memcpy(map, data_cluster(fh) + sizeof(entry_t), sizeof(chunk_t) * chunk_capacity());
+		uint8_t *plain = (uint8_t *)arena_alloc(CHUNK_BYTES);
+		while (at < end && result == 0) {
+			int k = at / CHUNK_BYTES;
+			int in_chunk = at % CHUNK_BYTES;
+			int n = end - at < (uint64_t)(CHUNK_BYTES - in_chunk) ? end - at : CHUNK_BYTES - in_chunk;
+			if (k >= chunk_capacity() || chunk_load(map, k, chain, length, plain) == -1) {
+				printf("fs_sendfile: chunk %d of the file at cluster %d is corrupt\n", k, fh);
+				result = -1;
+				break;
+			}
+			result = send_buffer(out_fd, plain + in_chunk, n);
+			at += n;
+		}
+	} else {
+		run_t *runs = NULL;
+		if (flags & FILE_SPARSE) {
+			runs = (run_t *)arena_alloc(sizeof(run_t) * run_capacity());
+			memcpy(runs, data_cluster(fh) + sizeof(entry_t), sizeof(run_t) * run_capacity());
+		}
+		uint8_t *zeros = (uint8_t *)arena_alloc(SEND_BUFFER);
+		memset(zeros, 0, SEND_BUFFER);
+		while (at < end && result == 0) {
+			int k = at / cluster_size_bytes;
+			int in_cluster = at % cluster_size_bytes;
+			int index = runs != NULL ? run_index(runs, k) : k;
+			uint64_t n = cluster_size_bytes - in_cluster;
+			if (index >= length) {
+				printf("fs_sendfile: the file at cluster %d is shorter than its size\n", fh);
+				result = -1;
+				break;
+			}
+			if (index == -1) {
+				// the whole hole at once
+				while (at + n < end && run_index(runs, k + 1) == -1) {
+					n += cluster_size_bytes;
+					k++;
+				}
+				if (n > end - at) n = end - at;
+				uint64_t sent;
+				for (sent = 0; sent < n && result == 0; sent += SEND_BUFFER) {
+					result = send_buffer(out_fd, zeros, n - sent < SEND_BUFFER ? n - sent : SEND_BUFFER);
+				}
+			} else {
+				// one extent for as long as the next cluster of the file is the next one on disk
+				off_t from = cluster_offset(chain[index]) + in_cluster;
+				while (at + n < end) {
+					int next = runs != NULL ? run_index(runs, k + 1) : k + 1;
+					if (next == -1 || next >= length || chain[next] != chain[index] + 1) break;
+					n += cluster_size_bytes;
+					k++;
+					index = next;
+				}
+				if (n > end - at) n = end - at;
+				// on a striped disk the extent is sent a stripe unit at a time, from the file holding it
+				uint64_t sent;
+				for (sent = 0; sent < n && result == 0; ) {
+					int file;
+					off_t in_at;
+					size_t piece = stripe_extent(from + sent, n - sent, &file, &in_at);
+					result = send_range(file < 0 ? in_fd : in_fds[file], out_fd, &mode, in_at, piece);
+					sent += piece;
+				}
+				STAT_ADD(send_extents, 1);
+			}
+			at += n;
+		}
+	}
+	stripe_close(in_fds);
+	close(in_fd);
+	unload_disk();
+	return result == -1 ? -1 : len;
+}
+
+// write len bytes of buf at offset of the file at fh, growing the file as needed
+// returns len, or -1 when fh isn't a live file or the disk is full
+int do_write(int fh, void *buf, int len, uint32_t offset) {
+	if ((fh & SNAPSHOT_HANDLE) || len < 0 || (uint64_t)offset + len > 0xFFFFFFFF) return -1;
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	fh = cow_resolve(fh);
+	entry_t *file = file_entry(fh);
+	int first = 0, last = INT_MAX; // clusters of the chain the write changes
+	if (file != NULL) {
+		if (!(file->children_count & FILE_COMPRESSED)) {
+			first = (file->children_count & FILE_SPARSE || file->size > offset ? offset : file->size) / cluster_size_bytes;
+			last = len == 0 ? -1 : ((uint64_t)offset + len - 1) / cluster_size_bytes;
+		}
+		// a sparse file's chain only holds the clusters in its runs, and clusters filled in are
+		// linked in after those before them
+		int copy_last = last;
+		if (file->children_count & FILE_SPARSE && last != -1) copy_last = run_through((run_t *)(data_cluster(fh) + sizeof(entry_t)), last) - 1;
+		slab_free(&entry_slab, file);
+		// a file shared with a snapshot or another file is copied before it's written
+		fh = cow_file(fh, copy_last);
+		file = fh == -1 ? NULL : fill_entry(fh);
+	}
+	if (file == NULL) {
+		unload_disk();
+		return -1;
+	}
+	if (len == 0) {
+		slab_free(&entry_slab, file);
+		unload_disk();
+		return 0;
+	}
+
+	int *chain = (int *)arena_alloc(sizeof(int) * (MBR_memory->data_length + 1));
+	int length = file_chain(fh, chain);
+	run_t *runs = NULL;
+	int result;
+	if (file->children_count & FILE_COMPRESSED) {
+		chunk_t *map = (chunk_t *)arena_alloc(sizeof(chunk_t) * chunk_capacity());
+		memcpy(map, data_cluster(fh) + sizeof(entry_t), sizeof(chunk_t) * chunk_capacity());
+		result = write_chunks(fh, map, chain, length, (uint8_t *)buf, len, offset, file->size);
+	} else if (file->children_count & FILE_SPARSE) {
+		runs = (run_t *)arena_alloc(sizeof(run_t) * run_capacity());
+		memcpy(runs, data_cluster(fh) + sizeof(entry_t), sizeof(run_t) * run_capacity());
+		result = write_sparse(fh, runs, chain, &length, (uint8_t *)buf, len, offset);
+		// from here on first and last are positions in the chain, like those of other files
+		if (result == 0) {
+			first = run_index(runs, first);
+			last = run_index(runs, last);
+		}
+	} else {
+		result = write_clusters(fh, chain, length, (uint8_t *)buf, len, offset, file->size);
+	}
+	if (result == -1) {
+		printf("fs_write: not written\nno free space left on disk for the file\n");
+		slab_free(&entry_slab, file);
+		unload_disk();
+		return -1;
+	}
+
+	// what's written is indexed, or at least forgotten by the index
+	if (DEDUP) {
+		dedup_file(fh, first, last);
+	} else if (dedup_key != NULL) {
+		int k;
+		for (k = first; k < length && k <= last; k++) dedup_key[chain[k]] = 0;
+	}
+
+	// the data is on disk before the FAT links it, and the FAT before the run map or size covers it
+	disk_open(DISK_NAME);
+	disk_barrier();
+	if (COW_header != NULL) cow_write_back();
+	else fat_write_back();
+	if (runs != NULL) disk_write(runs, sizeof(run_t) * run_capacity(), cluster_offset(fh) + sizeof(entry_t));
+	if (offset + len > file->size) {
+		file->size = offset + len;
+		disk_write(file, sizeof(entry_t), cluster_offset(fh));
+	}
+	disk_close();
+	slab_free(&entry_slab, file);
+	unload_disk();
+	return len;
+}
+// **************** end file functions *****************//
+// ************************** write-back related functions **************//
+// fs_write on a sparse file only copies the data into the file's pages in memory, one per cluster
+// of the file written, each holding the whole cluster as it reads now; a page over a hole has a
+// free cluster reserved for it, so the write can't fail later for want of space, but which
+// cluster isn't decided until the page is written back
+// the flusher thread writes a file's pages back once the first of them is WB_EXPIRE_NS old, or
+// oldest file first while more than WB_BUDGET / WB_BACKGROUND_RATIO bytes are dirty; fs_write
+// writes back itself rather than go past WB_BUDGET; a file is written back whole, a run of
+// neighbouring pages (at most WB_CHUNK bytes) per do_write, with the clusters for its holes
+// taken one after another from one free run
+// a file removed before then never reaches the disk; compressed and unsparse files, and every
+// file while the disk can share clusters (a snapshot area exists, or DEDUP is on), are written
+// through, since a write to a shared cluster takes a copy that can't be reserved ahead; so is
+// every file of a shared mount, the other processes couldn't see its pages
+#define WB_EXPIRE_NS 5000000000ULL
+#define WB_BUDGET (16 * 1024 * 1024) // dirty bytes
+#define WB_BACKGROUND_RATIO 4
+#define WB_WAKE_SECONDS 1 // how often the flusher looks for expired files while any are dirty
+#define WB_CHUNK (1024 * 1024) // bytes of a file written back at once
+
+int WRITEBACK = 1; // 0 writes every fs_write through to the disk
+
+typedef struct {
+	uint32_t k; // cluster of the file
+	int reserved; // 1 if it's over a hole and a cluster is reserved for it
+	uint8_t *data;
+} wb_page_t;
+
+typedef struct {
+	int fh;
+	uint32_t size; // size of the file with the pages in
+	uint64_t dirtied; // now_ns() when its first page was made
+	int reserved; // pages with a cluster reserved
+	int count;
+	int capacity;
+	wb_page_t *pages; // in order of k
+} wb_file_t;
+
+// all of it is used under fs_lock
+wb_file_t *wb_files = NULL;
+int wb_count = 0;
+int wb_capacity = 0;
+uint64_t wb_dirty_bytes = 0;
+int wb_page_bytes; // cluster size the pages were made with
+
+int wb_pending = 0; // 1 while some file may be dirty, wakes the flusher up
+int wb_started = 0;
+pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER; // taken after fs_lock, never before it
+pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+
+// position of the file at fh in wb_files, -1 if nothing of it is buffered
+int wb_index(int fh) {
+	int i;
+	for (i = 0; i < wb_count; i++) {
+		if (wb_files[i].fh == fh) return i;
+	}
+	return -1;
+}
+
+// position of the page for cluster k in the pages of f, or where it would go, minus one, if there is none
+int wb_page_index(wb_file_t *f, uint32_t k) {
+	int low = 0, high = f->count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (f->pages[mid].k < k) low = mid + 1;
+		else high = mid;
+	}
+	return low < f->count && f->pages[low].k == k ? low : -low - 1;
+}
+
+uint32_t wb_size(int fh, uint32_t size) {
+	int i = wb_index(fh);
+	return i == -1 ? size : wb_files[i].size;
+}
+
+// the page for cluster k of the file at fh, NULL if there is none
+uint8_t *wb_data(int fh, uint32_t k) {
+	int i = wb_index(fh);
+	if (i == -1) return NULL;
+	int p = wb_page_index(&wb_files[i], k);
+	return p < 0 ? NULL : wb_files[i].pages[p].data;
+}
+
+// forget file i and free its pages and the clusters reserved for them
+void wb_forget(int i) {
+	wb_file_t *f = &wb_files[i];
+	int p;
+	for (p = 0; p < f->count; p++) free(f->pages[p].data);
+	free(f->pages);
+	fat_reserved -= f->reserved;
+	wb_dirty_bytes -= (uint64_t)f->count * wb_page_bytes;
+	wb_files[i] = wb_files[--wb_count];
+}
+
+// drop the pages of a file that is gone, fh is -1 for every file
+void wb_drop(int fh) {
+	int i;
+	for (i = wb_count - 1; i >= 0; i--) {
+		if (fh != -1 && wb_files[i].fh != fh) continue;
+		STAT_ADD(wb_dropped, (uint64_t)wb_files[i].count * wb_page_bytes);
+		wb_forget(i);
+	}
+}
+
+// write the pages of file i back and forget them, no disk may be loaded; up to WB_CHUNK bytes of
+// neighbouring pages go to do_write at once and are forgotten, then waiting operations may go first
+// returns 0, or -1 if the disk filled up under them, when what was left is lost
+int wb_flush(int i) {
+	TRACE_BEGIN("wb_flush");
+	int fh = wb_files[i].fh;
+	int result = 0;
+	// the reserved clusters are taken one after another from a run long enough for them all
+	fat_goal = -1;
+	while ((i = wb_index(fh)) != -1 && result == 0) {
+		wb_file_t *f = &wb_files[i];
+		int p, end, reserved = 0;
+		for (end = 1; end < f->count && f->pages[end].k == f->pages[end - 1].k + 1 && (uint64_t)(end + 1) * wb_page_bytes <= WB_CHUNK; end++);
+		for (p = 0; p < end; p++) reserved += f->pages[p].reserved;
+		uint64_t from = (uint64_t)f->pages[0].k * wb_page_bytes;
+		uint64_t to = (uint64_t)(f->pages[end - 1].k + 1) * wb_page_bytes;
+		if (to > f->size) to = f->size;
+		uint8_t *buf = (uint8_t *)fs_malloc(to - from);
+		for (p = 0; p < end; p++) {
+			uint64_t at = (uint64_t)p * wb_page_bytes;
+			memcpy(buf + at, f->pages[p].data, to - from - at < (uint64_t)wb_page_bytes ? to - from - at : (uint64_t)wb_page_bytes);
+			free(f->pages[p].data);
+		}
+		f->count -= end;
+		memmove(f->pages, f->pages + end, sizeof(wb_page_t) * f->count);
+		wb_dirty_bytes -= (uint64_t)end * wb_page_bytes;
+		fat_goal_length = f->reserved;
+		fat_reserved -= reserved;
+		f->reserved -= reserved;
+		if (f->count == 0) wb_forget(i);
+		result = do_write(fh, buf, to - from, from) == -1 ? -1 : 0;
+		fat_goal_length = 0;
+		if (result == 0) STAT_ADD(wb_written, to - from);
+		free(buf);
+		io_yield();
+	}
+	if (result == -1) {
+		printf("fs_write: data buffered for the file at cluster %d not written back\n", fh);
+		if ((i = wb_index(fh)) != -1) wb_forget(i);
+	}
+	TRACE_END("wb_flush");
+	return result;
+}
+
+// write back the file at fh, or every file if fh is -1; fs_lock must be held, no disk loaded
+void wb_sync(int fh) {
+	int i;
+	while ((i = fh == -1 ? wb_count - 1 : wb_index(fh)) != -1) wb_flush(i);
+}
+
+// position of the file dirtied first
+int wb_oldest() {
+	int oldest = 0, i;
+	for (i = 1; i < wb_count; i++) {
+		if (wb_files[i].dirtied < wb_files[oldest].dirtied) oldest = i;
+	}
+	return oldest;
+}
+
+void *wb_worker(void *arg) {
+	fs_io_class(IO_BACKGROUND);
+	pthread_mutex_lock(&wb_lock);
+	while (1) {
+		while (!wb_pending) pthread_cond_wait(&wb_cond, &wb_lock);
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += WB_WAKE_SECONDS;
+		pthread_cond_timedwait(&wb_cond, &wb_lock, &until);
+		pthread_mutex_unlock(&wb_lock);
+
+		io_lock();
+		TRACE_BEGIN("wb_worker");
+		uint64_t now = now_ns();
+		int i = 0;
+		while (i < wb_count) {
+			if (now - wb_files[i].dirtied >= WB_EXPIRE_NS) wb_flush(i); // the last file takes its place
+			else i++;
+		}
+		while (wb_count > 0 && wb_dirty_bytes > WB_BUDGET / WB_BACKGROUND_RATIO) wb_flush(wb_oldest());
+		TRACE_END("wb_worker");
+		pthread_mutex_lock(&wb_lock);
+		wb_pending = wb_count > 0;
+		io_unlock();
+	}
+	return NULL;
+}
+
+// tell the flusher there is something dirty, starting it on first use, and wake it up now if
+// too much is; what is still dirty when the process exits is written back then
+void wb_wake() {
+	pthread_mutex_lock(&wb_lock);
+	if (!wb_started) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, wb_worker, NULL);
+		pthread_detach(thread);
+		atexit(fs_sync);
+		wb_started = 1;
+	}
+	if (!wb_pending || wb_dirty_bytes > WB_BUDGET / WB_BACKGROUND_RATIO) pthread_cond_signal(&wb_cond);
+	wb_pending = 1;
+	pthread_mutex_unlock(&wb_lock);
+}
+
+// take a write of len bytes of buf at offset of the file at fh into its pages; a write that
+// can't be buffered writes what the file has buffered back first and then goes to do_write
+// returns len, or -1 when fh isn't a live file or the disk has no room left for the write
+int wb_write(int fh, void *buf, int len, uint32_t offset) {
+	int i = wb_index(fh);
+	if (!WRITEBACK || SHARED_MOUNT || DEDUP || (fh & SNAPSHOT_HANDLE) || len <= 0 || (uint64_t)offset + len > 0xFFFFFFFF) {
+		if (i != -1) wb_flush(i);
+		return do_write(fh, buf, len, offset);
+	}
+	uint64_t end = (uint64_t)offset + len;
+	// rewriting pages already there needs nothing from the disk
+	if (i != -1) {
+		wb_file_t *f = &wb_files[i];
+		int p = wb_page_index(f, offset / wb_page_bytes);
+		int pages = (end - 1) / wb_page_bytes - offset / wb_page_bytes + 1;
+		if (p >= 0 && p + pages <= f->count && f->pages[p + pages - 1].k == f->pages[p].k + pages - 1) {
+			uint64_t at;
+			for (at = offset; at < end; ) {
+				uint32_t k = at / wb_page_bytes;
+				int in_cluster = at % wb_page_bytes;
+				int n = end - at < (uint64_t)(wb_page_bytes - in_cluster) ? end - at : wb_page_bytes - in_cluster;
+				memcpy(f->pages[p + (k - f->pages[p].k)].data + in_cluster, (uint8_t *)buf + (at - offset), n);
+				at += n;
+			}
+			if (end > f->size) f->size = end;
+			STAT_ADD(wb_buffered, len);
+			return len;
+		}
+	}
+	// the oldest files are written back rather than go over budget
+	while (wb_count > 0 && wb_dirty_bytes + len > WB_BUDGET) {
+		wb_flush(wb_oldest());
+		i = wb_index(fh);
+	}
+
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	entry_t *file = COW_header == NULL ? file_entry(fh) : NULL;
+	if (file == NULL || !(file->children_count & FILE_SPARSE)) {
+		if (file != NULL) slab_free(&entry_slab, file);
+		unload_disk();
+		if (i != -1) wb_flush(i);
+		return do_write(fh, buf, len, offset);
+	}
+	uint32_t size = file->size;
+	slab_free(&entry_slab, file);
+	run_t *runs = (run_t *)arena_alloc(sizeof(run_t) * run_capacity());
+	memcpy(runs, data_cluster(fh) + sizeof(entry_t), sizeof(run_t) * run_capacity());
+	int *chain = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int length = file_chain(fh, chain);
+	uint32_t first = offset / cluster_size_bytes, last = (end - 1) / cluster_size_bytes, k;
+	int wanted = 0;
+	for (k = first; k <= last; k++) {
+		if ((i == -1 || wb_page_index(&wb_files[i], k) < 0) && run_index(runs, k) == -1) wanted++;
+	}
+	if (wanted > MBR_memory->free_count - fat_reserved) {
+		printf("fs_write: not written\nno free space left on disk for the file\n");
+		unload_disk();
+		return -1;
+	}
+
+	if (i == -1) {
+		if (wb_count == wb_capacity) {
+			wb_capacity = wb_capacity ? wb_capacity * 2 : 16;
+			wb_files = (wb_file_t *)realloc(wb_files, sizeof(wb_file_t) * wb_capacity);
+		}
+		i = wb_count++;
+		memset(&wb_files[i], 0, sizeof(wb_file_t));
+		wb_files[i].fh = fh;
+		wb_files[i].size = size;
+		wb_files[i].dirtied = now_ns();
+		wb_page_bytes = cluster_size_bytes;
+	}
+	wb_file_t *f = &wb_files[i];
+	for (k = first; k <= last; k++) {
+		int p = wb_page_index(f, k);
+		if (p < 0) {
+			// a new page starts out as the cluster reads now
+			p = -p - 1;
+			if (f->count == f->capacity) {
+				f->capacity = f->capacity ? f->capacity * 2 : 16;
+				f->pages = (wb_page_t *)realloc(f->pages, sizeof(wb_page_t) * f->capacity);
+			}
+			memmove(f->pages + p + 1, f->pages + p, sizeof(wb_page_t) * (f->count - p));
+			f->count++;
+			wb_page_t *page = &f->pages[p];
+			int index = run_index(runs, k);
+			page->k = k;
+			page->reserved = index == -1;
+			page->data = (uint8_t *)fs_malloc(cluster_size_bytes);
+			if (index != -1 && index < length) memcpy(page->data, data_cluster(chain[index]), cluster_size_bytes);
+			else memset(page->data, 0, cluster_size_bytes);
+			f->reserved += page->reserved;
+			fat_reserved += page->reserved;
+			wb_dirty_bytes += cluster_size_bytes;
+		}
+		uint64_t start = (uint64_t)k * cluster_size_bytes;
+		uint64_t from = offset > start ? offset : start;
+		uint64_t to = end < start + cluster_size_bytes ? end : start + cluster_size_bytes;
+		memcpy(f->pages[p].data + (from - start), (uint8_t *)buf + (from - offset), to - from);
+	}
+	if (end > f->size) f->size = end;
+	unload_disk();
+	STAT_ADD(wb_buffered, len);
+	wb_wake();
+	return len;
+}
+// **************** end write-back functions *****************//
+// ************************** fsck related functions ********************//
+// fsck walks the directory tree from the root on several threads, marking every cluster it
+// reaches in a bitmap, then compares the bitmap with the FAT
+// it finds leaked clusters (allocated in the FAT but unreachable), cross-linked clusters (reached
+// twice), pointers and overflow links to free or out of range clusters, and directories whose
+// children_count doesn't match their slots; with repair set the problems are fixed on disk
+// once there is a snapshot area the snapshot roots are walked too, a cluster reached again is
+// shared rather than cross-linked, and the references counted on the way must match cow_t.refs
+// on a disk with a checksum table every data cluster, the FAT (cluster -1) and the MBR with the
+// table (cluster -2) are checked too, repairing one recomputes its checksum from what is on disk
+enum { FSCK_LEAKED, FSCK_CROSS_LINK, FSCK_BAD_POINTER, FSCK_BAD_LINK, FSCK_BAD_COUNT, FSCK_BAD_REFS, FSCK_BAD_SNAPSHOT, FSCK_BAD_CHECKSUM, FSCK_BAD_SUMMARY, FSCK_KINDS };
+const char *fsck_names[FSCK_KINDS] = { "leaked cluster", "cross-linked cluster", "pointer to free cluster",
+	"broken overflow link", "bad children_count", "bad reference count", "snapshot of free cluster", "checksum mismatch",
+	"wrong free cluster summary" };
+
+typedef struct {
+	int kind;
+	int cluster; // cluster holding the bad slot or entry, or the leaked cluster
+	off_t offset; // disk offset of the slot or children_count to repair
+	int value; // cluster the slot points to, or the correct children_count or free cluster count
+} fsck_problem_t;
+
+uint64_t *fsck_bitmap; // one bit per data cluster, set once the cluster is reached
+uint32_t *fsck_refs; // references found to each cluster, with a snapshot area only
+int *fsck_queue; // directories waiting to be checked, each is queued at most once
+int fsck_queued;
+int fsck_busy; // workers checking a directory, the walk is over when none are and the queue is empty
+fsck_problem_t *fsck_problems;
+int fsck_count;
+int fsck_capacity;
+pthread_mutex_t fsck_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fsck_cond = PTHREAD_COND_INITIALIZER;
+
+// mark a cluster as reached, returns 0 if it had already been reached
+int fsck_mark(int cluster) {
+	uint64_t bit = (uint64_t)1 << (cluster % 64);
+	return !(__atomic_fetch_or(&fsck_bitmap[cluster / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// count a reference to a cluster and mark it, returns 0 if it had already been reached
+int fsck_reach(int cluster) {
+	if (fsck_refs != NULL) __atomic_fetch_add(&fsck_refs[cluster], 1, __ATOMIC_RELAXED);
+	return fsck_mark(cluster);
+}
+
+int fsck_allocated(int cluster) {
+	return cluster < MBR_memory->data_length && fat_get(cluster) != 0xFFFF;
+}
+
+void fsck_report(int kind, int cluster, off_t offset, int value) {
+	pthread_mutex_lock(&fsck_lock);
+	if (fsck_count == fsck_capacity) {
+		fsck_capacity = fsck_capacity ? fsck_capacity * 2 : 64;
+		fsck_problems = (fsck_problem_t *)realloc(fsck_problems, sizeof(fsck_problem_t) * fsck_capacity);
+	}
+	fsck_problem_t *p = &fsck_problems[fsck_count++];
+	p->kind = kind;
+	p->cluster = cluster;
+	p->offset = offset;
+	p->value = value;
+	pthread_mutex_unlock(&fsck_lock);
+}
+
+void fsck_push(int dh) {
+	pthread_mutex_lock(&fsck_lock);
+	fsck_queue[fsck_queued++] = dh;
+	pthread_cond_signal(&fsck_cond);
+	pthread_mutex_unlock(&fsck_lock);
+}
+
+// mark the clusters after the first one of a file, following its FAT chain
+void fsck_file(int cluster) {
+	int hops = 0;
+	while (fat_get(cluster) != 0xFFFE && hops++ < MBR_memory->data_length) {
+		int next = fat_get(cluster);
+		off_t offset = geo.cluster_bytes + cluster * sizeof(uint16_t);
+		if (!fsck_allocated(next)) {
+			fsck_report(FSCK_BAD_LINK, cluster, offset, next);
+			return;
+		}
+		if (!fsck_reach(next)) {
+			// the rest of a shared chain is checked by whoever reached it first
+			if (fsck_refs == NULL) fsck_report(FSCK_CROSS_LINK, cluster, offset, next);
+			return;
+		}
+		cluster = next;
+	}
+}
+
+// check every slot of the directory at cluster dh, read through the worker's reader, and queue its
+// subdirectories; an overflow cluster shared with another copy of the directory is only counted,
+// its slots are checked by whichever walk reached it first
+void fsck_directory(int dh, cluster_reader_t *reader) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int cluster = dh;
+	int first = sizeof(entry_t);
+	int children = 0;
+	int owner = 1; // this walk reached the cluster first
+	int hops = 0;
+	while (cluster != -1 && hops++ <= MBR_memory->data_length) {
+		uint8_t *data = reader_cluster(reader, cluster);
+		off_t location = cluster_offset(cluster);
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		int next = -1;
+		int next_owner = 0;
+		int s;
+		for (s = 0; s < slots; s++) {
+			uint8_t *slot = data + first + s * sizeof(entry_ptr_t);
+			off_t offset = location + first + s * sizeof(entry_ptr_t);
+			int target = le16(slot + 2);
+			if (!owner) {
+				if ((slot[0] == 0 || slot[0] == 1) && fsck_allocated(target)) children++;
+				else if (slot[0] == 2 && s == slots - 1 && fsck_allocated(target)) next = target;
+				continue;
+			}
+			if (slot[0] == 0 || slot[0] == 1) {
+				if (!fsck_allocated(target)) {
+					fsck_report(FSCK_BAD_POINTER, cluster, offset, target);
+				} else if (!fsck_reach(target)) {
+					if (fsck_refs != NULL) children++;
+					else fsck_report(FSCK_CROSS_LINK, cluster, offset, target);
+				} else {
+					children++;
+					if (slot[0] == 1) fsck_push(target);
+					else fsck_file(target);
+				}
+			} else if (slot[0] == 2) {
+				// a link is only valid in the last slot of a cluster
+				if (s != slots - 1 || !fsck_allocated(target)) {
+					fsck_report(FSCK_BAD_LINK, cluster, offset, target);
+				} else if (!fsck_reach(target)) {
+					if (fsck_refs != NULL) next = target;
+					else fsck_report(FSCK_CROSS_LINK, cluster, offset, target);
+				} else {
+					next = target;
+					next_owner = 1;
+				}
+			}
+		}
+		cluster = next;
+		owner = next_owner;
+		first = 0;
+	}
+
+	uint16_t children_count;
+	memcpy(&children_count, reader_cluster(reader, dh) + offsetof(entry_t, children_count), sizeof(uint16_t));
+	if (children_count != children) {
+		off_t offset = cluster_offset(dh) + offsetof(entry_t, children_count);
+		fsck_report(FSCK_BAD_COUNT, dh, offset, children);
+	}
+}
+
+void *fsck_worker(void *arg) {
+	cluster_reader_t reader;
+	reader_open(&reader, READER_BYTES);
+	pthread_mutex_lock(&fsck_lock);
+	while (1) {
+		while (fsck_queued == 0 && fsck_busy > 0) pthread_cond_wait(&fsck_cond, &fsck_lock);
+		if (fsck_queued == 0) break;
+		int dh = fsck_queue[--fsck_queued];
+		fsck_busy++;
+		pthread_mutex_unlock(&fsck_lock);
+		fsck_directory(dh, &reader);
+		pthread_mutex_lock(&fsck_lock);
+		fsck_busy--;
+	}
+	pthread_cond_broadcast(&fsck_cond);
+	pthread_mutex_unlock(&fsck_lock);
+	reader_close(&reader);
+	return NULL;
+}
+
+int compare_problems(const void *a, const void *b) {
+	const fsck_problem_t *x = (const fsck_problem_t *)a, *y = (const fsck_problem_t *)b;
+	if (x->kind != y->kind) return x->kind - y->kind;
+	return x->cluster - y->cluster;
+}
+
+// check the disk with nthreads workers, returns the number of problems found or -1 if it can't be loaded
+int do_fsck(int repair, int nthreads) {
+	crc_verify = 0;
+	int loaded = load_disk(DISK_NAME);
+	crc_verify = 1;
+	if (loaded == -1) return -1;
+	int cluster_size_bytes = geo.cluster_bytes;
+	// the workers read directories through readers of their own, a small data area is read in once
+	reader_load_small();
+	int words = (MBR_memory->data_length + 63) / 64;
+	fsck_bitmap = (uint64_t *)arena_alloc(sizeof(uint64_t) * words);
+	memset(fsck_bitmap, 0, sizeof(uint64_t) * words);
+	fsck_queue = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	fsck_queued = 0;
+	fsck_busy = 0;
+	fsck_count = 0;
+	fsck_refs = NULL;
+	int i;
+
+	// the snapshot area is reached from the MBR, and each snapshot root from its snapshot_t
+	int root = live_root();
+	if (COW_header != NULL) {
+		fsck_refs = (uint32_t *)arena_alloc(sizeof(uint32_t) * MBR_memory->data_length);
+		memset(fsck_refs, 0, sizeof(uint32_t) * MBR_memory->data_length);
+		int cluster = MBR_memory->cow_start;
+		for (i = 0; i < cow_clusters; i++, cluster = fat_get(cluster)) fsck_reach(cluster);
+		for (i = 0; i < COW_header->snapshot_count; i++) {
+			int snapshot_root = SNAP_memory[i].root;
+			if (!fsck_allocated(snapshot_root)) fsck_report(FSCK_BAD_SNAPSHOT, snapshot_root, 0, i);
+			else if (fsck_reach(snapshot_root)) fsck_push(snapshot_root);
+		}
+	}
+	if (!fsck_allocated(root)) fsck_report(FSCK_LEAKED, root, 0, 0); // the root must be allocated
+	if (fsck_reach(root)) fsck_push(root);
+	fat_load_all();
+	disk_open(DISK_NAME);
+	pthread_t threads[nthreads];
+	for (i = 0; i < nthreads; i++) pthread_create(&threads[i], NULL, fsck_worker, NULL);
+	for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+
+	for (i = 0; i < MBR_memory->data_length; i++) {
+		if (fat_get(i) != 0xFFFF && !(fsck_bitmap[i / 64] & ((uint64_t)1 << (i % 64)))) {
+			fsck_report(FSCK_LEAKED, i, cluster_size_bytes + i * sizeof(uint16_t), 0);
+		} else if (fsck_refs != NULL && fat_get(i) != 0xFFFF && fsck_refs[i] != COW_memory[i].refs) {
+			fsck_report(FSCK_BAD_REFS, i, 0, fsck_refs[i]);
+		}
+	}
+	// the summary in the MBR and the groups, a stale group only has its free count to compare
+	int free_count, free_hint;
+	fat_group_t *groups = (fat_group_t *)arena_alloc(sizeof(fat_group_t) * (fat_pages + 1));
+	fat_count(groups, &free_count, &free_hint);
+	int groups_bad = 0;
+	for (i = 0; i < fat_pages; i++) {
+		if (groups[i].free != fat_groups[i].free) groups_bad = 1;
+		if (!fat_group_stale[i] && memcmp(&groups[i], &fat_groups[i], sizeof(fat_group_t)) != 0) groups_bad = 1;
+	}
+	if (MBR_memory->free_count != free_count || fat_free_hint > free_hint || groups_bad) {
+		fsck_report(FSCK_BAD_SUMMARY, -1, 0, free_count);
+	}
+	if (CRC_memory != NULL) {
+		int table_bytes = sizeof(uint32_t) * (MBR_memory->data_length + 1);
+		if (crc32c(MBR_memory, offsetof(mbr_t, crc_mbr)) != MBR_memory->crc_mbr || crc32c(CRC_memory, table_bytes) != MBR_memory->crc_table) {
+			fsck_report(FSCK_BAD_CHECKSUM, -2, 0, 0);
+		}
+		if (fat_crc() != CRC_memory[0]) fsck_report(FSCK_BAD_CHECKSUM, -1, 0, 0);
+		// the clusters go by in order, so the sweep reads a bigger window at a time
+		cluster_reader_t sweep;
+		reader_open(&sweep, 16 * READER_BYTES);
+		for (i = 0; i < MBR_memory->data_length; i++) {
+			if (crc32c(reader_cluster(&sweep, i), cluster_size_bytes) != CRC_memory[1 + i]) fsck_report(FSCK_BAD_CHECKSUM, i, 0, 0);
+		}
+		reader_close(&sweep);
+	}
+	disk_close();
+
+	if (fsck_count > 0) qsort(fsck_problems, fsck_count, sizeof(fsck_problem_t), compare_problems);
+	for (i = 0; i < fsck_count; i++) {
+		fsck_problem_t *p = &fsck_problems[i];
+		if (p->kind == FSCK_BAD_COUNT) printf("fsck: %s in directory at cluster %d, should be %d\n", fsck_names[p->kind], p->cluster, p->value);
+		else if (p->kind == FSCK_BAD_REFS) printf("fsck: %s of cluster %d, should be %d\n", fsck_names[p->kind], p->cluster, p->value);
+		else if (p->kind == FSCK_BAD_SNAPSHOT) printf("fsck: %s %d in snapshot %.16s\n", fsck_names[p->kind], p->cluster, SNAP_memory[p->value].name);
+		else if (p->kind == FSCK_LEAKED) printf("fsck: %s %d\n", fsck_names[p->kind], p->cluster);
+		else if (p->kind == FSCK_BAD_CHECKSUM && p->cluster == -2) printf("fsck: %s in the MBR or checksum table\n", fsck_names[p->kind]);
+		else if (p->kind == FSCK_BAD_CHECKSUM && p->cluster == -1) printf("fsck: %s in the FAT\n", fsck_names[p->kind]);
+		else if (p->kind == FSCK_BAD_CHECKSUM) printf("fsck: %s in data cluster %d\n", fsck_names[p->kind], p->cluster);
+		else if (p->kind == FSCK_BAD_SUMMARY) printf("fsck: %s, %d clusters are free\n", fsck_names[p->kind], p->value);
+		else printf("fsck: %s %d in cluster %d\n", fsck_names[p->kind], p->value, p->cluster);
+	}
+
+	if (repair && fsck_count > 0) {
+		// bad slots are cleared, counts rewritten and leaked clusters returned to the FAT
+		uint8_t free_slot[sizeof(entry_ptr_t)];
+		memset(free_slot, 0xFF, sizeof(entry_ptr_t));
+		disk_open(DISK_NAME);
+		for (i = 0; i < fsck_count; i++) {
+			fsck_problem_t *p = &fsck_problems[i];
+			if (p->kind == FSCK_LEAKED) {
+				fat_set(p->cluster, p->cluster == root ? 0xFFFE : 0xFFFF);
+				if (COW_memory != NULL) COW_memory[p->cluster].refs = p->cluster == root;
+			} else if (p->kind == FSCK_BAD_REFS) {
+				COW_memory[p->cluster].refs = p->value;
+			} else if (p->kind == FSCK_BAD_SNAPSHOT) {
+				SNAP_memory[p->value].name[0] = '\0'; // dropped below
+			} else if (p->kind == FSCK_BAD_CHECKSUM) {
+				if (p->cluster == -1) crc_fat_dirty = 1;
+				else if (p->cluster >= 0) crc_dirty[p->cluster] = 1;
+				crc_pending = 1; // unload_disk recomputes them, and rewrites the table and the MBR
+			} else if (p->kind == FSCK_BAD_SUMMARY) {
+				continue; // counted again below, once the leaked clusters are back
+			} else if (p->kind == FSCK_BAD_COUNT) {
+				uint16_t children_count = p->value;
+				disk_write(&children_count, sizeof(uint16_t), p->offset);
+			} else if (p->offset < geo.data_offset) {
+				fat_set(p->cluster, 0xFFFE); // end the file at the last good cluster
+			} else {
+				disk_write(free_slot, sizeof(entry_ptr_t), p->offset);
+			}
+		}
+		disk_close();
+		fat_rebuild();
+		if (COW_header != NULL) {
+			int kept = 0;
+			for (i = 0; i < COW_header->snapshot_count; i++) {
+				if (SNAP_memory[i].name[0] != '\0') SNAP_memory[kept++] = SNAP_memory[i];
+			}
+			COW_header->snapshot_count = kept;
+			cow_write_back();
+		} else {
+			disk_open(DISK_NAME);
+			fat_write_back();
+			disk_close();
+		}
+		printf("fsck: repaired %d problems\n", fsck_count);
+	}
+	int problems = fsck_count;
+	free(fsck_problems);
+	fsck_problems = NULL;
+	fsck_capacity = 0;
+	unload_disk();
+	return problems;
+}
+// **************** end fsck functions *****************//
+
+// ************************** walk related functions ********************//
+// fs_walk visits a directory tree on several threads; each thread keeps a deque of directories
+// still to read, takes the newest from the bottom of its own and, once that is empty, steals the
+// oldest from the top of another's, which is the root of the biggest subtree left there
+// like fsck each thread reads directories and entries through cluster readers of its own, and a
+// bitmap keeps any directory from being read twice
+typedef struct {
+	int dh; // cluster of the directory
+	int depth;
+} walk_item_t;
+
+typedef struct {
+	walk_item_t *items; // each directory is pushed once, so data_length items always fit
+	// top and bottom change under lock, with atomic stores since thieves peek at them without it
+	int top; // oldest, taken by thieves
+	int bottom; // one past the newest, pushed and taken by the owner
+	pthread_mutex_t lock;
+} walk_deque_t;
+
+walk_deque_t *walk_deques;
+cluster_reader_t *walk_readers; // two for each thread: its directory's clusters, and the entries in them
+__thread cluster_reader_t *walk_reader; // the thread's entry reader, callbacks may use it too
+int walk_threads;
+int walk_pending; // directories pushed and not read yet, the walk is over when none are
+int walk_stop; // set once the callback asks to end the walk
+int walk_flags; // SNAPSHOT_HANDLE when walking a snapshot, added to every handle passed on
+walk_fn walk_callback;
+void *walk_arg;
+uint64_t *walk_bitmap; // one bit per data cluster, set once the directory there is pushed
+int walk_visited; // entries passed to the callback
+
+// mark a directory as pushed, returns 0 if it already was
+int walk_mark(int cluster) {
+	uint64_t bit = (uint64_t)1 << (cluster % 64);
+	return !(__atomic_fetch_or(&walk_bitmap[cluster / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+void walk_push(int id, int dh, int depth) {
+	walk_deque_t *deque = &walk_deques[id];
+	__atomic_fetch_add(&walk_pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&deque->lock);
+	deque->items[deque->bottom].dh = dh;
+	deque->items[deque->bottom].depth = depth;
+	__atomic_store_n(&deque->bottom, deque->bottom + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&deque->lock);
+}
+
+// take the newest directory from the thread's own deque, returns 0 if it is empty
+int walk_pop(int id, walk_item_t *item) {
+	walk_deque_t *deque = &walk_deques[id];
+	int found = 0;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->bottom > deque->top) {
+		*item = deque->items[deque->bottom - 1];
+		__atomic_store_n(&deque->bottom, deque->bottom - 1, __ATOMIC_RELAXED);
+		found = 1;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// take the oldest directory from another thread's deque, trying them in turn from the next one
+int walk_steal(int id, walk_item_t *item) {
+	int k;
+	for (k = 1; k < walk_threads; k++) {
+		walk_deque_t *deque = &walk_deques[(id + k) % walk_threads];
+		if (__atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) <= __atomic_load_n(&deque->top, __ATOMIC_RELAXED)) continue;
+		int found = 0;
+		pthread_mutex_lock(&deque->lock);
+		if (deque->bottom > deque->top) {
+			*item = deque->items[deque->top];
+			__atomic_store_n(&deque->top, deque->top + 1, __ATOMIC_RELAXED);
+			found = 1;
+		}
+		pthread_mutex_unlock(&deque->lock);
+		if (found) {
+			STAT_ADD(walk_steals, 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// pass every child of the directory to the callback and push its subdirectories
+void walk_directory(int id, walk_item_t *item) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int cluster = item->dh;
+	int first = sizeof(entry_t);
+	int hops = 0;
+	cluster_reader_t *directory = &walk_readers[2 * id];
+	while (cluster != -1 && hops++ <= MBR_memory->data_length) {
+		uint8_t *data = reader_cluster(directory, cluster);
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		int next = -1;
+		int s;
+		for (s = 0; s < slots; s++) {
+			uint8_t *slot = data + first + s * sizeof(entry_ptr_t);
+			int target = le16(slot + 2);
+			if (target >= MBR_memory->data_length) continue;
+			if (slot[0] == 2 && s == slots - 1) next = target;
+			if (slot[0] != 0 && slot[0] != 1) continue;
+			if (__atomic_load_n(&walk_stop, __ATOMIC_RELAXED)) return;
+			// the callback may read through walk_reader, so it gets a copy of the entry
+			entry_t entry;
+			memcpy(&entry, reader_cluster(walk_reader, target), sizeof(entry_t));
+			STAT_ADD(walk_entries, 1);
+			__atomic_fetch_add(&walk_visited, 1, __ATOMIC_RELAXED);
+			int skip = walk_callback(&entry, target | walk_flags, item->dh | walk_flags, item->depth + 1, walk_arg);
+			if (skip < 0) {
+				__atomic_store_n(&walk_stop, 1, __ATOMIC_RELAXED);
+				return;
+			}
+			if (slot[0] == 1 && skip == 0 && walk_mark(target)) walk_push(id, target, item->depth + 1);
+		}
+		cluster = next;
+		first = 0;
+	}
+}
+
+void *walk_worker(void *arg) {
+	int id = *(int *)arg;
+	walk_reader = &walk_readers[2 * id + 1];
+	walk_item_t item;
+	while (1) {
+		if (walk_pop(id, &item) || walk_steal(id, &item)) {
+			walk_directory(id, &item);
+			// a directory's children are pushed before it stops counting, so 0 means nothing is left anywhere
+			__atomic_fetch_sub(&walk_pending, 1, __ATOMIC_ACQ_REL);
+		} else if (__atomic_load_n(&walk_pending, __ATOMIC_ACQUIRE) == 0) {
+			break;
+		} else {
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+// call fn for everything below the directory at dh with nthreads threads
+// returns the number of entries passed to fn, or -1 if dh isn't a directory
+int do_walk(int dh, walk_fn fn, void *arg, int nthreads) {
+	if (load_disk(DISK_NAME) == -1) return -1;
+	int root = handle_cluster(dh);
+	if (root < 0 || root >= MBR_memory->data_length || fat_get(root) == 0xFFFF) {
+		unload_disk();
+		return -1;
+	}
+	if (((entry_t *)(data_cluster(root)))->entry_type != 1) {
+		unload_disk();
+		return -1;
+	}
+	if (nthreads < 1) nthreads = 1;
+	int words = (MBR_memory->data_length + 63) / 64;
+	walk_bitmap = (uint64_t *)arena_alloc(sizeof(uint64_t) * words);
+	memset(walk_bitmap, 0, sizeof(uint64_t) * words);
+	walk_deques = (walk_deque_t *)arena_alloc(sizeof(walk_deque_t) * nthreads);
+	walk_readers = (cluster_reader_t *)arena_alloc(sizeof(cluster_reader_t) * 2 * nthreads);
+	int i;
+	reader_load_small();
+	for (i = 0; i < 2 * nthreads; i++) reader_open(&walk_readers[i], READER_BYTES);
+	for (i = 0; i < nthreads; i++) {
+		walk_deques[i].items = (walk_item_t *)arena_alloc(sizeof(walk_item_t) * MBR_memory->data_length);
+		walk_deques[i].top = 0;
+		walk_deques[i].bottom = 0;
+		pthread_mutex_init(&walk_deques[i].lock, NULL);
+	}
+	walk_threads = nthreads;
+	walk_pending = 0;
+	walk_stop = 0;
+	walk_flags = dh & SNAPSHOT_HANDLE;
+	walk_callback = fn;
+	walk_arg = arg;
+	walk_visited = 0;
+
+	walk_mark(root);
+	walk_push(0, root, 0);
+	fat_load_all();
+	disk_open(DISK_NAME);
+	pthread_t threads[nthreads];
+	int ids[nthreads];
+	for (i = 0; i < nthreads; i++) {
+		ids[i] = i;
+		pthread_create(&threads[i], NULL, walk_worker, &ids[i]);
+	}
+	for (i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+	disk_close();
+	for (i = 0; i < nthreads; i++) pthread_mutex_destroy(&walk_deques[i].lock);
+	for (i = 0; i < 2 * nthreads; i++) reader_close(&walk_readers[i]);
+	unload_disk();
+	return walk_visited;
+}
+
+// clusters an entry takes: the FAT chain of a file, or a directory and its overflow clusters
+uint64_t walk_clusters(entry_t *entry, int cluster) {
+	uint64_t clusters = 1;
+	if (entry->entry_type == 1) {
+		int cluster_size_bytes = geo.cluster_bytes;
+		int first = sizeof(entry_t);
+		while (clusters <= MBR_memory->data_length) {
+			int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+			uint8_t *last = reader_cluster(walk_reader, cluster) + first + (slots - 1) * sizeof(entry_ptr_t);
+			cluster = le16(last + 2);
+			if (last[0] != 2 || cluster >= MBR_memory->data_length) break;
+			clusters++;
+			first = 0;
+		}
+	} else {
+		while (fat_get(cluster) < MBR_memory->data_length && clusters <= MBR_memory->data_length) {
+			cluster = fat_get(cluster);
+			clusters++;
+		}
+	}
+	return clusters;
+}
+
+int du_entry(entry_t *entry, int handle, int parent, int depth, void *arg) {
+	du_t *du = (du_t *)arg;
+	if (entry->entry_type == 1) {
+		__atomic_fetch_add(&du->directories, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_fetch_add(&du->files, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&du->bytes, entry->size, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&du->clusters, walk_clusters(entry, handle & 0xFFFF), __ATOMIC_RELAXED);
+	return 0;
+}
+
+typedef struct {
+	char *pattern;
+	int *handles;
+	int max;
+	int found;
+} find_t;
+
+// 1 if the entry's name matches the shell pattern
+int find_match(entry_t *entry, char *pattern) {
+	char name[17];
+	int len = entry->name_len < 16 ? entry->name_len : 16;
+	memcpy(name, entry->name, len);
+	name[len] = '\0';
+	return fnmatch(pattern, name, 0) == 0;
+}
+
+int find_entry(entry_t *entry, int handle, int parent, int depth, void *arg) {
+	find_t *find = (find_t *)arg;
+	if (!find_match(entry, find->pattern)) return 0;
+	int n = __atomic_fetch_add(&find->found, 1, __ATOMIC_RELAXED);
+	if (n < find->max) find->handles[n] = handle;
+	return n + 1 >= find->max ? -1 : 0;
+}
+
+// print every match as it's found, for --find
+int find_print(entry_t *entry, int handle, int parent, int depth, void *arg) {
+	if (find_match(entry, (char *)arg)) {
+		printf("find: %s %.*s at depth %d, handle %d in directory %d\n", entry->entry_type == 1 ? "directory" : "file",
+			entry->name_len < 16 ? entry->name_len : 16, entry->name, depth, handle, parent);
+	}
+	return 0;
+}
+// **************** end walk functions *****************//
+
+// ************************** defrag related functions ******************//
+// fs_defrag runs one time slice of an incremental defragmentation and returns the amount of work
+// left, 0 once the disk is laid out; a slice run as background work also ends once foreground
+// operations are waiting for fs_lock
+// each slice walks the tree from the root, compacts directories whose slots have holes or that
+// hold more overflow clusters than they need, and then swaps clusters into breadth first order:
+// every directory and file chain contiguous and the children of a directory right after it
+// moving a directory changes its cluster, so open a directory again after a slice
+// a volume that has had snapshots is left alone, clusters there can have several parents
+enum { DEFRAG_FREE, DEFRAG_DIR, DEFRAG_OVERFLOW, DEFRAG_FILE };
+#define DEFRAG_NO_REF INT_MIN
+
+uint8_t *defrag_image; // data area being rearranged, when it is in memory
+uint8_t **defrag_held; // otherwise the clusters read so far, each in the arena, NULL for the rest
+size_t defrag_held_bytes;
+uint8_t *defrag_kind; // what each cluster holds
+off_t *defrag_ref; // pointer to each cluster: a slot offset in the data area, or the FAT entry -(ref + 1)
+uint8_t *defrag_dirty; // clusters to write back at the end of the slice
+int *defrag_order; // reachable clusters in the order they should be laid out
+int defrag_items;
+
+// cluster c of the data area being rearranged; without the data area in memory it is read
+// through the block cache when it is first needed and held until the end of the slice
+uint8_t *defrag_cluster(int c) {
+	if (defrag_image != NULL) {
+		crc_first_read(c); // before the slice changes it in memory
+		return defrag_image + ((size_t)c << geo.cluster_shift);
+	}
+	if (defrag_held[c] == NULL) {
+		defrag_held[c] = (uint8_t *)arena_alloc(geo.cluster_bytes);
+		memcpy(defrag_held[c], data_cluster(c), geo.cluster_bytes);
+		defrag_held_bytes += geo.cluster_bytes;
+	}
+	return defrag_held[c];
+}
+
+// the byte at offset ref of the data area, for the slot offsets in defrag_ref
+uint8_t *defrag_at(off_t ref) {
+	return defrag_cluster(ref >> geo.cluster_shift) + (ref & (geo.cluster_bytes - 1));
+}
+
+// point defrag_image at the data area in memory, or start holding clusters as they are read
+void defrag_load() {
+	int data_length = MBR_memory->data_length;
+	reader_load_small();
+	defrag_image = DATA_memory;
+	defrag_held = NULL;
+	defrag_held_bytes = 0;
+	if (defrag_image == NULL) {
+		defrag_held = (uint8_t **)arena_alloc(sizeof(uint8_t *) * data_length);
+		memset(defrag_held, 0, sizeof(uint8_t *) * data_length);
+	}
+}
+
+int defrag_valid(int cluster) {
+	return cluster < MBR_memory->data_length && fat_get(cluster) != 0xFFFF && defrag_kind[cluster] == DEFRAG_FREE;
+}
+
+void defrag_append(int cluster, int kind, off_t ref) {
+	defrag_kind[cluster] = kind;
+	defrag_ref[cluster] = ref;
+	defrag_order[defrag_items++] = cluster;
+}
+
+// append a directory with its overflow clusters, or a file with its FAT chain, so the chain is laid out together
+void defrag_append_chain(int cluster, int kind, off_t ref) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	defrag_append(cluster, kind, ref);
+	if (kind == DEFRAG_FILE) {
+		while (fat_get(cluster) != 0xFFFE && defrag_valid(fat_get(cluster))) {
+			defrag_append(fat_get(cluster), DEFRAG_FILE, -(cluster + 1));
+			cluster = fat_get(cluster);
+		}
+		return;
+	}
+	int first = sizeof(entry_t);
+	while (1) {
+		off_t last = (off_t)cluster * cluster_size_bytes + cluster_size_bytes - (cluster_size_bytes - first) % sizeof(entry_ptr_t) - sizeof(entry_ptr_t);
+		uint8_t *slot = defrag_at(last);
+		int next = le16(slot + 2);
+		if (slot[0] != 2 || !defrag_valid(next)) return;
+		defrag_append(next, DEFRAG_OVERFLOW, last);
+		cluster = next;
+		first = 0;
+	}
+}
+
+// walk the tree breadth first from the root, filling defrag_order, defrag_kind and defrag_ref
+void defrag_walk() {
+	int cluster_size_bytes = geo.cluster_bytes;
+	memset(defrag_kind, DEFRAG_FREE, MBR_memory->data_length);
+	defrag_items = 0;
+	defrag_append_chain(live_root(), DEFRAG_DIR, DEFRAG_NO_REF);
+	int i;
+	for (i = 0; i < defrag_items; i++) {
+		int cluster = defrag_order[i];
+		int first;
+		if (defrag_kind[cluster] == DEFRAG_DIR) first = sizeof(entry_t);
+		else if (defrag_kind[cluster] == DEFRAG_OVERFLOW) first = 0;
+		else continue;
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		int s;
+		for (s = 0; s < slots; s++) {
+			off_t offset = (off_t)cluster * cluster_size_bytes + first + s * sizeof(entry_ptr_t);
+			uint8_t *slot = defrag_at(offset);
+			int target = le16(slot + 2);
+			if ((slot[0] == 0 || slot[0] == 1) && defrag_valid(target)) {
+				defrag_append_chain(target, slot[0] == 1 ? DEFRAG_DIR : DEFRAG_FILE, offset);
+			}
+		}
+	}
+}
+
+// point the pointer at ref to cluster
+void defrag_set_ptr(off_t ref, int cluster) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	if (ref == DEFRAG_NO_REF) return;
+	if (ref < 0) {
+		fat_set(-(ref + 1), cluster);
+		return;
+	}
+	uint8_t *slot = defrag_at(ref);
+	slot[2] = cluster & 0xFF;
+	slot[3] = cluster >> 8;
+	defrag_dirty[ref / cluster_size_bytes] = 1;
+}
+
+// rewrite the slots of the directory at cluster dh with no holes, freeing the overflow clusters
+// that are no longer needed, returns 0 if the directory was already compact
+int defrag_compact(int dh) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	int per_overflow = cluster_size_bytes / sizeof(entry_ptr_t) - 1; // the last slot is kept for the link
+	int per_first = (cluster_size_bytes - sizeof(entry_t)) / sizeof(entry_ptr_t) - 1;
+	int chain[MBR_memory->data_length];
+	int length = 0;
+	int children = 0;
+	int holes = 0; // a free slot before a used one
+	int free_seen = 0;
+	int cluster = dh;
+	while (1) {
+		chain[length++] = cluster;
+		int first = cluster == dh ? sizeof(entry_t) : 0;
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		int s;
+		for (s = 0; s < slots - 1; s++) {
+			uint8_t type = defrag_cluster(cluster)[first + s * sizeof(entry_ptr_t)];
+			if (type == 0 || type == 1) {
+				children++;
+				if (free_seen) holes = 1;
+			} else {
+				free_seen = 1;
+			}
+		}
+		uint8_t *last = defrag_cluster(cluster) + first + (slots - 1) * sizeof(entry_ptr_t);
+		int next = le16(last + 2);
+		if (last[0] != 2 || next >= MBR_memory->data_length || defrag_kind[next] != DEFRAG_OVERFLOW) break;
+		cluster = next;
+	}
+	int needed = 1;
+	if (children > per_first) needed += (children - per_first + per_overflow - 1) / per_overflow;
+	if (!holes && needed == length) return 0;
+
+	// gather the child slots in order, then lay them out again from the first slot
+	uint8_t *slots_copy = (uint8_t *)arena_alloc(children * sizeof(entry_ptr_t) + 1);
+	int c = 0, j, s;
+	for (j = 0; j < length; j++) {
+		int first = j == 0 ? sizeof(entry_t) : 0;
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		for (s = 0; s < slots - 1; s++) {
+			uint8_t *slot = defrag_cluster(chain[j]) + first + s * sizeof(entry_ptr_t);
+			if (slot[0] == 0 || slot[0] == 1) memcpy(slots_copy + c++ * sizeof(entry_ptr_t), slot, sizeof(entry_ptr_t));
+		}
+	}
+	c = 0;
+	for (j = 0; j < needed; j++) {
+		int first = j == 0 ? sizeof(entry_t) : 0;
+		int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+		off_t base = (off_t)chain[j] * cluster_size_bytes + first;
+		memset(defrag_at(base), 0xFF, slots * sizeof(entry_ptr_t));
+		for (s = 0; s < slots - 1 && c < children; s++, c++) {
+			uint8_t *slot = defrag_at(base + s * sizeof(entry_ptr_t));
+			memcpy(slot, slots_copy + c * sizeof(entry_ptr_t), sizeof(entry_ptr_t));
+			defrag_ref[le16(slot + 2)] = base + s * sizeof(entry_ptr_t);
+		}
+		if (j < needed - 1) {
+			uint8_t *link = defrag_at(base + (slots - 1) * sizeof(entry_ptr_t));
+			link[0] = 2;
+			link[1] = 0;
+			link[2] = chain[j + 1] & 0xFF;
+			link[3] = chain[j + 1] >> 8;
+			defrag_ref[chain[j + 1]] = base + (slots - 1) * sizeof(entry_ptr_t);
+		}
+		defrag_dirty[chain[j]] = 1;
+	}
+	for (j = needed; j < length; j++) {
+		fat_set(chain[j], 0xFFFF);
+		defrag_kind[chain[j]] = DEFRAG_FREE;
+		defrag_ref[chain[j]] = DEFRAG_NO_REF;
+		memset(defrag_cluster(chain[j]), 0xFF, cluster_size_bytes);
+		defrag_dirty[chain[j]] = 1;
+	}
+	return 1;
+}
+
+// after cluster x received new contents, point the refs of everything it points to back at it
+void defrag_rescan(int x) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	if (defrag_kind[x] == DEFRAG_FILE) {
+		if (fat_get(x) < MBR_memory->data_length) defrag_ref[fat_get(x)] = -(x + 1);
+		return;
+	}
+	if (defrag_kind[x] != DEFRAG_DIR && defrag_kind[x] != DEFRAG_OVERFLOW) return;
+	int first = defrag_kind[x] == DEFRAG_DIR ? sizeof(entry_t) : 0;
+	int slots = (cluster_size_bytes - first) / sizeof(entry_ptr_t);
+	int s;
+	for (s = 0; s < slots; s++) {
+		off_t offset = (off_t)x * cluster_size_bytes + first + s * sizeof(entry_ptr_t);
+		uint8_t *slot = defrag_at(offset);
+		int target = le16(slot + 2);
+		if (slot[0] <= 2 && target < MBR_memory->data_length && defrag_kind[target] != DEFRAG_FREE) defrag_ref[target] = offset;
+	}
+}
+
+// exchange the contents of clusters a and b, fixing the pointers to both
+void defrag_swap(int a, int b, uint8_t *scratch) {
+	int cluster_size_bytes = geo.cluster_bytes;
+	off_t refs[2] = { defrag_ref[a], defrag_ref[b] };
+	if (defrag_image != NULL) {
+		memcpy(scratch, defrag_cluster(a), cluster_size_bytes);
+		memcpy(defrag_cluster(a), defrag_cluster(b), cluster_size_bytes);
+		memcpy(defrag_cluster(b), scratch, cluster_size_bytes);
+	} else {
+		uint8_t *held = defrag_cluster(a);
+		defrag_held[a] = defrag_cluster(b);
+		defrag_held[b] = held;
+	}
+	uint16_t fat = fat_get(a);
+	fat_set(a, fat_get(b));
+	fat_set(b, fat);
+	uint8_t kind = defrag_kind[a];
+	defrag_kind[a] = defrag_kind[b];
+	defrag_kind[b] = kind;
+
+	// a pointer held in a or b itself moved along with it
+	int i;
+	for (i = 0; i < 2; i++) {
+		off_t ref = refs[i];
+		if (ref == DEFRAG_NO_REF) continue;
+		if (ref < 0) {
+			if (-(ref + 1) == a) ref = -(b + 1);
+			else if (-(ref + 1) == b) ref = -(a + 1);
+		} else if (ref / cluster_size_bytes == a) {
+			ref += (off_t)(b - a) * cluster_size_bytes;
+		} else if (ref / cluster_size_bytes == b) {
+			ref += (off_t)(a - b) * cluster_size_bytes;
+		}
+		refs[i] = ref;
+	}
+	defrag_set_ptr(refs[0], b);
+	defrag_set_ptr(refs[1], a);
+	defrag_ref[b] = refs[0];
+	defrag_ref[a] = refs[1];
+	defrag_rescan(a);
+	defrag_rescan(b);
+	defrag_dirty[a] = 1;
+	defrag_dirty[b] = 1;
+}
+
+// run one slice of at most slice_ns nanoseconds, returns the work left
+int do_defrag(uint64_t slice_ns) {
+	uint64_t start = now_ns();
+	if (load_disk(DISK_NAME) == -1) return -1;
+	if (COW_header != NULL) {
+		printf("fs_defrag: not defragmenting, the volume has had snapshots\n");
+		unload_disk();
+		return 0;
+	}
+	// clusters are about to move, what the dedup index knows of them won't hold
+	free(dedup_key);
+	dedup_key = NULL;
+	dedup_length = 0;
+	int cluster_size_bytes = geo.cluster_bytes;
+	int data_length = MBR_memory->data_length;
+	defrag_load();
+	// the clusters are read through the block cache as the slice needs them
+	disk_open(DISK_NAME);
+	defrag_kind = (uint8_t *)arena_alloc(data_length);
+	defrag_ref = (off_t *)arena_alloc(sizeof(off_t) * data_length);
+	defrag_dirty = (uint8_t *)arena_alloc(data_length);
+	defrag_order = (int *)arena_alloc(sizeof(int) * data_length);
+	memset(defrag_dirty, 0, data_length);
+	defrag_walk();
+
+	// first pass: compact directories, the layout is worked out again in the next slice
+	// every slice does at least one unit of work, so a short slice still makes progress
+	int left = 0;
+	int done = 0;
+	int i;
+	for (i = 0; i < defrag_items; i++) {
+		int cluster = defrag_order[i];
+		if (defrag_kind[cluster] != DEFRAG_DIR) continue;
+		if (done > 0 && (now_ns() - start > slice_ns || io_preempted() || defrag_held_bytes > CACHE_BYTES)) {
+			left++;
+			continue;
+		}
+		int compacted = defrag_compact(cluster);
+		left += compacted;
+		done += compacted;
+	}
+
+	// second pass: move item i of the layout to cluster i
+	if (left == 0) {
+		int *item = (int *)arena_alloc(sizeof(int) * data_length); // item held by each cluster, -1 if none
+		int *where = (int *)arena_alloc(sizeof(int) * defrag_items); // cluster holding each item
+		uint8_t *scratch = (uint8_t *)arena_alloc(cluster_size_bytes);
+		for (i = 0; i < data_length; i++) item[i] = -1;
+		for (i = 0; i < defrag_items; i++) {
+			where[i] = defrag_order[i];
+			item[defrag_order[i]] = i;
+		}
+		for (i = 0; i < defrag_items; i++) {
+			if (where[i] == i) continue;
+			if (done > 0 && (now_ns() - start > slice_ns || io_preempted() || defrag_held_bytes > CACHE_BYTES)) {
+				left++;
+				continue;
+			}
+			done++;
+			int from = where[i];
+			int other = item[i];
+			defrag_swap(from, i, scratch);
+			where[i] = i;
+			item[i] = i;
+			item[from] = other;
+			if (other != -1) where[other] = from;
+		}
+	}
+
+	disk_close();
+
+	disk_open(DISK_NAME);
+	for (i = 0; i < data_length; i++) {
+		if (defrag_dirty[i]) disk_write(defrag_cluster(i), cluster_size_bytes, cluster_offset(i));
+	}
+	fat_write_back();
+	disk_close();
+	unload_disk();
+	return left;
+}
+
+// print how scattered the tree is and how long reading it in traversal order takes
+void defrag_report(char *label) {
+	if (load_disk(DISK_NAME) == -1) return;
+	int cluster_size_bytes = geo.cluster_bytes;
+	int data_length = MBR_memory->data_length;
+	defrag_load();
+	defrag_kind = (uint8_t *)arena_alloc(data_length);
+	defrag_ref = (off_t *)arena_alloc(sizeof(off_t) * data_length);
+	defrag_order = (int *)arena_alloc(sizeof(int) * data_length);
+	disk_open(DISK_NAME);
+	defrag_walk();
+	disk_close();
+
+	int breaks = 0;
+	uint64_t distance = 0;
+	uint8_t *buf = (uint8_t *)arena_alloc(cluster_size_bytes);
+	int i;
+	uint64_t start = now_ns();
+	disk_open(DISK_NAME);
+	for (i = 0; i < defrag_items; i++) {
+		disk_read(buf, cluster_size_bytes, cluster_offset(defrag_order[i]));
+		if (i > 0 && defrag_order[i] != defrag_order[i - 1] + 1) {
+			breaks++;
+			distance += abs(defrag_order[i] - defrag_order[i - 1]);
+		}
+	}
+	disk_close();
+	uint64_t elapsed = now_ns() - start;
+	printf("%s: %d clusters in use, %d discontinuities, mean jump %.1f clusters, traversal %llu ns\n", label, defrag_items,
+		breaks, breaks ? (double)distance / breaks : 0.0, (unsigned long long)elapsed);
+	unload_disk();
+}
+// **************** end defrag functions *****************//
+
+// ************************** migration related functions ***************//
+// fs_migrate brings FileSystem.bin up to FS_VERSION in place, once; every other operation
+// refuses an image of another version
+// version 0 images stored creation_date and creation_time big-endian, every entry_t reachable
+// from the live root or a snapshot root gets them swapped, each once even if it's shared
+// images before version 2 have no free cluster summary and those before version 3 no generation,
+// load_disk counts the summary from the FAT as it does after an unclean shutdown; the MBR grows
+// by them, which moves crc_mbr, so the MBR checksum isn't checked on the way in
+// version 4 took stripe_count and stripe_unit from the end of disk_name, which format left zero
+
+// swap the timestamps of every reachable entry, returns the number of entries rewritten
+int migrate_timestamps() {
+	uint8_t *seen = (uint8_t *)arena_alloc(MBR_memory->data_length);
+	memset(seen, 0, MBR_memory->data_length);
+	int *stack = (int *)arena_alloc(sizeof(int) * MBR_memory->data_length);
+	int depth = 0;
+	int root = live_root();
+	seen[root] = 1;
+	stack[depth++] = root;
+	int i;
+	for (i = 0; COW_header != NULL && i < COW_header->snapshot_count; i++) {
+		int snapshot_root = SNAP_memory[i].root;
+		if (snapshot_root < MBR_memory->data_length && !seen[snapshot_root]) {
+			seen[snapshot_root] = 1;
+			stack[depth++] = snapshot_root;
+		}
+	}
+	int migrated = 0;
+	while (depth > 0) {
+		int cluster = stack[--depth];
+		entry_t entry;
+		memcpy(&entry, data_cluster(cluster), sizeof(entry_t));
+		entry.creation_date = __builtin_bswap16(entry.creation_date);
+		entry.creation_time = __builtin_bswap16(entry.creation_time);
+		disk_write(&entry, sizeof(entry_t), cluster_offset(cluster));
+		migrated++;
+		if (entry.entry_type != 1) continue;
+		slot_cursor_t cursor;
+		slot_cursor_init(&cursor, cluster);
+		uint8_t *slot;
+		while ((slot = next_child(&cursor)) != NULL) {
+			int child = le16(slot + 2);
+			if (child < MBR_memory->data_length && !seen[child]) {
+				seen[child] = 1;
+				stack[depth++] = child;
+			}
+		}
+	}
+	return migrated;
+}
+
+// migrate the disk, returns the number of entries rewritten, or -1 if it can't be migrated
+int do_migrate() {
+	disk_migrating = 1;
+	crc_verify = 0;
+	int loaded = load_disk(DISK_NAME);
+	crc_verify = 1;
+	disk_migrating = 0;
+	if (loaded == -1) return -1;
+	int version = MBR_memory->magic == FS_MAGIC ? MBR_memory->version : 0;
+	if (MBR_memory->magic != FS_MAGIC && MBR_memory->magic != 0) {
+		printf("migrate: %s isn't a disk this program made\n", DISK_NAME);
+		unload_disk();
+		return -1;
+	}
+	if (version >= FS_VERSION) {
+		if (version > FS_VERSION) printf("migrate: %s is version %d, newer than this program\n", DISK_NAME, version);
+		else printf("migrate: %s is already version %d\n", DISK_NAME, FS_VERSION);
+		unload_disk();
+		return version == FS_VERSION ? 0 : -1;
+	}
+	int migrated = 0;
+	disk_open(DISK_NAME);
+	if (version < 1) migrated = migrate_timestamps();
+	// load_disk counted the free space of an image before version 3, no checkpoint matched
+	MBR_memory->generation = 0;
+	MBR_memory->stripe_count = 0;
+	MBR_memory->stripe_unit = 0;
+	// the checksums of the rewritten clusters and of the MBR are brought up to date by unload_disk
+	MBR_memory->magic = FS_MAGIC;
+	MBR_memory->version = FS_VERSION;
+	disk_write(MBR_memory, sizeof(mbr_t), 0);
+	disk_close();
+	printf("migrate: %s updated from version %d to %d, %d entries rewritten\n", DISK_NAME, version, FS_VERSION, migrated);
+	unload_disk();
+	return migrated;
+}
+// **************** end migration functions *****************//
+
+// format, fsck and defrag wait for pending reclaims first: a new disk makes them meaningless, fsck
+// would report them as leaked and defrag would move the clusters they name
+// operations that look at the whole disk write back what fs_write buffered before they start, and
+// format drops it
+void format(uint16_t sector_size, uint16_t cluster_size, uint16_t disk_size) {
+	fs_reclaim_wait();
+	io_lock();
+	uint64_t start = op_begin(OP_FORMAT);
+	TRACE_BEGIN("format");
+	do_format(sector_size, cluster_size, disk_size);
+	TRACE_END("format");
+	op_end(OP_FORMAT, start);
+	io_unlock();
+}
+
+entry_t *fs_ls(int dh, int child_num) {
+	io_lock();
+	uint64_t start = op_begin(OP_LS);
+	TRACE_BEGIN("fs_ls");
+	entry_t *child = do_ls(dh, child_num);
+	TRACE_END("fs_ls");
+	op_end(OP_LS, start);
+	io_unlock();
+	return child;
+}
+
+int fs_mkdir(int dh, char* child_name) {
+	io_lock();
+	uint64_t start = op_begin(OP_MKDIR);
+	TRACE_BEGIN("fs_mkdir");
+	int result = do_mkdir(dh, child_name);
+	TRACE_END("fs_mkdir");
+	op_end(OP_MKDIR, start);
+	io_unlock();
+	return result;
+}
+
+int fs_opendir(char *absolute_path) {
+	io_lock();
+	uint64_t start = op_begin(OP_OPENDIR);
+	TRACE_BEGIN("fs_opendir");
+	int dh = do_opendir(absolute_path, NULL);
+	TRACE_END("fs_opendir");
+	op_end(OP_OPENDIR, start);
+	io_unlock();
+	return dh;
+}
+
+int fs_fsck(int repair, int nthreads) {
+	io_lock();
+	uint64_t start = op_begin(OP_FSCK);
+	TRACE_BEGIN("fs_fsck");
+	// buffered writes and pending reclaims go to the disk first, under the lock so none come in between
+	wb_sync(-1);
+	reclaim_drain();
+	int problems = do_fsck(repair, nthreads);
+	TRACE_END("fs_fsck");
+	op_end(OP_FSCK, start);
+	io_unlock();
+	return problems;
+}
+
+int fs_walk(int dh, walk_fn fn, void *arg, int nthreads) {
+	io_lock();
+	uint64_t start = op_begin(OP_WALK);
+	TRACE_BEGIN("fs_walk");
+	wb_sync(-1);
+	int entries = do_walk(dh, fn, arg, nthreads);
+	TRACE_END("fs_walk");
+	op_end(OP_WALK, start);
+	io_unlock();
+	return entries;
+}
+
+// add up the files, directories, bytes and clusters below the directory at dh
+// returns 0, or -1 if dh isn't a directory
+int fs_du(int dh, du_t *du, int nthreads) {
+	memset(du, 0, sizeof(du_t));
+	return fs_walk(dh, du_entry, du, nthreads) == -1 ? -1 : 0;
+}
+
+// store the handles of up to max entries below the directory at dh whose names match the shell
+// pattern, the walk ends once max are found; returns how many were stored, or -1 if dh isn't a directory
+int fs_find(int dh, char *pattern, int *handles, int max, int nthreads) {
+	if (max <= 0) return 0;
+	find_t find = { pattern, handles, max, 0 };
+	if (fs_walk(dh, find_entry, &find, nthreads) == -1) return -1;
+	return find.found < max ? find.found : max;
+}
+
+int fs_space(space_t *space) {
+	io_lock();
+	uint64_t start = op_begin(OP_SPACE);
+	TRACE_BEGIN("fs_space");
+	int result = do_space(space);
+	TRACE_END("fs_space");
+	op_end(OP_SPACE, start);
+	io_unlock();
+	return result;
+}
+
+// update FileSystem.bin to the current on-disk format, see do_migrate
+int fs_migrate() {
+	io_lock();
+	uint64_t start = op_begin(OP_MIGRATE);
+	TRACE_BEGIN("fs_migrate");
+	wb_sync(-1);
+	reclaim_drain();
+	int migrated = do_migrate();
+	TRACE_END("fs_migrate");
+	op_end(OP_MIGRATE, start);
+	io_unlock();
+	return migrated;
+}
+
+int fs_defrag(uint64_t slice_ns) {
+	io_lock();
+	uint64_t start = op_begin(OP_DEFRAG);
+	TRACE_BEGIN("fs_defrag");
+	wb_sync(-1);
+	reclaim_drain();
+	int left = do_defrag(slice_ns);
+	TRACE_END("fs_defrag");
+	op_end(OP_DEFRAG, start);
+	io_unlock();
+	return left;
+}
+
+// remove the directory child_name, and everything below it, from the directory at dh
+int fs_rmdir(int dh, char *child_name) {
+	io_lock();
+	uint64_t start = op_begin(OP_RMDIR);
+	TRACE_BEGIN("fs_rmdir");
+	int result = do_remove(dh, child_name, 1);
+	TRACE_END("fs_rmdir");
+	op_end(OP_RMDIR, start);
+	io_unlock();
+	return result;
+}
+
+// remove the file child_name from the directory at dh
+int fs_unlink(int dh, char *child_name) {
+	io_lock();
+	uint64_t start = op_begin(OP_UNLINK);
+	TRACE_BEGIN("fs_unlink");
+	int result = do_remove(dh, child_name, 0);
+	TRACE_END("fs_unlink");
+	op_end(OP_UNLINK, start);
+	io_unlock();
+	return result;
+}
+
+// move the entry at old_path to new_path, lookups holding fs_lock see it at one or the other
+int fs_rename(char *old_path, char *new_path) {
+	io_lock();
+	uint64_t start = op_begin(OP_RENAME);
+	TRACE_BEGIN("fs_rename");
+	int result = do_rename(old_path, new_path);
+	TRACE_END("fs_rename");
+	op_end(OP_RENAME, start);
+	io_unlock();
+	return result;
+}
+
+// take a read-only snapshot of the whole volume called name
+int fs_snapshot(char *name) {
+	io_lock();
+	uint64_t start = op_begin(OP_SNAPSHOT);
+	TRACE_BEGIN("fs_snapshot");
+	wb_sync(-1);
+	int result = do_snapshot(name);
+	TRACE_END("fs_snapshot");
+	op_end(OP_SNAPSHOT, start);
+	io_unlock();
+	return result;
+}
+
+// delete the snapshot called name
+int fs_snapshot_delete(char *name) {
+	io_lock();
+	uint64_t start = op_begin(OP_SNAPSHOT_DELETE);
+	TRACE_BEGIN("fs_snapshot_delete");
+	int result = do_snapshot_delete(name);
+	TRACE_END("fs_snapshot_delete");
+	op_end(OP_SNAPSHOT_DELETE, start);
+	io_unlock();
+	return result;
+}
+
+// copy snapshot number n into snapshot, -1 after the last one
+int fs_snapshot_ls(int n, snapshot_t *snapshot) {
+	io_lock();
+	uint64_t start = op_begin(OP_LS);
+	TRACE_BEGIN("fs_snapshot_ls");
+	int result = do_snapshot_ls(n, snapshot);
+	TRACE_END("fs_snapshot_ls");
+	op_end(OP_LS, start);
+	io_unlock();
+	return result;
+}
+
+// open a directory of the snapshot called snapshot, the handle works with fs_ls but can't be written through
+int fs_snapshot_opendir(char *snapshot, char *absolute_path) {
+	io_lock();
+	uint64_t start = op_begin(OP_OPENDIR);
+	TRACE_BEGIN("fs_snapshot_opendir");
+	int dh = do_opendir(absolute_path, snapshot);
+	TRACE_END("fs_snapshot_opendir");
+	op_end(OP_OPENDIR, start);
+	io_unlock();
+	return dh;
+}
+
+// create an empty file called name in the directory at dh and return its handle,
+// flags is FILE_COMPRESSED or 0, a file that isn't compressed is sparse
+int fs_create(int dh, char *name, int flags) {
+	io_lock();
+	uint64_t start = op_begin(OP_CREATE);
+	TRACE_BEGIN("fs_create");
+	int fh = do_create(dh, name, flags);
+	TRACE_END("fs_create");
+	op_end(OP_CREATE, start);
+	io_unlock();
+	return fh;
+}
+
+// handle of the file called name in the directory at dh
+int fs_open(int dh, char *name) {
+	io_lock();
+	uint64_t start = op_begin(OP_OPEN);
+	TRACE_BEGIN("fs_open");
+	int fh = do_open(dh, name);
+	TRACE_END("fs_open");
+	op_end(OP_OPEN, start);
+	io_unlock();
+	return fh;
+}
+
+// read up to len bytes at offset of the file at fh, returns the number read
+int fs_read(int fh, void *buf, int len, uint32_t offset) {
+	io_lock();
+	uint64_t start = op_begin(OP_READ);
+	TRACE_BEGIN("fs_read");
+	int result = do_read(fh, buf, len, offset);
+	TRACE_END("fs_read");
+	op_end(OP_READ, start);
+	io_unlock();
+	return result;
+}
+
+// write len bytes at offset of the file at fh, returns len; the data may only reach the disk
+// later, see the write-back functions
+int fs_write(int fh, void *buf, int len, uint32_t offset) {
+	io_lock();
+	uint64_t start = op_begin(OP_WRITE);
+	TRACE_BEGIN("fs_write");
+	int result = wb_write(fh, buf, len, offset);
+	TRACE_END("fs_write");
+	op_end(OP_WRITE, start);
+	io_unlock();
+	return result;
+}
+
+// write back everything fs_write has buffered
+void fs_sync() {
+	io_lock();
+	uint64_t start = op_begin(OP_SYNC);
+	TRACE_BEGIN("fs_sync");
+	wb_sync(-1);
+	TRACE_END("fs_sync");
+	op_end(OP_SYNC, start);
+	io_unlock();
+}
+
+// offset of the first byte of data at or after offset of the file at fh, -1 if there is none
+int64_t fs_seek_data(int fh, uint32_t offset) {
+	io_lock();
+	uint64_t start = op_begin(OP_SEEK);
+	TRACE_BEGIN("fs_seek_data");
+	wb_sync(fh); // buffered pages have no clusters to tell data from holes by
+	int64_t result = do_seek(fh, offset, 0);
+	TRACE_END("fs_seek_data");
+	op_end(OP_SEEK, start);
+	io_unlock();
+	return result;
+}
+
+// offset of the first byte of a hole at or after offset of the file at fh, the size of the file
+// if no hole comes before its end, -1 if offset is past the end
+int64_t fs_seek_hole(int fh, uint32_t offset) {
+	io_lock();
+	uint64_t start = op_begin(OP_SEEK);
+	TRACE_BEGIN("fs_seek_hole");
+	wb_sync(fh); // buffered pages have no clusters to tell data from holes by
+	int64_t result = do_seek(fh, offset, 1);
+	TRACE_END("fs_seek_hole");
+	op_end(OP_SEEK, start);
+	io_unlock();
+	return result;
+}
+
+// send up to len bytes at offset of the file at fh to out_fd without copying them through this
+// process where the kernel allows it, returns the number sent
+int fs_sendfile(int fh, int out_fd, uint32_t offset, int len) {
+	io_lock();
+	uint64_t start = op_begin(OP_SENDFILE);
+	TRACE_BEGIN("fs_sendfile");
+	wb_sync(fh); // the bytes are sent from the disk file
+	int result = do_sendfile(fh, out_fd, offset, len);
+	TRACE_END("fs_sendfile");
+	op_end(OP_SENDFILE, start);
+	io_unlock();
+	return result;
+}
+
+// run one time slice of deduplicating the files of the live tree, returns the files left
+int fs_dedup(uint64_t slice_ns) {
+	io_lock();
+	uint64_t start = op_begin(OP_DEDUP);
+	TRACE_BEGIN("fs_dedup");
+	wb_sync(-1);
+	int left = do_dedup(slice_ns);
+	TRACE_END("fs_dedup");
+	op_end(OP_DEDUP, start);
+	io_unlock();
+	return left;
+}
+
+// ************************** server related functions ******************//
+// --serve runs this process as fsd, a server for the disk on the Unix domain socket FSD_SOCKET,
+// so clients use it without linking the file system in; each request runs as the fs_ operation
+// it names, loading and unloading the disk like any other, and a readdir runs one fs_ls per child
+// a request is an fsd_request_t followed by length bytes (a path, a name, or the data of a write)
+// and gets an fsd_response_t followed by length bytes (the data of a read, or the entry_t of each
+// child of a readdir); a client can send requests without waiting for the responses to earlier
+// ones, and each connection's responses come back in the order its requests were sent
+// worker threads wait on one epoll set; a connection is armed one shot, so one worker at a time
+// reads it until FSD_BATCH requests are in, runs them under one io_lock, and sends back what it
+// can; a connection with responses it hasn't taken yet isn't read again until they are all sent,
+// and one whose client has shut down its side is closed once they are
+#define FSD_SOCKET "fsd.sock"
+#define FSD_BATCH 64 // requests run under one io_lock
+#define FSD_MAX_LENGTH (1024 * 1024) // of the bytes after a request header, and of a read
+#define FSD_NAME_MAX 4096 // of a path or name
+#define FSD_READDIR_MAX 1024 // entries one readdir returns
+
+enum { FSD_OPENDIR, FSD_MKDIR, FSD_READDIR, FSD_CREATE, FSD_OPEN, FSD_READ, FSD_WRITE };
+
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t length; // bytes after the header
+	uint32_t id; // sent back in the response
+	uint8_t op;
+	uint8_t reserved[3];
+	int32_t handle; // directory or file handle
+	uint32_t offset; // read and write: byte offset, readdir: first child
+	uint32_t count; // read: bytes, readdir: most entries, create: FILE_ flags
+} fsd_request_t;
+
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t length; // bytes after the header
+	uint32_t id;
+	int32_t result; // handle, entries or bytes, -1 on failure
+} fsd_response_t;
+
+typedef struct {
+	int fd;
+	uint8_t *in; // received, not yet run
+	size_t in_used;
+	size_t in_size;
+	uint8_t *out; // responses, sent up to out_sent
+	size_t out_used;
+	size_t out_sent;
+	size_t out_size;
+	int eof; // the client shut down its side
+} fsd_conn_t;
+
+int fsd_listen_fd = -1;
+int fsd_epoll = -1;
+int fsd_wake = -1; // readable once the server is stopping
+pthread_t *fsd_threads = NULL;
+int fsd_nthreads = 0;
+
+// room for n more bytes in a buffer
+void fsd_grow(uint8_t **buf, size_t *size, size_t used, size_t n) {
+	if (used + n <= *size) return;
+	while (used + n > *size) *size = *size ? *size * 2 : 4096;
+	*buf = (uint8_t *)realloc(*buf, *size);
+}
+
+// run one request and add its response to the connection's output
+void fsd_execute(fsd_conn_t *conn, fsd_request_t *req, uint8_t *payload) {
+	size_t at = conn->out_used;
+	fsd_grow(&conn->out, &conn->out_size, conn->out_used, sizeof(fsd_response_t));
+	conn->out_used += sizeof(fsd_response_t);
+	int32_t result = -1;
+	char text[FSD_NAME_MAX + 1];
+	int named = req->op != FSD_READDIR && req->op != FSD_READ && req->op != FSD_WRITE;
+	if (named && req->length <= FSD_NAME_MAX) {
+		memcpy(text, payload, req->length);
+		text[req->length] = '\0';
+	}
+	if (named && req->length > FSD_NAME_MAX) {
+		// refused
+	} else if (req->op == FSD_OPENDIR) {
+		result = fs_opendir(text);
+	} else if (req->op == FSD_MKDIR) {
+		result = fs_mkdir(req->handle, text);
+	} else if (req->op == FSD_READDIR) {
+		uint32_t i;
+		for (i = 0; i < req->count && i < FSD_READDIR_MAX; i++) {
+			entry_t *child = fs_ls(req->handle, req->offset + i);
+			if (child == NULL) break;
+			fsd_grow(&conn->out, &conn->out_size, conn->out_used, sizeof(entry_t));
+			memcpy(conn->out + conn->out_used, child, sizeof(entry_t));
+			conn->out_used += sizeof(entry_t);
+			slab_free(&entry_slab, child);
+		}
+		result = i;
+	} else if (req->op == FSD_CREATE) {
+		result = fs_create(req->handle, text, req->count);
+	} else if (req->op == FSD_OPEN) {
+		result = fs_open(req->handle, text);
+	} else if (req->op == FSD_READ) {
+		int len = req->count < FSD_MAX_LENGTH ? req->count : FSD_MAX_LENGTH;
+		fsd_grow(&conn->out, &conn->out_size, conn->out_used, len);
+		result = fs_read(req->handle, conn->out + conn->out_used, len, req->offset);
+		if (result > 0) conn->out_used += result;
+	} else if (req->op == FSD_WRITE) {
+		result = fs_write(req->handle, payload, req->length, req->offset);
+	}
+	fsd_response_t *res = (fsd_response_t *)(conn->out + at);
+	res->length = conn->out_used - at - sizeof(fsd_response_t);
+	res->id = req->id;
+	res->result = result;
+	STAT_ADD(fsd_requests, 1);
+}
+
+void fsd_close(fsd_conn_t *conn) {
+	epoll_ctl(fsd_epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+// send as much of the connection's output as it takes, returns -1 if the connection failed
+int fsd_send(fsd_conn_t *conn) {
+	while (conn->out_sent < conn->out_used) {
+		ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_used - conn->out_sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && errno == EAGAIN) break;
+		if (n <= 0) return -1;
+		conn->out_sent += n;
+	}
+	return 0;
+}
+
+// read what a connection has sent, run its complete requests and send the responses back
+void fsd_serve(fsd_conn_t *conn) {
+	// send what is left from last time first, nothing more is read until it's gone
+	if (fsd_send(conn) == -1) {
+		fsd_close(conn);
+		return;
+	}
+	int closed = 0;
+	if (conn->out_sent == conn->out_used && !conn->eof) {
+		conn->out_sent = conn->out_used = 0;
+		// read until FSD_BATCH requests are in, so a client that keeps sending can't make the input
+		// grow without bound; the rest stays in the socket until epoll reports it again
+		size_t scanned = 0; // the requests before it are complete
+		int complete = 0;
+		while (complete < FSD_BATCH) {
+			if (conn->in_used - scanned >= sizeof(fsd_request_t)) {
+				uint32_t length;
+				memcpy(&length, conn->in + scanned, sizeof(length));
+				if (length > FSD_MAX_LENGTH) break; // refused below
+				if (conn->in_used - scanned >= sizeof(fsd_request_t) + length) {
+					scanned += sizeof(fsd_request_t) + length;
+					complete++;
+					continue;
+				}
+			}
+			fsd_grow(&conn->in, &conn->in_size, conn->in_used, 65536);
+			ssize_t n = recv(conn->fd, conn->in + conn->in_used, conn->in_size - conn->in_used, 0);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && errno == EAGAIN) break;
+			if (n == 0) conn->eof = 1;
+			if (n <= 0) {
+				closed = n < 0;
+				break;
+			}
+			conn->in_used += n;
+		}
+		size_t at = 0;
+		while (1) {
+			int batch = 0;
+			while (batch < FSD_BATCH && conn->in_used - at >= sizeof(fsd_request_t)) {
+				fsd_request_t req;
+				memcpy(&req, conn->in + at, sizeof(req));
+				if (req.length > FSD_MAX_LENGTH) {
+					printf("fsd: a request of %u bytes, closing the connection\n", req.length);
+					if (batch > 0) io_unlock();
+					fsd_close(conn);
+					return;
+				}
+				if (conn->in_used - at < sizeof(req) + req.length) break;
+				if (batch++ == 0) io_lock();
+				fsd_execute(conn, &req, conn->in + at + sizeof(req));
+				at += sizeof(req) + req.length;
+			}
+			if (batch == 0) break;
+			io_unlock();
+			STAT_ADD(fsd_batches, 1);
+		}
+		memmove(conn->in, conn->in + at, conn->in_used - at);
+		conn->in_used -= at;
+		if (fsd_send(conn) == -1) closed = 1;
+	}
+	// a client that shut down its side still gets every response it asked for
+	if (closed || (conn->eof && conn->out_sent == conn->out_used)) {
+		fsd_close(conn);
+		return;
 	}
-	*headRef = NULL;
+	struct epoll_event event;
+	event.events = (conn->out_sent < conn->out_used ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	event.data.ptr = conn;
+	epoll_ctl(fsd_epoll, EPOLL_CTL_MOD, conn->fd, &event);
 }
 
-void print(node_t **headRef) {
-	printf("printing list\n");
-	node_t *current = *headRef;
-	if (current == NULL) {
-		printf("List is empty\n");
-	} else {
-		while (current->next != NULL) {
-			printf("%s\n", current->dir);
-			current = current->next;
-		}
+// take every connection waiting on the socket
+void fsd_accept() {
+	while (1) {
+		int fd = accept4(fsd_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1) break;
+		fsd_conn_t *conn = (fsd_conn_t *)calloc(1, sizeof(fsd_conn_t));
+		conn->fd = fd;
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLONESHOT;
+		event.data.ptr = conn;
+		epoll_ctl(fsd_epoll, EPOLL_CTL_ADD, fd, &event);
+		STAT_ADD(fsd_connections, 1);
 	}
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &fsd_listen_fd;
+	epoll_ctl(fsd_epoll, EPOLL_CTL_MOD, fsd_listen_fd, &event);
 }
-// **************** end linked list functions *****************//
 
-// format the date for creation_date and creation_time fields of entry_t struct
-// pack the date into an unsigned 32 bit integer that is later split into two 16 bit integers
-uint32_t date_format() {
-	time_t t = time(NULL);
-	struct tm *tptr = localtime(&t);
-	uint32_t time_stamp;
-	time_stamp = ((tptr->tm_year-80)<<25) + ((tptr->tm_mon+1)<<21) + ((tptr->tm_mday)<<16) + (tptr->tm_hour<<11) + (tptr->tm_min<<5) + ((tptr->tm_sec)%60)/2;
-	return time_stamp;
+void *fsd_worker(void *arg) {
+	while (1) {
+		struct epoll_event event;
+		int n = epoll_wait(fsd_epoll, &event, 1, -1);
+		if (n <= 0) continue;
+		if (event.data.ptr == &fsd_wake) break;
+		if (event.data.ptr == &fsd_listen_fd) fsd_accept();
+		else fsd_serve((fsd_conn_t *)event.data.ptr);
+	}
+	return NULL;
 }
 
-// create a entry_t struct to initialize a directory
-entry_t *create_directory_entry(char *dir_name) {
-	entry_t *dir = (entry_t *)malloc(sizeof(entry_t));
-	uint32_t time_stamp = date_format();
-	dir->entry_type = 1;
-	dir->creation_date = htons((time_stamp>>16) & 0xFFFF);
-	dir->creation_time = htons(time_stamp & 0xFFFF);
-	dir->name_len = strlen(dir_name);
-	memset(dir->name, 0, 16);
-	strcpy(dir->name, dir_name);		  
-	dir->size = 0; // a directory is always size 0	
-	dir->children_count = 0;
-	return dir;
+// listen on path and serve it with nthreads workers, returns -1 if the socket can't be set up
+int fsd_start(char *path, int nthreads) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	fsd_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fsd_listen_fd == -1 || bind(fsd_listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fsd_listen_fd, SOMAXCONN) != 0) {
+		printf("fsd: unable to listen on %s\n", path);
+		if (fsd_listen_fd != -1) close(fsd_listen_fd);
+		return -1;
+	}
+	fsd_epoll = epoll_create1(EPOLL_CLOEXEC);
+	fsd_wake = eventfd(0, EFD_CLOEXEC);
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = &fsd_listen_fd;
+	epoll_ctl(fsd_epoll, EPOLL_CTL_ADD, fsd_listen_fd, &event);
+	event.events = EPOLLIN; // level triggered, so it wakes every worker
+	event.data.ptr = &fsd_wake;
+	epoll_ctl(fsd_epoll, EPOLL_CTL_ADD, fsd_wake, &event);
+	fsd_nthreads = nthreads < 1 ? 1 : nthreads;
+	fsd_threads = (pthread_t *)malloc(sizeof(pthread_t) * fsd_nthreads);
+	int i;
+	for (i = 0; i < fsd_nthreads; i++) pthread_create(&fsd_threads[i], NULL, fsd_worker, NULL);
+	return 0;
 }
 
-// create an entry_ptr_t struct
-entry_ptr_t *create_ptr(int type, int child_cluster) {
-	entry_ptr_t *ptr = (entry_ptr_t *)malloc(sizeof(entry_ptr_t));
-	ptr->type = type;
-	ptr->reserved = 0;
-	ptr->start = child_cluster;
-	return ptr;
+// stop the workers and close the socket, connections still open are dropped with their memory
+void fsd_stop(char *path) {
+	uint64_t one = 1;
+	if (write(fsd_wake, &one, sizeof(one)) != sizeof(one)) printf("fsd: unable to wake the workers\n");
+	int i;
+	for (i = 0; i < fsd_nthreads; i++) pthread_join(fsd_threads[i], NULL);
+	free(fsd_threads);
+	fsd_threads = NULL;
+	close(fsd_listen_fd);
+	close(fsd_epoll);
+	close(fsd_wake);
+	unlink(path);
 }
 
-// format the file system:
-// determine FAT area length and Data area length
-// write the Master Boot Record to file, initialize the FAT area, and create the root dir
-void format(uint16_t sector_size, uint16_t cluster_size, uint16_t disk_size) {
-	mbr_t *MBR = (mbr_t *)malloc(sizeof(mbr_t));
-	MBR->sector_size = sector_size;
-	MBR->cluster_size = cluster_size;
-	MBR->disk_size = disk_size;
-	MBR->fat_start = 1;
-	memset(MBR->disk_name, 0, 32);
-	strcpy(MBR->disk_name, "A");
+// client side: connect to the server at path, -1 if it isn't there
+int fsd_connect(char *path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
 
-	// determine the size (in clusters) of the FAT and Data areas
-	int i;
-	int cluster_size_bytes = sector_size * cluster_size; // number of bytes per cluster
-	int max_data_length;
-	for (max_data_length = disk_size - 2, i = 1; max_data_length >= 0; max_data_length--, i++) {
-		if (max_data_length * 2 <= cluster_size_bytes * i) {
-			MBR->fat_length = disk_size - max_data_length - 1;
-			MBR->data_start = MBR->fat_start + MBR->fat_length;
-			MBR->data_length = max_data_length;
-			break;
-		}
+// client side: add a request to buf, returns its new length
+size_t fsd_pack(uint8_t *buf, size_t used, int op, uint32_t id, int handle, uint32_t offset, uint32_t count,
+	const void *payload, uint32_t length) {
+	fsd_request_t req;
+	memset(&req, 0, sizeof(req));
+	req.length = length;
+	req.id = id;
+	req.op = op;
+	req.handle = handle;
+	req.offset = offset;
+	req.count = count;
+	memcpy(buf + used, &req, sizeof(req));
+	if (length > 0) memcpy(buf + used + sizeof(req), payload, length);
+	return used + sizeof(req) + length;
+}
+
+// client side: read n bytes, 0 if the connection ended first
+int fsd_recv_all(int fd, void *buf, size_t n) {
+	size_t got = 0;
+	while (got < n) {
+		ssize_t m = recv(fd, (uint8_t *)buf + got, n - got, 0);
+		if (m < 0 && errno == EINTR) continue;
+		if (m <= 0) return 0;
+		got += m;
 	}
+	return 1;
+}
 
-	// initialization operations
-	// - initialize the file system by writing zeros to every byte
-	// size of resulting file should be equal to sector_size * cluster_size * disk_size
-	int disk_size_bytes = sector_size * cluster_size * disk_size;
-	FILE *fs;
-	fs = fopen(DISK_NAME, "wb");
-	uint8_t init_fs[disk_size_bytes]; 
-	for (i=0; i < disk_size_bytes; i++) {
-		init_fs[i] = 0xFF;
+// client side: send buf and read the response to each of count requests, returns the result of
+// the last, and the time each response took since buf was sent in latencies unless it's NULL
+int fsd_roundtrip(int fd, uint8_t *buf, size_t used, int count, uint8_t *reply, uint64_t *latencies) {
+	uint64_t start = now_ns();
+	size_t sent = 0;
+	while (sent < used) {
+		ssize_t n = send(fd, buf + sent, used - sent, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		sent += n;
 	}
-	fwrite(init_fs, sizeof(uint8_t), disk_size_bytes, fs);	
-	fclose(fs);
+	int result = -1, i;
+	for (i = 0; i < count; i++) {
+		fsd_response_t res;
+		if (!fsd_recv_all(fd, &res, sizeof(res)) || res.length > FSD_MAX_LENGTH) return -1;
+		if (res.length > 0 && !fsd_recv_all(fd, reply, res.length)) return -1;
+		if (latencies != NULL) latencies[i] = now_ns() - start;
+		result = res.result;
+	}
+	return result;
+}
+// **************** end server functions *****************//
 
-	fs = fopen(DISK_NAME, "rb+");
+// ************************** benchmark related functions ***************//
+// --bench runs each scenario through the public operations and prints one CSV row per
+// scenario and parameter: ops/sec plus p50 and p99 latency of the timed operation
+#define BENCH_REPEAT 200 // timed operations per lookup scenario
 
-	// write the MBR
-	fwrite(MBR, sizeof(mbr_t), 1, fs);
-	
-	// create the root directory
-	// root directory information is held starting in cluster 2
-	// update the FAT entry from 0xFFFF to 0xFFFe
-	fseek(fs, sector_size*cluster_size, SEEK_SET);
-	uint16_t allocate = 0xFFFE;
-	fwrite(&allocate, sizeof(uint16_t), 1, fs);
+uint64_t *bench_samples = NULL;
+int bench_count = 0;
+uint64_t bench_wall_ns = 0; // when set, ops/sec comes from it rather than from the samples, which overlapped
 
-	fseek(fs, sector_size*cluster_size*2, SEEK_SET);
-	entry_t *root = create_directory_entry("root");
-	fwrite(root, sizeof(entry_t), 1, fs);	
+int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
 
-	// finished initilizing the file system, close the file
-	fclose(fs);	
+void bench_reset(int max_samples) {
+	free(bench_samples);
+	bench_samples = (uint64_t *)malloc(sizeof(uint64_t) * max_samples);
+	bench_count = 0;
+	bench_wall_ns = 0;
+}
 
+// print the CSV row for the samples collected since bench_reset
+void bench_report(const char *scenario, const char *param) {
+	uint64_t total = 0;
+	int i;
+	if (bench_count == 0) {
+		printf("%s,%s,%s,0,0.0,0,0\n", scenario, param, DIRECT_IO ? "direct" : "buffered");
+		return;
+	}
+	for (i = 0; i < bench_count; i++) total += bench_samples[i];
+	if (bench_wall_ns != 0) total = bench_wall_ns;
+	qsort(bench_samples, bench_count, sizeof(uint64_t), compare_u64);
+	printf("%s,%s,%s,%d,%.1f,%llu,%llu\n", scenario, param, DIRECT_IO ? "direct" : "buffered", bench_count,
+		total ? bench_count / (total / 1e9) : 0.0,
+		(unsigned long long)bench_samples[bench_count / 2],
+		(unsigned long long)bench_samples[bench_count * 99 / 100]);
 }
 
-// load the disk into memory
-void load_disk(char *disk_name) {
-	// allocate memory for an mbr_t structure
-	MBR_memory = (mbr_t *)malloc(sizeof(mbr_t));
-	FILE *fs;
-	fs = fopen(disk_name, "r+b");
-	fseek(fs, 0, SEEK_SET);
-	fread(MBR_memory, sizeof(mbr_t), 1, fs);
-
-	uint16_t cluster_size_bytes = MBR_memory->sector_size * MBR_memory->cluster_size;
-	// allocate memory for the FAT in memory
-	FAT_memory = (uint16_t *)malloc(sizeof(uint16_t)*MBR_memory->data_length);
-	fseek(fs, cluster_size_bytes, SEEK_SET);
-	fread(FAT_memory, sizeof(uint16_t), MBR_memory->data_length, fs);
-	
-	// allocate memory for the Data area
-	DATA_memory = malloc(sizeof(uint8_t) * MBR_memory->data_length * cluster_size_bytes);
-	fseek(fs, cluster_size_bytes*MBR_memory->data_start , SEEK_SET);
-	fread(DATA_memory, sizeof(uint8_t), cluster_size_bytes*MBR_memory->data_length, fs);
+int bench_stop = 0; // set to stop bench_defrag_worker
+int bench_defrag_passes = 0;
 
-	fclose(fs);
+// scatter the files of the directories a0 to a7 of root: each of them has its files removed, and
+// they are created again a file of each directory in turn, written 4 KB at a time
+void bench_scatter() {
+	char path[32], name[16];
+	int a, i, fh[8];
+	for (i = 0; i < 8; i++) {
+		for (a = 0; a < 8; a++) {
+			sprintf(path, "root/a%d", a);
+			sprintf(name, "f%d", i);
+			fs_unlink(fs_opendir(path), name);
+		}
+	}
+	uint8_t chunk[4096];
+	memset(chunk, 'x', sizeof(chunk));
+	for (i = 0; i < 8; i++) {
+		for (a = 0; a < 8; a++) {
+			sprintf(path, "root/a%d", a);
+			sprintf(name, "f%d", i);
+			fh[a] = fs_create(fs_opendir(path), name, 0);
+		}
+		uint32_t at;
+		for (at = 0; at < 4 * sizeof(chunk); at += sizeof(chunk)) {
+			for (a = 0; a < 8; a++) fs_write(fh[a], chunk, sizeof(chunk), at);
+		}
+		fs_sync();
+	}
 }
 
-// fill entry struct from disk
-entry_t *fill_entry (int dh) {
-	entry_t *e = malloc(sizeof(entry_t));
-	int cluster_size_bytes = MBR_memory->sector_size * MBR_memory->cluster_size;
-	int lookup = (1 + MBR_memory->fat_length + dh) * cluster_size_bytes;
-	FILE *fs;
-	fs = fopen(DISK_NAME, "rb+");
-	fseek(fs, lookup, SEEK_SET);
-	fread(e, sizeof(entry_t), 1, fs);
-	fclose(fs);
-	return e; 	
+// background work for the lookup scenario: defragment in 200 us slices, scattering the files
+// again each time the disk is laid out, until bench_stop is set
+void *bench_defrag_worker(void *arg) {
+	fs_io_class(IO_BACKGROUND);
+	while (!__atomic_load_n(&bench_stop, __ATOMIC_ACQUIRE)) {
+		if (fs_defrag(200000) == 0) {
+			bench_scatter();
+			bench_defrag_passes++;
+		}
+	}
+	return NULL;
 }
 
-// return a child, if any of a directory
-entry_t *fs_ls(int dh, int child_num) {
-	int cluster_size_bytes = MBR_memory->sector_size * MBR_memory->cluster_size;
-	int lookup = htons(dh) * cluster_size_bytes + sizeof(entry_t) + child_num * sizeof(entry_ptr_t); 
-	entry_ptr_t *ptr = malloc(sizeof(entry_ptr_t));
-	ptr->type = DATA_memory[lookup];
-	ptr->reserved = DATA_memory[lookup + 1];
-	ptr->start = (DATA_memory[lookup + 3] << 8) + DATA_memory[lookup + 2];
-	if (ptr->type != 0 && ptr->type != 1 && ptr->type != 2)
-		return NULL;
-	if (ptr->type == 1) {
-		entry_t *child = fill_entry((int)ptr->start);
-		return child;
-	} else if (ptr->type == 2) {
+// a client of the load generator: it makes its own directory with a file in it, then sends
+// requests depth at a time, in turn an opendir of its directory, a readdir of it, a 4 KB write
+// of the file and a read of it back, and times each from when its batch went out
+#define FSD_DEPTH 8 // requests a client has in flight by default
+
+typedef struct {
+	int id;
+	int depth;
+	int requests;
+	uint64_t *latencies; // one per request
+	int failed;
+} fsd_client_t;
+
+void *fsd_client(void *arg) {
+	fsd_client_t *client = (fsd_client_t *)arg;
+	int fd = fsd_connect(FSD_SOCKET);
+	if (fd == -1) {
+		client->failed = 1;
 		return NULL;
-	}		
+	}
+	uint8_t *buf = (uint8_t *)malloc(client->depth * (sizeof(fsd_request_t) + 4096));
+	uint8_t *reply = (uint8_t *)malloc(FSD_MAX_LENGTH);
+	uint8_t data[4096];
+	memset(data, client->id, sizeof(data));
+	char name[16], path[32];
+	sprintf(name, "c%d", client->id);
+	sprintf(path, "root/c%d", client->id);
+	size_t used = fsd_pack(buf, 0, FSD_MKDIR, 0, 0, 0, 0, name, strlen(name));
+	used = fsd_pack(buf, used, FSD_OPENDIR, 1, 0, 0, 0, path, strlen(path));
+	int dh = fsd_roundtrip(fd, buf, used, 2, reply, NULL);
+	used = fsd_pack(buf, 0, FSD_CREATE, 0, dh, 0, 0, "f", 1);
+	int fh = fsd_roundtrip(fd, buf, used, 1, reply, NULL);
+	if (fh == -1 && dh != -1) {
+		// left by an earlier run against the same server
+		used = fsd_pack(buf, 0, FSD_OPEN, 0, dh, 0, 0, "f", 1);
+		fh = fsd_roundtrip(fd, buf, used, 1, reply, NULL);
+	}
+	if (dh == -1 || fh == -1) client->failed = 1;
+	int i, j;
+	for (i = 0; i < client->requests && !client->failed; i += client->depth) {
+		used = 0;
+		for (j = 0; j < client->depth; j++) {
+			int op = (i + j) % 4;
+			if (op == 0) used = fsd_pack(buf, used, FSD_OPENDIR, j, 0, 0, 0, path, strlen(path));
+			else if (op == 1) used = fsd_pack(buf, used, FSD_READDIR, j, dh, 0, 16, NULL, 0);
+			else if (op == 2) used = fsd_pack(buf, used, FSD_WRITE, j, fh, 0, 0, data, sizeof(data));
+			else used = fsd_pack(buf, used, FSD_READ, j, fh, 0, sizeof(data), NULL, 0);
+		}
+		if (fsd_roundtrip(fd, buf, used, client->depth, reply, client->latencies + i) == -1) client->failed = 1;
+	}
+	close(fd);
+	free(buf);
+	free(reply);
 	return NULL;
 }
 
-// find the next free cluster available, returns -1 if disk is full
-int find_free_cluster() {
-	int child_cluster;
-	for (child_cluster=0; child_cluster < MBR_memory->data_length; child_cluster++) {
-		if (FAT_memory[child_cluster] == 0xFFFF) {
-			FAT_memory[child_cluster] = 0xFFFE;
-			return child_cluster;
+// run clients clients of requests requests each against the server on FSD_SOCKET, collecting
+// their latencies and the time they all took, returns the clients that failed
+int fsd_load(int clients, int requests, int depth) {
+	requests = (requests + depth - 1) / depth * depth;
+	fsd_client_t *client = (fsd_client_t *)calloc(clients, sizeof(fsd_client_t));
+	pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * clients);
+	int i, failed = 0;
+	uint64_t start = now_ns();
+	for (i = 0; i < clients; i++) {
+		client[i].id = i;
+		client[i].depth = depth;
+		client[i].requests = requests;
+		client[i].latencies = (uint64_t *)calloc(requests, sizeof(uint64_t));
+		pthread_create(&threads[i], NULL, fsd_client, &client[i]);
+	}
+	for (i = 0; i < clients; i++) pthread_join(threads[i], NULL);
+	bench_reset(clients * requests);
+	bench_wall_ns = now_ns() - start;
+	for (i = 0; i < clients; i++) {
+		failed += client[i].failed;
+		if (!client[i].failed) {
+			memcpy(bench_samples + bench_count, client[i].latencies, sizeof(uint64_t) * requests);
+			bench_count += requests;
 		}
+		free(client[i].latencies);
 	}
-	return -1;	
+	free(client);
+	free(threads);
+	return failed;
 }
 
-// make a new directory where the parent is located at the data cluster indicated by dh
-void fs_mkdir(int dh, char* child_name) {
-	if (strlen(child_name) > 16) {
-		printf("Directory \"%s\" not made: name of directory must not exceed 16 bytes\n", child_name);
-		return;
+// time repeated opendir calls of the same path, fs_opendir tokenizes its argument so it is copied each time
+void bench_opendir(char *path) {
+	char buf[strlen(path) + 1];
+	int i;
+	for (i = 0; i < BENCH_REPEAT; i++) {
+		strcpy(buf, path);
+		uint64_t start = now_ns();
+		int dh = fs_opendir(buf);
+		bench_samples[bench_count++] = now_ns() - start;
+		if (dh == -1) printf("bench_opendir: %s not found\n", path);
 	}
+}
 
-	load_disk(DISK_NAME);
-	
-	// create file pointer and open disk
-	FILE *fs;
-	fs = fopen(DISK_NAME, "rb+");
-	int cluster_size_bytes = MBR_memory->sector_size * MBR_memory->cluster_size;
+void bench() {
+	char param[64];
+	int i, n;
+	printf("scenario,param,mode,ops,ops_per_sec,p50_ns,p99_ns\n");
 
-	// update children count of parent directory
-	int parent_location = (1 + MBR_memory->fat_length + dh) * cluster_size_bytes;
-	entry_t *parent = fill_entry(dh);
-	parent->children_count++;
-	// save the children count for later use, this is the count with the new child directory
-	uint16_t children_count = parent->children_count;
+	// format: disks of increasing size, 512 byte clusters
+	uint16_t format_sizes[] = { 64, 1024, 16384, 65535 };
+	for (n = 0; n < 4; n++) {
+		bench_reset(10);
+		for (i = 0; i < 10; i++) {
+			uint64_t start = now_ns();
+			format(512, 1, format_sizes[n]);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		sprintf(param, "clusters=%d", format_sizes[n]);
+		bench_report("format", param);
+	}
 
-	// create the child directory and write to disk
-	// find the next available spot to write to disk
-	int child_cluster = find_free_cluster();
-	//printf("child_cluster = %d\n", child_cluster);
-	if (child_cluster == -1) {
-		printf("fs_mkdir: directory not made\nno free space left on disk for new directory\n");
-		return;
+	// mkdir storm: n children created in root, 4096 byte clusters so root holds them all
+	int storm_sizes[] = { 100, 500, 1000 };
+	for (n = 0; n < 3; n++) {
+		format(512, 8, storm_sizes[n] + 16);
+		bench_reset(storm_sizes[n]);
+		for (i = 0; i < storm_sizes[n]; i++) {
+			char name[16];
+			sprintf(name, "c%d", i);
+			uint64_t start = now_ns();
+			fs_mkdir(0, name);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		sprintf(param, "children=%d", storm_sizes[n]);
+		bench_report("mkdir_storm", param);
 	}
-	entry_t *child = create_directory_entry(child_name);
-	int child_location = (1 + MBR_memory->fat_length + child_cluster) * cluster_size_bytes;
-	fseek(fs, child_location, SEEK_SET);
-	fwrite(child, sizeof(entry_t), 1, fs);
 
-	// pointer to the new directory, 1 indicates pointer to a directory
-	entry_ptr_t *ptr_to_child = create_ptr(1, child_cluster);
+	// wide directory lookup: opendir of the last of n children of root
+	int wide_sizes[] = { 10, 100, 1000 };
+	for (n = 0; n < 3; n++) {
+		format(512, 8, wide_sizes[n] + 16);
+		char name[16];
+		for (i = 0; i < wide_sizes[n]; i++) {
+			sprintf(name, "c%d", i);
+			fs_mkdir(0, name);
+		}
+		char path[32];
+		sprintf(path, "root/%s", name);
+		bench_reset(BENCH_REPEAT);
+		bench_opendir(path);
+		sprintf(param, "children=%d", wide_sizes[n]);
+		bench_report("wide_lookup", param);
+		// readdir: fs_ls of each child in turn
+		bench_reset(BENCH_REPEAT);
+		for (i = 0; i < BENCH_REPEAT; i++) {
+			uint64_t start = now_ns();
+			entry_t *child = fs_ls(0, i % wide_sizes[n]);
+			bench_samples[bench_count++] = now_ns() - start;
+			if (child == NULL) printf("bench: fs_ls found no child %d\n", i % wide_sizes[n]);
+			else slab_free(&entry_slab, child);
+		}
+		bench_report("readdir", param);
+	}
 
-	// iterate through pointers of parent directory to find next open slot
-	int max_children_initial_cluster = (cluster_size_bytes - sizeof(entry_t)) / sizeof(entry_ptr_t);
-	int max_children_overflow_cluster = cluster_size_bytes / sizeof(entry_ptr_t);
-	//printf("initial overflow %d %d\n", max_children_initial_cluster, max_children_overflow_cluster);
+	// deep path opendir: opendir of the bottom of a chain of n nested directories
+	int deep_sizes[] = { 1, 8, 32, 128 };
+	for (n = 0; n < 4; n++) {
+		format(512, 1, deep_sizes[n] + 16);
+		char *path = (char *)malloc(8 + 8 * deep_sizes[n]);
+		strcpy(path, "root");
+		int dh = 0;
+		for (i = 0; i < deep_sizes[n]; i++) {
+			char name[16];
+			sprintf(name, "d%d", i);
+			fs_mkdir(dh, name);
+			strcat(path, "/");
+			strcat(path, name);
+			char buf[strlen(path) + 1];
+			strcpy(buf, path);
+			dh = fs_opendir(buf);
+		}
+		bench_reset(BENCH_REPEAT);
+		bench_opendir(path);
+		free(path);
+		sprintf(param, "depth=%d", deep_sizes[n]);
+		bench_report("deep_opendir", param);
+	}
 
-	if (children_count < max_children_initial_cluster) {
+	// crc32c: one 1 MB buffer per operation, so ops/sec is MB/s, with each implementation
+	int crc_bytes = 1024 * 1024;
+	uint8_t *crc_buf = (uint8_t *)malloc(crc_bytes);
+	for (i = 0; i < crc_bytes; i++) crc_buf[i] = i * 2654435761u >> 24;
+	pthread_once(&crc32c_once, crc32c_init);
+	uint32_t (*crc_impls[2])(uint32_t, const uint8_t *, size_t) = { crc32c_slicing8, crc32c_update };
+	const char *crc_names[2] = { "impl=slicing8", crc32c_update == crc32c_slicing8 ? "impl=slicing8" : "impl=hardware" };
+	for (n = 0; n < 2; n++) {
+		bench_reset(BENCH_REPEAT);
+		volatile uint32_t sink = 0;
+		for (i = 0; i < BENCH_REPEAT; i++) {
+			uint64_t start = now_ns();
+			sink ^= crc_impls[n](0xFFFFFFFF, crc_buf, crc_bytes);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		bench_report("crc32c", crc_names[n]);
+	}
+	free(crc_buf);
 
-		int ptr_offset = (1+MBR_memory->fat_length+dh) * cluster_size_bytes + (int)sizeof(entry_t) + (children_count-1)*sizeof(entry_ptr_t);
-		fseek(fs, ptr_offset, SEEK_SET);
-		fwrite(ptr_to_child, sizeof(entry_ptr_t), 1, fs);
+	// load_disk: opendir of root on a 32 MB and a 256 MB disk; the FAT and data area come in as
+	// they are touched, checksums still read and check the whole disk
+	int checksums = CHECKSUMS;
+	uint16_t load_sizes[] = { 8192, 65535 };
+	for (n = 0; n < 4; n++) {
+		CHECKSUMS = n % 2;
+		format(512, 8, load_sizes[n / 2]);
+		bench_reset(20);
+		for (i = 0; i < 20; i++) {
+			char path[] = "root";
+			uint64_t start = now_ns();
+			fs_opendir(path);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		sprintf(param, "mb=%d checksums=%d", load_sizes[n / 2] * 4096 >> 20, n % 2);
+		bench_report("load_disk", param);
+	}
+	CHECKSUMS = checksums;
 
-	} else if (children_count == max_children_initial_cluster) {
-		// find free area in FAT
-		int ptr_overflow_cluster = find_free_cluster();
-		//printf("ptr overflow cluster %d\n", ptr_overflow_cluster);
-		// create a link cluster to write in last available area
-		entry_ptr_t *link_ptr = create_ptr(2, ptr_overflow_cluster);
-		int	link_ptr_offset = (1 + MBR_memory->fat_length + dh) * cluster_size_bytes + (children_count-1)*sizeof(entry_ptr_t);
-		
-		fseek(fs, link_ptr_offset, SEEK_SET);
-		fwrite(link_ptr, sizeof(entry_ptr_t), 1, fs);
-		
-		int ptr_offset = (1 + MBR_memory->fat_length + ptr_overflow_cluster) * cluster_size_bytes;
-		fseek(fs, ptr_offset, SEEK_SET);
-		fwrite(ptr_to_child, sizeof(entry_ptr_t), 1, fs);
-		parent->children_count++;
-		free(link_ptr);
+	// file_write, file_read: a 4 MB log file written and read back 64 KB at a time, with and
+	// without compression; the ratio is what the compressed chunks took on disk
+	int file_bytes = 4 * 1024 * 1024, io_bytes = 64 * 1024;
+	char *log = (char *)malloc(file_bytes + 128);
+	char *back = (char *)malloc(io_bytes);
+	int at = 0;
+	for (i = 0; at < file_bytes; i++) {
+		at += sprintf(log + at, "2026-10-19T12:%02d:%02d.%03d INFO request id=%d path=/api/v1/items/%d status=%d latency_ms=%d\n",
+			i / 60000 % 60, i / 1000 % 60, i % 1000, i, i * 7 % 5000, i % 50 ? 200 : 404, i * 13 % 250);
+	}
+	for (n = 0; n < 2; n++) {
+		format(512, 8, 8192);
+		int fh = fs_create(0, "log", n ? FILE_COMPRESSED : 0);
+		fs_stats_t before = fs_stats();
+		bench_reset(file_bytes / io_bytes);
+		for (at = 0; at < file_bytes; at += io_bytes) {
+			uint64_t start = now_ns();
+			fs_write(fh, log + at, io_bytes, at);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		fs_stats_t after = fs_stats();
+		uint64_t stored = after.compress_out - before.compress_out;
+		sprintf(param, "compressed=%d ratio=%.2f", n, stored ? (double)(after.compress_in - before.compress_in) / stored : 1.0);
+		bench_report("file_write", param);
+		bench_reset(file_bytes / io_bytes);
+		for (at = 0; at < file_bytes; at += io_bytes) {
+			uint64_t start = now_ns();
+			fs_read(fh, back, io_bytes, at);
+			bench_samples[bench_count++] = now_ns() - start;
+			if (memcmp(back, log + at, io_bytes) != 0) printf("bench: file_read returned the wrong bytes at %d\n", at);
+		}
+		bench_report("file_read", param);
 	}
 
-	// write the updated parent to disk
-	fseek(fs, parent_location, SEEK_SET);
-	fwrite(parent, sizeof(entry_t), 1, fs);
-	
-	// write the updated FAT area to disk
-	fseek(fs, cluster_size_bytes, SEEK_SET);
-	fwrite(FAT_memory, sizeof(uint16_t), MBR_memory->data_length, fs);
+	// stripe_seq: a 32 MB file written 1 MB at a time and synced, then read back 1 MB at a time, with
+	// the data area in the disk file and striped across 1 to 8 files; ops/sec is MB/s, and the host's
+	// page cache is emptied of the files between the two so that the reads reach the device
+	int stripe_counts[] = { 0, 1, 2, 4, 8 };
+	int stripes = STRIPES;
+	int seq_bytes = 32 * 1024 * 1024, seq_io = 1024 * 1024;
+	char *seq = (char *)malloc(seq_io);
+	char *seq_back = (char *)malloc(seq_io);
+	for (n = 0; n < 5; n++) {
+		STRIPES = stripe_counts[n];
+		format(4096, 1, 16384);
+		int fh = fs_create(0, "seq", 0);
+		bench_reset(seq_bytes / seq_io);
+		uint64_t start = now_ns();
+		for (at = 0; at < seq_bytes; at += seq_io) {
+			memset(seq, at / seq_io, seq_io);
+			uint64_t op = now_ns();
+			fs_write(fh, seq, seq_io, at);
+			bench_samples[bench_count++] = now_ns() - op;
+		}
+		fs_sync();
+		bench_wall_ns = now_ns() - start;
+		sprintf(param, "stripes=%d unit_kb=%d", STRIPES, STRIPES ? STRIPE_UNIT * 4 : 0);
+		bench_report("stripe_seq_write", param);
+		char name[sizeof(DISK_NAME) + 16];
+		for (i = -1; i < STRIPES; i++) {
+			if (i == -1) strcpy(name, DISK_NAME);
+			else stripe_name(name, i);
+			int fd = open(name, O_RDONLY);
+			if (fd == -1) continue;
+			if (fdatasync(fd) != 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0) printf("bench: %s stays in the page cache\n", name);
+			close(fd);
+		}
+		bench_reset(seq_bytes / seq_io);
+		start = now_ns();
+		for (at = 0; at < seq_bytes; at += seq_io) {
+			uint64_t op = now_ns();
+			fs_read(fh, seq_back, seq_io, at);
+			bench_samples[bench_count++] = now_ns() - op;
+			memset(seq, at / seq_io, seq_io);
+			if (memcmp(seq_back, seq, seq_io) != 0) printf("bench: stripe_seq read the wrong bytes at %d\n", at);
+		}
+		bench_wall_ns = now_ns() - start;
+		bench_report("stripe_seq_read", param);
+	}
+	STRIPES = stripes;
+	free(seq);
+	free(seq_back);
 
-	fclose(fs);	
+	// dedup: 16 files of 512 KB written 64 KB at a time, 4 different ones each written 4 times,
+	// with and without deduplication on write; saved is what the copies gave back
+	int dedup = DEDUP;
+	int copy_bytes = 512 * 1024;
+	for (n = 0; n < 2; n++) {
+		DEDUP = n;
+		format(512, 8, 8192);
+		fs_stats_t before = fs_stats();
+		bench_reset(16 * copy_bytes / io_bytes);
+		for (i = 0; i < 16; i++) {
+			char name[16];
+			sprintf(name, "copy%d", i);
+			int fh = fs_create(0, name, 0);
+			for (at = 0; at < copy_bytes; at += io_bytes) {
+				uint64_t start = now_ns();
+				fs_write(fh, log + i % 4 * copy_bytes + at, io_bytes, at);
+				bench_samples[bench_count++] = now_ns() - start;
+			}
+		}
+		fs_stats_t after = fs_stats();
+		sprintf(param, "dedup=%d saved_kb=%llu", n, (unsigned long long)(after.clusters_deduped - before.clusters_deduped) * 4);
+		bench_report("dedup", param);
+	}
+	DEDUP = dedup;
 
-	// free up any allocated memory
-	free(child);
-	free(parent);
-	free(ptr_to_child);
-	free(MBR_memory);
-	free(FAT_memory);
-	free(DATA_memory);
-}
+	// sparse_write: 4 KB of the log every 1 MB of a 24 MB file, which leaves holes between the
+	// writes; allocated is what the 32 MB disk takes on the host afterwards
+	format(512, 8, 8192);
+	int fh = fs_create(0, "sparse", 0);
+	bench_reset(24);
+	for (i = 0; i < 24; i++) {
+		uint64_t start = now_ns();
+		fs_write(fh, log + i * 4096, 4096, i * 1024 * 1024);
+		bench_samples[bench_count++] = now_ns() - start;
+	}
+	fs_sync();
+	struct stat st;
+	stat(DISK_NAME, &st);
+	sprintf(param, "allocated_kb=%lld", (long long)st.st_blocks / 2);
+	bench_report("sparse_write", param);
 
+	// sendfile: the 4 MB log copied out to a host file 1 MB at a time, through fs_read and write
+	// or with fs_sendfile
+	int send_bytes = 1024 * 1024;
+	char *copy = (char *)malloc(send_bytes);
+	format(512, 8, 8192);
+	fh = fs_create(0, "log", 0);
+	for (at = 0; at < file_bytes; at += io_bytes) fs_write(fh, log + at, io_bytes, at);
+	for (n = 0; n < 2; n++) {
+		bench_reset(8 * file_bytes / send_bytes);
+		for (i = 0; i < 8; i++) {
+			int out = open("bench.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			for (at = 0; at < file_bytes; at += send_bytes) {
+				uint64_t start = now_ns();
+				if (n) fs_sendfile(fh, out, at, send_bytes);
+				else if (write(out, copy, fs_read(fh, copy, send_bytes, at)) != send_bytes) printf("bench: write to bench.out failed\n");
+				bench_samples[bench_count++] = now_ns() - start;
+			}
+			close(out);
+		}
+		bench_report("sendfile", n ? "zero_copy=1" : "zero_copy=0");
+	}
+	unlink("bench.out");
+	free(copy);
 
-// open a directory with the absolute path name
-int fs_opendir(char *absolute_path) {
-	load_disk(DISK_NAME);
+	// writeback: 8 files of 512 KB written 4 KB at a time in turn, then sent out to count the runs of
+	// neighbouring clusters they ended up in, with every write going to the disk at once and with
+	// delayed allocation; then 64 temp files of 64 KB each written and removed, counting the
+	// clusters written to the disk for them
+	int writeback = WRITEBACK;
+	for (n = 0; n < 2; n++) {
+		WRITEBACK = n;
+		format(512, 8, 8192);
+		int files[8];
+		for (i = 0; i < 8; i++) {
+			char name[16];
+			sprintf(name, "w%d", i);
+			files[i] = fs_create(0, name, 0);
+		}
+		bench_reset(8 * copy_bytes / 4096);
+		for (at = 0; at < copy_bytes; at += 4096) {
+			for (i = 0; i < 8; i++) {
+				uint64_t start = now_ns();
+				fs_write(files[i], log + i * copy_bytes + at, 4096, at);
+				bench_samples[bench_count++] = now_ns() - start;
+			}
+		}
+		fs_sync();
+		fs_stats_t before = fs_stats();
+		int out = open("bench.out", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		for (i = 0; i < 8; i++) fs_sendfile(files[i], out, 0, copy_bytes);
+		close(out);
+		unlink("bench.out");
+		fs_stats_t after = fs_stats();
+		sprintf(param, "writeback=%d extents=%llu", n, (unsigned long long)(after.send_extents - before.send_extents));
+		bench_report("writeback_interleaved", param);
 
-	// while parsing the path given by absolute_path, add each directory name to a linked list
-	node_t *root = NULL; // head pointer/root of linked list of directories in the path
-	char *token; // each token is a directory
-	//printf("absolute path: %s\n", absolute_path);
-	// check that path isn't empty
-	if (strlen(absolute_path) == 0) {
-		return -1;
-	}
-	token = strtok(absolute_path, "/");
-	// if root is not first directory given in path, then return -1
-	if (strcmp(token, "root") != 0) {
-		return -1;
+		before = fs_stats();
+		bench_reset(64);
+		for (i = 0; i < 64; i++) {
+			uint64_t start = now_ns();
+			int fh = fs_create(0, "temp", 0);
+			for (at = 0; at < io_bytes; at += 4096) fs_write(fh, log + at, 4096, at);
+			fs_unlink(0, "temp");
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		fs_reclaim_wait();
+		after = fs_stats();
+		sprintf(param, "writeback=%d cluster_writes=%llu", n, (unsigned long long)(after.cluster_writes - before.cluster_writes));
+		bench_report("writeback_temp", param);
 	}
-	// start building the list, that will be checked farther down
-	insert(&root, token);
-	while (token != NULL) {
-		//printf("%s\n", token);
-		token = strtok(NULL, "/");
-		insert(&root, token);
+	WRITEBACK = writeback;
+
+	// lookups during a defrag: opendir of a directory two levels down every 50 us while another
+	// thread defragments the disk in the background, first with fs_lock taken first come, first served
+	// and then with the scheduler putting the lookups ahead
+	int sched = IO_SCHED;
+	for (n = 0; n < 2; n++) {
+		IO_SCHED = n;
+		format(512, 1, 8192);
+		char name[16];
+		for (i = 0; i < 8; i++) {
+			sprintf(name, "a%d", i);
+			fs_mkdir(0, name);
+		}
+		fs_mkdir(fs_opendir(strcpy(name, "root/a3")), "b");
+		bench_scatter();
+		bench_stop = 0;
+		bench_defrag_passes = 0;
+		pthread_t worker;
+		pthread_create(&worker, NULL, bench_defrag_worker, NULL);
+		bench_reset(BENCH_REPEAT * 10);
+		for (i = 0; i < BENCH_REPEAT * 10; i++) {
+			strcpy(name, "root/a3/b");
+			uint64_t start = now_ns();
+			if (fs_opendir(name) == -1) printf("bench: root/a3/b not found\n");
+			bench_samples[bench_count++] = now_ns() - start;
+			usleep(50); // lookups come in spread out, the worker runs in between
+		}
+		__atomic_store_n(&bench_stop, 1, __ATOMIC_RELEASE);
+		pthread_join(worker, NULL);
+		sprintf(param, "sched=%d defrag_passes=%d", n, bench_defrag_passes);
+		bench_report("lookup_during_defrag", param);
 	}
-	//print(&root);
+	IO_SCHED = sched;
 
-	// start checking the linked list of directories
-	if (get_length(&root) == 0) return -1; // this condition shouldn't ever pass, but inserted just in case
-	if (get_length(&root) == 1) return 0; // if length of list of directories is 1, then only directory is "root"
-	else {
-		int dh_next;
-		int dh_current = 0; // the cluster that the current directory is held
-		char *dir_current = "root"; // current directory
-		char *dir_next = get_next_dir(&root, dir_current); // next directory in the path
-		int i;
-		int path_length = get_length(&root);
-		for (i=0; i<path_length-1; i++) {
-			int child_num = 0; 
-			//printf("current and next dir = %s, %s\n", dir_current, dir_next);
-			
-			//while (child_num < 10) {
-			while(1) {
-				//printf("child_num = %d\n", child_num);
-				entry_t *child = fs_ls(dh_current, child_num);
-				// no child present, or no child matches the directory being searched for, return -1
-				if (child == NULL) {
-					//printf("child returned was NULL\n");
-					empty_list(&root);
-					free(MBR_memory);
-					free(FAT_memory);
-					free(DATA_memory);
-					return -1;
-				}
-				int cluster_size_bytes = MBR_memory->sector_size * MBR_memory->cluster_size;
-				// child found with matching name
-				if (strcmp(child->name, dir_next) == 0) {
-					int dh_p1, dh_p2;
-					//printf("dh_current, csb, child_num %d %d %d\n", dh_current, cluster_size_bytes, child_num);
-					// pull the pointer location of the child from the data that is in memory
-					dh_p1 = DATA_memory[htons(dh_current) * cluster_size_bytes + sizeof(entry_t) + child_num * sizeof(entry_ptr_t) + 2];
-					dh_p2 = DATA_memory[htons(dh_current) * cluster_size_bytes + sizeof(entry_t) + child_num * sizeof(entry_ptr_t) + 3];
-					dh_next = (dh_p1 << 8) + dh_p2;
-					dh_current = dh_next; // update
-					//printf("child name, dh %s %d\n", child->name, htons(dh_current));
-					break;
-				}
-				child_num++;
+	// shared mount: 1, 2 and 4 processes each make 100 directories in root at the same time, then
+	// the directories found and the problems fsck finds are counted; the latencies are collected
+	// in memory shared with the processes
+	int shared_counts[] = { 1, 2, 4 };
+	uint64_t *shared_samples = (uint64_t *)mmap(NULL, sizeof(uint64_t) * 4 * 100, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	for (n = 0; n < 3; n++) {
+		format(512, 8, 4096);
+		fs_sync();
+		fs_reclaim_wait();
+		SHARED_MOUNT = 1;
+		fflush(stdout);
+		int p;
+		for (p = 0; p < shared_counts[n]; p++) {
+			if (fork() != 0) continue;
+			for (i = 0; i < 100; i++) {
+				char name[16];
+				sprintf(name, "p%d_%d", p, i);
+				uint64_t start = now_ns();
+				fs_mkdir(0, name);
+				shared_samples[p * 100 + i] = now_ns() - start;
 			}
+			shm_detach();
+			_exit(0);
+		}
+		while (wait(NULL) > 0);
+		du_t du;
+		fs_du(0, &du, 1);
+		int problems = fs_fsck(0, 1);
+		shm_detach();
+		bench_reset(shared_counts[n] * 100);
+		for (i = 0; i < shared_counts[n] * 100; i++) bench_samples[bench_count++] = shared_samples[i];
+		sprintf(param, "processes=%d directories=%d problems=%d", shared_counts[n], (int)du.directories, problems);
+		bench_report("shared_mkdir", param);
+	}
+	munmap(shared_samples, sizeof(uint64_t) * 4 * 100);
 
-			dir_current = dir_next; // update current directory
-			dir_next = get_next_dir(&root, dir_current); // find the next directory in path 
-		
+	// server: 1 to 256 clients on their own connections to fsd in this process, 8 requests in
+	// flight each, and 16 clients with one at a time; the disk is formatted again for each run
+	int fsd_clients[] = { 1, 4, 16, 64, 256, 16 };
+	int fsd_depths[] = { FSD_DEPTH, FSD_DEPTH, FSD_DEPTH, FSD_DEPTH, FSD_DEPTH, 1 };
+	if (fsd_start(FSD_SOCKET, 4) == 0) {
+		for (n = 0; n < 6; n++) {
+			format(512, 8, 8192);
+			int failed = fsd_load(fsd_clients[n], 16384 / fsd_clients[n] > 64 ? 16384 / fsd_clients[n] : 64, fsd_depths[n]);
+			sprintf(param, "clients=%d depth=%d failed=%d", fsd_clients[n], fsd_depths[n], failed);
+			bench_report("fsd", param);
 		}
-		empty_list(&root);
-		free(MBR_memory);
-		free(FAT_memory);
-		free(DATA_memory);
-		//printf("dh_current %d %d\n", dh_current, htons(dh_current));	
-		return htons(dh_current);
+		fsd_stop(FSD_SOCKET);
 	}
 
-	empty_list(&root);	
-	free(MBR_memory);
-	free(FAT_memory);
-	free(DATA_memory);
-	return -1;
+	// walk: fs_du and fs_find over a tree 8 wide, directories three levels down and files on the
+	// fourth, with 1 to 8 threads; the 16-bit FAT caps a tree at 65535 clusters, and the names differ
+	// from level to level since fs_opendir can't resolve a path naming the same directory twice
+	format(512, 1, 4720);
+	char tree_path[64];
+	int a, b, c, nodes = 0;
+	for (a = 0; a < 8; a++) {
+		sprintf(tree_path, "a%d", a);
+		fs_mkdir(0, tree_path);
+		for (b = 0; b < 8; b++) {
+			sprintf(tree_path, "root/a%d", a);
+			int dh_a = fs_opendir(tree_path);
+			sprintf(tree_path, "b%d", b);
+			fs_mkdir(dh_a, tree_path);
+			sprintf(tree_path, "root/a%d/b%d", a, b);
+			int dh_b = fs_opendir(tree_path);
+			for (c = 0; c < 8; c++) {
+				char name[16];
+				sprintf(name, "c%d", c);
+				fs_mkdir(dh_b, name);
+				sprintf(tree_path, "root/a%d/b%d/c%d", a, b, c);
+				int dh_c = fs_opendir(tree_path);
+				for (i = 0; i < 8; i++) {
+					sprintf(name, "f%d", i);
+					fs_create(dh_c, name, 0);
+				}
+			}
+		}
+	}
+	int walk_threads_n[] = { 1, 2, 4, 8 };
+	for (n = 0; n < 4; n++) {
+		du_t du;
+		bench_reset(BENCH_REPEAT / 10);
+		for (i = 0; i < BENCH_REPEAT / 10; i++) {
+			uint64_t start = now_ns();
+			fs_du(0, &du, walk_threads_n[n]);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		nodes = du.files + du.directories;
+		sprintf(param, "threads=%d nodes=%d", walk_threads_n[n], nodes);
+		bench_report("walk_du", param);
+	}
+	int *found = (int *)malloc(sizeof(int) * nodes);
+	for (n = 0; n < 4; n++) {
+		bench_reset(BENCH_REPEAT / 10);
+		int matches = 0;
+		for (i = 0; i < BENCH_REPEAT / 10; i++) {
+			uint64_t start = now_ns();
+			matches = fs_find(0, "f7", found, nodes, walk_threads_n[n]);
+			bench_samples[bench_count++] = now_ns() - start;
+		}
+		sprintf(param, "threads=%d matches=%d", walk_threads_n[n], matches);
+		bench_report("walk_find", param);
+	}
+	free(found);
+	free(log);
+	free(back);
+	free(bench_samples);
+	bench_samples = NULL;
 }
+// **************** end benchmark functions *****************//
 
 void print_disk() {
 	int disk_size_bytes = 640;
@@ -475,7 +7756,196 @@ void print_disk() {
 	}
 }	
 
+// report memory footprint and disk throughput of the run, to compare buffered and direct mode
+void print_usage(struct timeval *start) {
+	struct timeval end;
+	struct rusage usage;
+	gettimeofday(&end, NULL);
+	getrusage(RUSAGE_SELF, &usage);
+	double elapsed = (end.tv_sec - start->tv_sec) + (end.tv_usec - start->tv_usec) / 1e6;
+	fs_stats_t stats = fs_stats();
+	uint64_t moved = stats.bytes_read + stats.bytes_written;
+	fprintf(stderr, "%s mode: %.6f s, max rss %ld KB, block cache %zu KB, %llu bytes read, %llu bytes written, %.2f MB/s, %llu allocations\n",
+		DIRECT_IO ? "direct" : "buffered", elapsed, usage.ru_maxrss, block_bytes * cache_slots / 1024,
+		(unsigned long long)stats.bytes_read, (unsigned long long)stats.bytes_written,
+		elapsed > 0 ? moved / elapsed / (1024 * 1024) : 0.0, (unsigned long long)alloc_count);
+}
+
 int main(int argc, char *argv[]) {
+	// --direct: bypass the kernel page cache, --measure: report footprint and throughput
+	// --stats: dump the counters from fs_stats(), --trace file: write a Chrome trace (needs -DFS_TRACE)
+	// --bench: run the benchmark scenarios instead of the demo and print CSV
+	// --fsck [--repair] [--threads n]: check FileSystem.bin instead of running the demo
+	// --defrag [--slice us]: defragment FileSystem.bin in slices of the given length
+	// --snapshot name, --snapshot-delete name, --snapshots: take, delete or list snapshots of FileSystem.bin
+	// --checksums: format the demo and bench disks with a CRC32C per cluster
+	// --stripes n [--stripe-unit clusters]: format them with the data area striped across n files
+	// --dedup [--slice us]: share the clusters files of FileSystem.bin have in common
+	// --du path, --find pattern [--threads n]: total up a directory of FileSystem.bin, or find names matching a pattern
+	// --migrate: update FileSystem.bin to the current on-disk format
+	// --space: print the free space of FileSystem.bin
+	// --write-through: write every fs_write to the disk at once instead of buffering it
+	// --no-sched: let background work take fs_lock as soon as it is free, like foreground work
+	// --shared: mount FileSystem.bin together with the other processes using it, see the shared mount functions
+	// --serve [--threads n]: run as fsd, serving FileSystem.bin on fsd.sock until SIGINT or SIGTERM
+	// --load clients [--depth n]: drive the fsd on fsd.sock with that many clients and print CSV
+	int measure = 0;
+	int stats = 0;
+	char *trace_path = NULL;
+	int run_bench = 0;
+	int run_fsck = 0;
+	int repair = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int run_defrag = 0;
+	int run_dedup = 0;
+	int run_migrate = 0;
+	int run_space = 0;
+	int slice_us = 1000;
+	char *du_path = NULL;
+	char *find_pattern = NULL;
+	char *snapshot_name = NULL;
+	char *snapshot_delete = NULL;
+	int list_snapshots = 0;
+	int serve = 0;
+	int load_clients = 0;
+	int load_depth = FSD_DEPTH;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--direct") == 0) DIRECT_IO = 1;
+		else if (strcmp(argv[i], "--measure") == 0) measure = 1;
+		else if (strcmp(argv[i], "--stats") == 0) stats = 1;
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) trace_path = argv[++i];
+		else if (strcmp(argv[i], "--bench") == 0) run_bench = 1;
+		else if (strcmp(argv[i], "--fsck") == 0) run_fsck = 1;
+		else if (strcmp(argv[i], "--repair") == 0) repair = 1;
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) nthreads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--defrag") == 0) run_defrag = 1;
+		else if (strcmp(argv[i], "--dedup") == 0) run_dedup = 1;
+		else if (strcmp(argv[i], "--migrate") == 0) run_migrate = 1;
+		else if (strcmp(argv[i], "--space") == 0) run_space = 1;
+		else if (strcmp(argv[i], "--slice") == 0 && i + 1 < argc) slice_us = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--du") == 0 && i + 1 < argc) du_path = argv[++i];
+		else if (strcmp(argv[i], "--find") == 0 && i + 1 < argc) find_pattern = argv[++i];
+		else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) snapshot_name = argv[++i];
+		else if (strcmp(argv[i], "--snapshot-delete") == 0 && i + 1 < argc) snapshot_delete = argv[++i];
+		else if (strcmp(argv[i], "--snapshots") == 0) list_snapshots = 1;
+		else if (strcmp(argv[i], "--checksums") == 0) CHECKSUMS = 1;
+		else if (strcmp(argv[i], "--stripes") == 0 && i + 1 < argc) STRIPES = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--stripe-unit") == 0 && i + 1 < argc) STRIPE_UNIT = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--write-through") == 0) WRITEBACK = 0;
+		else if (strcmp(argv[i], "--no-sched") == 0) IO_SCHED = 0;
+		else if (strcmp(argv[i], "--shared") == 0) SHARED_MOUNT = 1;
+		else if (strcmp(argv[i], "--serve") == 0) serve = 1;
+		else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) load_clients = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) load_depth = atoi(argv[++i]);
+	}
+	if (serve) {
+		// the workers are started with the signals blocked, so only this thread takes them
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+		if (fsd_start(FSD_SOCKET, nthreads) != 0) return 1;
+		printf("fsd: serving %s on %s with %d threads\n", DISK_NAME, FSD_SOCKET, fsd_nthreads);
+		fflush(stdout);
+		int signal;
+		sigwait(&signals, &signal);
+		fsd_stop(FSD_SOCKET);
+		fs_sync();
+		fs_reclaim_wait();
+		if (stats) {
+			fs_stats_t total = fs_stats();
+			print_stats(&total);
+		}
+		return 0;
+	}
+	if (load_clients > 0) {
+		if (load_depth < 1) load_depth = 1;
+		int failed = fsd_load(load_clients, 16384 / load_clients > 64 ? 16384 / load_clients : 64, load_depth);
+		char param[64];
+		sprintf(param, "clients=%d depth=%d failed=%d", load_clients, load_depth, failed);
+		printf("scenario,param,mode,ops,ops_per_sec,p50_ns,p99_ns\n");
+		bench_report("fsd", param);
+		return failed > 0;
+	}
+	if (run_migrate) {
+		return fs_migrate() == -1;
+	}
+	if (run_space) {
+		space_t space;
+		if (fs_space(&space) == -1) return 1;
+		printf("space: %d of %d clusters free, the longest free run is %d clusters", space.free, space.clusters, space.largest_length);
+		if (space.largest_start != -1) printf(" from cluster %d", space.largest_start);
+		printf(", %d allocation groups\n", space.groups);
+		return 0;
+	}
+	if (snapshot_name != NULL || snapshot_delete != NULL || list_snapshots) {
+		int result = 0;
+		if (snapshot_name != NULL && fs_snapshot(snapshot_name) == -1) {
+			printf("snapshot: can't take snapshot %s\n", snapshot_name);
+			result = 1;
+		}
+		if (snapshot_delete != NULL && fs_snapshot_delete(snapshot_delete) == -1) {
+			printf("snapshot: no snapshot called %s\n", snapshot_delete);
+			result = 1;
+		}
+		fs_reclaim_wait();
+		snapshot_t snapshot;
+		for (i = 0; list_snapshots && fs_snapshot_ls(i, &snapshot) == 0; i++) {
+			printf("%.16s: root cluster %d, generation %d\n", snapshot.name, snapshot.root, snapshot.generation);
+		}
+		return result;
+	}
+	if (run_defrag) {
+		defrag_report("before");
+		int slices = 1;
+		while (fs_defrag((uint64_t)slice_us * 1000) > 0) slices++;
+		printf("defrag: done in %d slices of %d us\n", slices, slice_us);
+		defrag_report("after");
+		return 0;
+	}
+	if (run_dedup) {
+		int slices = 1;
+		while (fs_dedup((uint64_t)slice_us * 1000) > 0) slices++;
+		fs_reclaim_wait();
+		fs_stats_t total = fs_stats();
+		printf("dedup: %llu clusters shared in %d slices of %d us, %llu clusters hashed\n", (unsigned long long)total.clusters_deduped,
+			slices, slice_us, (unsigned long long)total.dedup_hashed);
+		return 0;
+	}
+	if (nthreads < 1) nthreads = 1;
+	if (du_path != NULL) {
+		du_t du;
+		int dh = fs_opendir(du_path);
+		if (dh == -1 || fs_du(dh, &du, nthreads) == -1) {
+			printf("du: no directory %s\n", du_path);
+			return 1;
+		}
+		printf("du: %llu files, %llu directories, %llu bytes in %llu clusters\n", (unsigned long long)du.files,
+			(unsigned long long)du.directories, (unsigned long long)du.bytes, (unsigned long long)du.clusters);
+		return 0;
+	}
+	if (find_pattern != NULL) {
+		char root[] = "root";
+		int entries = fs_walk(fs_opendir(root), find_print, find_pattern, nthreads);
+		printf("find: %d entries searched with %d threads\n", entries, nthreads);
+		return entries == -1;
+	}
+	if (run_fsck) {
+		struct timeval fsck_start;
+		gettimeofday(&fsck_start, NULL);
+		int problems = fs_fsck(repair, nthreads);
+		if (problems != -1) printf("fsck: %d problems found with %d threads\n", problems, nthreads);
+		if (measure) print_usage(&fsck_start);
+		return problems == 0 ? 0 : 1;
+	}
+	if (run_bench) {
+		bench();
+		return 0;
+	}
+	struct timeval start;
+	gettimeofday(&start, NULL);
 	
 	format(64, 1, 10);
 	char path[] = "root/";
@@ -505,6 +7975,19 @@ int main(int argc, char *argv[]) {
 	printf("opendir root/help %d\n", dh);
 	fs_mkdir(dh, "fsa"); 
 	fs_mkdir(dh, "abcdefghijklmnopqrstuv");
+	fs_reclaim_wait();
 	print_disk();
+	if (measure) print_usage(&start);
+	if (stats) {
+		fs_stats_t totals = fs_stats();
+		print_stats(&totals);
+	}
+	if (trace_path != NULL) {
+#ifdef FS_TRACE
+		trace_dump(trace_path);
+#else
+		printf("--trace: rebuild with -DFS_TRACE to record trace events\n");
+#endif
+	}
 	return 0;
 }
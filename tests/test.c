@@ -0,0 +1,242 @@
+// tests of the file system, built by make test with hw4.c included so they can reach its internals
+// each test formats a fresh FileSystem.bin in the current directory; --direct runs them in direct mode
+#define main hw4_main
+#include "../hw4.c"
+#undef main
+
+#define TEST_SOCKET "test.sock"
+
+int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: %s failed\n", __func__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+// fs_opendir and fs_rename split the paths they are given in place, so literals are copied first
+int opendir_path(const char *path) {
+	char copy[256];
+	strcpy(copy, path);
+	return fs_opendir(copy);
+}
+
+int rename_path(const char *old_path, const char *new_path) {
+	char old_copy[256], new_copy[256];
+	strcpy(old_copy, old_path);
+	strcpy(new_copy, new_path);
+	return fs_rename(old_copy, new_copy);
+}
+
+// make the directory at path and return its handle, -1 if it wasn't made
+int mkdir_path(const char *path) {
+	char parent[256];
+	strcpy(parent, path);
+	char *name = strrchr(parent, '/');
+	*name++ = '\0';
+	if (fs_mkdir(opendir_path(parent), name) == -1) return -1;
+	return opendir_path(path);
+}
+
+// once the slab pools and the arena are warm, a lookup or a mkdir doesn't reach malloc
+void test_alloc() {
+	format(512, 1, 3000);
+	mkdir_path("root/a");
+	int b = mkdir_path("root/a/b");
+	CHECK(mkdir_path("root/a/b/warm") != -1);
+	CHECK(fs_mkdir(b, "c") == 0);
+	// more than a slab chunk of objects, so one that isn't given back runs the pool dry
+	uint64_t before = alloc_count;
+	char name[16];
+	int i;
+	for (i = 0; i < 4 * SLAB_OBJECTS; i++) {
+		CHECK(opendir_path("root/a/b") == b);
+		CHECK(opendir_path("root/a/b/warm") != -1);
+		CHECK(opendir_path("root/a/missing") == -1);
+	}
+	CHECK(alloc_count == before);
+	before = alloc_count;
+	for (i = 0; i < 4 * SLAB_OBJECTS; i++) {
+		sprintf(name, "d%d", i);
+		CHECK(fs_mkdir(b, name) == 0);
+	}
+	CHECK(fs_mkdir(b, "a_name_too_long_to_fit") == -1);
+	CHECK(alloc_count == before);
+	entry_t *child = fs_ls(b, 0);
+	CHECK(child != NULL);
+	slab_free(&entry_slab, child);
+}
+
+// a directory moved to another parent keeps what is below it and is gone from its old parent
+void test_rename() {
+	format(512, 1, 3000);
+	int a = mkdir_path("root/a");
+	mkdir_path("root/b");
+	mkdir_path("root/a/x");
+	mkdir_path("root/a/x/inside");
+	CHECK(rename_path("root/a/x", "root/b/y") == 0);
+	CHECK(opendir_path("root/a/x") == -1);
+	CHECK(opendir_path("root/b/y") != -1);
+	CHECK(opendir_path("root/b/y/inside") != -1);
+	CHECK(fs_ls(a, 0) == NULL);
+	// onto an existing name and below itself are refused
+	mkdir_path("root/c");
+	CHECK(rename_path("root/c", "root/b/y") == -1);
+	CHECK(rename_path("root/b", "root/b/y/b") == -1);
+	CHECK(fs_fsck(0, 2) == 0);
+}
+
+// the clusters of a removed tree are reclaimed without leaking any or freeing one still in use
+void test_rmdir() {
+	format(512, 1, 3000);
+	int root = opendir_path("root");
+	int gone = mkdir_path("root/gone");
+	mkdir_path("root/kept");
+	char name[16], path[32];
+	int i;
+	for (i = 0; i < 40; i++) {
+		sprintf(name, "d%d", i);
+		CHECK(fs_mkdir(gone, name) == 0);
+		sprintf(path, "root/gone/%s", name);
+		int d = opendir_path(path);
+		CHECK(fs_mkdir(d, "sub") == 0);
+		int fh = fs_create(d, "f", 0);
+		CHECK(fs_write(fh, name, strlen(name), 0) == (int)strlen(name));
+	}
+	int fh = fs_create(root, "file", 0);
+	// neither a file nor a missing child is a directory to remove from
+	CHECK(fs_rmdir(fh, "x") == -1);
+	CHECK(fs_rmdir(root, "missing") == -1);
+	CHECK(fs_rmdir(root, "gone") == 0);
+	CHECK(opendir_path("root/gone") == -1);
+	fs_reclaim_wait();
+	CHECK(fs_fsck(0, 2) == 0);
+	CHECK(opendir_path("root/kept") != -1);
+}
+
+// a sparse file reads its holes as zeros and seek_data and seek_hole step between the runs
+void test_seek() {
+	format(512, 1, 3000);
+	int root = opendir_path("root");
+	int fh = fs_create(root, "sparse", FILE_SPARSE);
+	int cluster = 512;
+	uint8_t data[512], back[512];
+	memset(data, 'd', sizeof(data));
+	CHECK(fs_write(fh, data, cluster, 0) == cluster);
+	CHECK(fs_write(fh, data, cluster, 10 * cluster) == cluster);
+	CHECK(fs_seek_data(fh, 0) == 0);
+	CHECK(fs_seek_hole(fh, 0) == cluster);
+	CHECK(fs_seek_data(fh, cluster) == 10 * cluster);
+	CHECK(fs_seek_data(fh, 5 * cluster + 7) == 10 * cluster);
+	CHECK(fs_seek_hole(fh, 10 * cluster) == 11 * cluster);
+	CHECK(fs_seek_data(fh, 11 * cluster) == -1);
+	CHECK(fs_read(fh, back, cluster, 4 * cluster) == cluster);
+	uint8_t zeros[512];
+	memset(zeros, 0, sizeof(zeros));
+	CHECK(memcmp(back, zeros, cluster) == 0);
+	CHECK(fs_read(fh, back, cluster, 10 * cluster) == cluster);
+	CHECK(memcmp(back, data, cluster) == 0);
+	CHECK(fs_fsck(0, 1) == 0);
+}
+
+// an image turned back into version 0, unversioned with big-endian timestamps, migrates to
+// the one it came from
+void test_migrate() {
+	format(512, 1, 3000);
+	int root = opendir_path("root");
+	int a = mkdir_path("root/a");
+	int b = mkdir_path("root/a/b");
+	int fh = fs_create(a, "f", 0);
+	CHECK(fs_write(fh, "data", 4, 0) == 4);
+	entry_t *before = fs_ls(a, 0);
+	CHECK(before != NULL);
+	fs_sync();
+	fs_reclaim_wait();
+	int entries[] = { root, a, b, fh };
+	int fd = open(DISK_NAME, O_RDWR);
+	CHECK(fd != -1);
+	if (fd == -1) return;
+	int i;
+	for (i = 0; i < 4; i++) {
+		entry_t entry;
+		off_t at = cluster_offset(handle_cluster(entries[i]));
+		CHECK(pread(fd, &entry, sizeof(entry), at) == sizeof(entry));
+		entry.creation_date = __builtin_bswap16(entry.creation_date);
+		entry.creation_time = __builtin_bswap16(entry.creation_time);
+		CHECK(pwrite(fd, &entry, sizeof(entry), at) == sizeof(entry));
+	}
+	mbr_t mbr;
+	CHECK(pread(fd, &mbr, sizeof(mbr), 0) == sizeof(mbr));
+	mbr.magic = 0;
+	mbr.version = 0;
+	mbr.free_count = 0;
+	mbr.generation = 0;
+	CHECK(pwrite(fd, &mbr, sizeof(mbr), 0) == sizeof(mbr));
+	close(fd);
+	// the block cache still holds the blocks as they were before
+	if (cache != NULL) cache_free();
+	CHECK(opendir_path("root/a") == -1);
+	CHECK(fs_migrate() == 4);
+	entry_t *after = fs_ls(opendir_path("root/a"), 0);
+	CHECK(after != NULL);
+	if (before != NULL && after != NULL) {
+		CHECK(after->creation_date == before->creation_date);
+		CHECK(after->creation_time == before->creation_time);
+	}
+	slab_free(&entry_slab, before);
+	slab_free(&entry_slab, after);
+	CHECK(fs_migrate() == 0);
+	CHECK(fs_fsck(0, 1) == 0);
+}
+
+// requests pipelined over the server socket come back in order with the results the fs_
+// operations give
+void test_fsd() {
+	format(512, 1, 3000);
+	CHECK(fsd_start(TEST_SOCKET, 2) == 0);
+	int fd = fsd_connect(TEST_SOCKET);
+	CHECK(fd != -1);
+	if (fd == -1) {
+		fsd_stop(TEST_SOCKET);
+		return;
+	}
+	uint8_t *buf = (uint8_t *)malloc(2 * (sizeof(fsd_request_t) + 4096));
+	uint8_t *reply = (uint8_t *)malloc(FSD_MAX_LENGTH);
+	uint8_t data[4096];
+	int i;
+	for (i = 0; i < (int)sizeof(data); i++) data[i] = i * 7;
+	size_t used = fsd_pack(buf, 0, FSD_MKDIR, 0, 0, 0, 0, "d", 1);
+	used = fsd_pack(buf, used, FSD_OPENDIR, 1, 0, 0, 0, "root/d", 6);
+	int dh = fsd_roundtrip(fd, buf, used, 2, reply, NULL);
+	CHECK(dh != -1 && dh == opendir_path("root/d"));
+	used = fsd_pack(buf, 0, FSD_CREATE, 0, dh, 0, 0, "f", 1);
+	int fh = fsd_roundtrip(fd, buf, used, 1, reply, NULL);
+	CHECK(fh != -1);
+	used = fsd_pack(buf, 0, FSD_WRITE, 0, fh, 0, 0, data, sizeof(data));
+	used = fsd_pack(buf, used, FSD_READ, 1, fh, 0, sizeof(data), NULL, 0);
+	CHECK(fsd_roundtrip(fd, buf, used, 2, reply, NULL) == sizeof(data));
+	CHECK(memcmp(reply, data, sizeof(data)) == 0);
+	used = fsd_pack(buf, 0, FSD_READDIR, 0, dh, 0, 16, NULL, 0);
+	CHECK(fsd_roundtrip(fd, buf, used, 1, reply, NULL) == 1);
+	CHECK(strcmp(((entry_t *)reply)->name, "f") == 0);
+	used = fsd_pack(buf, 0, FSD_OPENDIR, 0, 0, 0, 0, "root/missing", 12);
+	CHECK(fsd_roundtrip(fd, buf, used, 1, reply, NULL) == -1);
+	close(fd);
+	free(buf);
+	free(reply);
+	fsd_stop(TEST_SOCKET);
+	CHECK(fs_fsck(0, 1) == 0);
+}
+
+int main(int argc, char **argv) {
+	if (argc > 1 && strcmp(argv[1], "--direct") == 0) DIRECT_IO = 1;
+	test_alloc();
+	test_rename();
+	test_rmdir();
+	test_seek();
+	test_migrate();
+	test_fsd();
+	printf("%s mode: %s\n", DIRECT_IO ? "direct" : "buffered", failures == 0 ? "all tests passed" : "tests failed");
+	return failures > 0;
+}